@@ -19,18 +19,34 @@ else if( !empty( $_POST['q'] ) )
 $type ='web';
 if( !empty( $_POST['type'] ) )
     $type =$_POST['type'];
+else if( !empty( $_GET['type'] ) )
+    $type =$_GET['type'];
+if( $type != 'images' )
+    $type ='web';
 if( isset( $_GET['color'] ) )
         $type ="color";
 
-// Write the query terms to a local file to minimize security problems
-$handle  = fopen("../zoekmuis/queryterms.txt","w");
-fwrite($handle,$myquery);
-fclose($handle);
-
-$commandstring = "(cd ../zoekmuis && ./webquery --$type)";
-
-//Using backticks one way for PHP to call an external program and return the output
-$myoutput =`$commandstring`;
+// The links to the other pages of the results pass the page number
+$page =0;
+if( !empty( $_GET['page'] ) )
+    $page =max( 0, intval( $_GET['page'] ) );
+
+// Ask webqueryd if it is running, it keeps the index open between queries
+$myoutput =false;
+$sock =@fsockopen( "unix://../zoekmuis/webqueryd.sock" );
+if( $sock ) {
+    fwrite( $sock, "$type $page " . str_replace( array( "\r", "\n" ), ' ', $myquery ) . "\n" );
+    $myoutput =stream_get_contents( $sock );
+    fclose( $sock );
+}
+
+if( $myoutput === false ) {
+    // Every request passes its own query, a shared file would mix up concurrent ones
+    $commandstring = "(cd ../zoekmuis && ./webquery --$type --page $page --query " . escapeshellarg( $myquery ) . ")";
+
+    //Using backticks one way for PHP to call an external program and return the output
+    $myoutput =`$commandstring`;
+}
 
 echo $myoutput;
 ?>
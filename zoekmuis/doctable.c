@@ -0,0 +1,379 @@
+/*
+ * Websearch - doctable.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Memory mapped table of document metadata
+ */
+
+#define _GNU_SOURCE
+#include "doctable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define DOCTABLE_DOCS DOCTABLE_PATH "docs"
+#define DOCTABLE_STRINGS DOCTABLE_PATH "strings"
+#define DOCTABLE_IDS DOCTABLE_PATH "ids"
+#define DOCTABLE_IDS_TMP DOCTABLE_PATH "ids.tmp"
+
+static inline uint64_t
+slot_hash( docid_t docid ) {
+    // DOCIDs are hashes already, just spread the high bits
+    return ( docid * 0x9e3779b97f4a7c15ull ) >> 17;
+}
+
+static void
+slots_insert( doctable_slot_t* slots, uint64_t capacity, uint64_t* count, docid_t docid, uint64_t ordinal ) {
+    uint64_t h =slot_hash( docid ) & (capacity-1);
+    while( slots[h].ordinal != 0 ) {
+        if( slots[h].docid == docid ) {
+            __atomic_store_n( &slots[h].ordinal, ordinal + 1, __ATOMIC_RELEASE );
+            return;
+        }
+        h =(h+1) & (capacity-1);
+    }
+    slots[h].docid =docid;
+    __atomic_store_n( &slots[h].ordinal, ordinal + 1, __ATOMIC_RELEASE );
+    (*count)++;
+}
+
+/* Host part of `url', hashed to 32 bits */
+static uint32_t
+host_id( const char* url, size_t len ) {
+    const char *end =url + len, *host =url;
+    for( const char *p =url; p+2 < end; p++ ) {
+        if( *p == '/' ) {
+            if( p > url && p[-1] == ':' && p[1] == '/' )
+                host =p+2;
+            break;
+        }
+    }
+    const char *p =host;
+    while( p < end && *p != '/' && *p != '?' && *p != '#' )
+        p++;
+    return (uint32_t)docid_make( host, p - host );
+}
+
+/* Map `ids' of `t', which has to be open */
+static int
+ids_map( doctable_t* t ) {
+    struct stat st;
+    if( fstat( t->idsfd, &st ) != 0 )
+        return -1;
+    int prot =t->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map =mmap( NULL, st.st_size, prot, MAP_SHARED, t->idsfd, 0 );
+    if( map == MAP_FAILED )
+        return -1;
+
+    doctable_idshdr_t *ids =map;
+    if( st.st_size < sizeof( doctable_idshdr_t ) || ids->magic != DOCTABLE_IDSMAGIC
+            || st.st_size != sizeof( doctable_idshdr_t ) + ids->capacity * sizeof( doctable_slot_t ) ) {
+        munmap( map, st.st_size );
+        errno =EINVAL;
+        return -1;
+    }
+    t->idsmap =map;
+    t->idslen =st.st_size;
+    t->ids =ids;
+    t->slots =(doctable_slot_t*)( ids + 1 );
+    return 0;
+}
+
+static int
+ids_create( int fd, uint64_t capacity ) {
+    doctable_idshdr_t hdr;
+    memset( &hdr, 0, sizeof( doctable_idshdr_t ) );
+    hdr.magic =DOCTABLE_IDSMAGIC;
+    hdr.capacity =capacity;
+    if( ftruncate( fd, sizeof( doctable_idshdr_t ) + capacity * sizeof( doctable_slot_t ) ) != 0
+            || pwrite( fd, &hdr, sizeof( doctable_idshdr_t ), 0 ) != sizeof( doctable_idshdr_t ) )
+        return -1;
+    return 0;
+}
+
+/* Double the capacity of `ids', replacing the file atomically */
+static int
+ids_grow( doctable_t* t ) {
+    int fd =open( DOCTABLE_IDS_TMP, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) goto err;
+    uint64_t capacity =t->ids->capacity * 2;
+    if( ids_create( fd, capacity ) != 0 )
+        goto err;
+
+    size_t len =sizeof( doctable_idshdr_t ) + capacity * sizeof( doctable_slot_t );
+    void *map =mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED ) goto err;
+    doctable_idshdr_t *ids =map;
+    doctable_slot_t *slots =(doctable_slot_t*)( ids + 1 );
+    for( uint64_t i =0; i < t->ids->capacity; i++ )
+        if( t->slots[i].ordinal )
+            slots_insert( slots, capacity, &ids->count, t->slots[i].docid, t->slots[i].ordinal - 1 );
+
+    if( rename( DOCTABLE_IDS_TMP, DOCTABLE_IDS ) != 0 ) {
+        munmap( map, len );
+        goto err;
+    }
+    munmap( t->idsmap, t->idslen );
+    close( t->idsfd );
+    t->idsfd =fd;
+    t->idsmap =map;
+    t->idslen =len;
+    t->ids =ids;
+    t->slots =slots;
+    return 0;
+
+err:
+    fprintf( stderr, "ids_grow(): %s\n", strerror( errno ) );
+    if( fd >= 0 ) close( fd );
+    unlink( DOCTABLE_IDS_TMP );
+    return -1;
+}
+
+static int
+docs_writeHeader( doctable_t* t ) {
+    if( pwrite( t->docsfd, &t->hdr, sizeof( doctable_hdr_t ), 0 ) != sizeof( doctable_hdr_t ) )
+        return -1;
+    return 0;
+}
+
+static int
+open_writable( doctable_t* t ) {
+    struct stat st;
+    if( mkdir( DOCTABLE_PATH, 0755 ) != 0 && errno != EEXIST )
+        return -1;
+
+    t->docsfd =open( DOCTABLE_DOCS, O_RDWR | O_CREAT, 0644 );
+    if( t->docsfd < 0 || flock( t->docsfd, LOCK_EX | LOCK_NB ) != 0 || fstat( t->docsfd, &st ) != 0 )
+        return -1;
+    if( st.st_size == 0 ) {
+        t->hdr.magic =DOCTABLE_MAGIC;
+        t->hdr.version =DOCTABLE_VERSION;
+        t->hdr.capacity =DOCTABLE_DOCS_INIT;
+        if( ftruncate( t->docsfd, sizeof( doctable_hdr_t ) + DOCTABLE_DOCS_INIT * sizeof( doctable_doc_t ) ) != 0
+                || docs_writeHeader( t ) != 0 )
+            return -1;
+    } else if( pread( t->docsfd, &t->hdr, sizeof( doctable_hdr_t ), 0 ) != sizeof( doctable_hdr_t )
+            || t->hdr.magic != DOCTABLE_MAGIC || t->hdr.version != DOCTABLE_VERSION ) {
+        errno =EINVAL;
+        return -1;
+    }
+
+    // Strings beyond the heap were written for an entry that never made it
+    t->stringsfd =open( DOCTABLE_STRINGS, O_RDWR | O_CREAT, 0644 );
+    if( t->stringsfd < 0 || ftruncate( t->stringsfd, t->hdr.heap ) != 0 )
+        return -1;
+
+    t->idsfd =open( DOCTABLE_IDS, O_RDWR | O_CREAT, 0644 );
+    if( t->idsfd < 0 || fstat( t->idsfd, &st ) != 0 )
+        return -1;
+    if( st.st_size == 0 && ids_create( t->idsfd, DOCTABLE_SLOTS_INIT ) != 0 )
+        return -1;
+    return ids_map( t );
+}
+
+static int
+open_readable( doctable_t* t ) {
+    struct stat st;
+    t->docsfd =open( DOCTABLE_DOCS, O_RDONLY );
+    if( t->docsfd < 0 )
+        return errno == ENOENT ? 0 : -1;
+    if( fstat( t->docsfd, &st ) != 0 )
+        return -1;
+    if( st.st_size < sizeof( doctable_hdr_t ) ) {
+        errno =EINVAL;
+        return -1;
+    }
+    t->docsmap =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, t->docsfd, 0 );
+    if( t->docsmap == MAP_FAILED ) {
+        t->docsmap =NULL;
+        return -1;
+    }
+    t->docslen =st.st_size;
+    memcpy( &t->hdr, t->docsmap, sizeof( doctable_hdr_t ) );
+    if( t->hdr.magic != DOCTABLE_MAGIC || t->hdr.version != DOCTABLE_VERSION ) {
+        errno =EINVAL;
+        return -1;
+    }
+    uint64_t fit =( st.st_size - sizeof( doctable_hdr_t ) ) / sizeof( doctable_doc_t );
+    if( t->hdr.count > fit )
+        t->hdr.count =fit;
+    t->docs =(const doctable_doc_t*)( (const char*)t->docsmap + sizeof( doctable_hdr_t ) );
+
+    t->stringsfd =open( DOCTABLE_STRINGS, O_RDONLY );
+    if( t->stringsfd < 0 || fstat( t->stringsfd, &st ) != 0 )
+        return -1;
+    if( st.st_size > 0 ) {
+        void *map =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, t->stringsfd, 0 );
+        if( map == MAP_FAILED ) return -1;
+        t->strings =map;
+        t->stringslen =st.st_size;
+    }
+
+    t->idsfd =open( DOCTABLE_IDS, O_RDONLY );
+    if( t->idsfd < 0 )
+        return -1;
+    return ids_map( t );
+}
+
+int
+doctable_open( doctable_t* t, int writable ) {
+    memset( t, 0, sizeof( doctable_t ) );
+    t->docsfd =t->stringsfd =t->idsfd =-1;
+    t->writable =writable;
+
+    if( ( writable ? open_writable( t ) : open_readable( t ) ) != 0 ) {
+        fprintf( stderr, "doctable_open(): %s\n", strerror( errno ) );
+        doctable_close( t );
+        return -1;
+    }
+    return 0;
+}
+
+void
+doctable_close( doctable_t* t ) {
+    if( t->docsmap )
+        munmap( t->docsmap, t->docslen );
+    if( t->strings )
+        munmap( (void*)t->strings, t->stringslen );
+    if( t->idsmap )
+        munmap( t->idsmap, t->idslen );
+    if( t->docsfd >= 0 )
+        close( t->docsfd );
+    if( t->stringsfd >= 0 )
+        close( t->stringsfd );
+    if( t->idsfd >= 0 )
+        close( t->idsfd );
+    memset( t, 0, sizeof( doctable_t ) );
+    t->docsfd =t->stringsfd =t->idsfd =-1;
+}
+
+int
+doctable_changed( const doctable_t* t ) {
+    if( t->docsmap == NULL )
+        return access( DOCTABLE_DOCS, F_OK ) == 0;
+    const doctable_hdr_t *hdr =t->docsmap;
+    return hdr->count != t->hdr.count || hdr->heap != t->hdr.heap;
+}
+
+uint64_t
+doctable_count( const doctable_t* t ) {
+    return t->hdr.count;
+}
+
+uint64_t
+doctable_find( const doctable_t* t, docid_t docid ) {
+    if( t->ids == NULL )
+        return DOCTABLE_NONE;
+    uint64_t capacity =t->ids->capacity;
+    uint64_t h =slot_hash( docid ) & (capacity-1);
+    for( uint64_t i =0; i < capacity; i++ ) {
+        const doctable_slot_t *slot =&t->slots[h];
+        uint64_t ordinal =__atomic_load_n( &slot->ordinal, __ATOMIC_ACQUIRE );
+        if( ordinal == 0 )
+            break;
+        // Readers do not see entries that were added after they opened the table
+        if( slot->docid == docid )
+            return ordinal <= t->hdr.count ? ordinal - 1 : DOCTABLE_NONE;
+        h =(h+1) & (capacity-1);
+    }
+    return DOCTABLE_NONE;
+}
+
+const doctable_doc_t*
+doctable_get( const doctable_t* t, uint64_t ordinal ) {
+    if( t->docs == NULL || ordinal >= t->hdr.count )
+        return NULL;
+    return &t->docs[ordinal];
+}
+
+const doctable_doc_t*
+doctable_lookup( const doctable_t* t, docid_t docid ) {
+    const doctable_doc_t *d =doctable_get( t, doctable_find( t, docid ) );
+    return d != NULL && d->docid == docid ? d : NULL;
+}
+
+const char*
+doctable_url( const doctable_t* t, const doctable_doc_t* d ) {
+    // An entry that was overwritten after opening may point past the mapping
+    if( d->url + d->url_len > t->stringslen )
+        return NULL;
+    return t->strings + d->url;
+}
+
+const char*
+doctable_title( const doctable_t* t, const doctable_doc_t* d ) {
+    if( d->title == DOCTABLE_NONE || d->title + d->title_len > t->stringslen )
+        return NULL;
+    return t->strings + d->title;
+}
+
+int
+doctable_put( doctable_t* t, docid_t docid, const char* url, size_t url_len,
+        const char* title, size_t title_len, uint32_t doclen, int64_t crawled ) {
+    doctable_doc_t d;
+    memset( &d, 0, sizeof( doctable_doc_t ) );
+    if( url_len > UINT32_MAX || title_len > UINT32_MAX ) {
+        errno =EFBIG;
+        goto err;
+    }
+
+    // Strings first, so an entry never points at missing ones
+    d.docid =docid;
+    d.url =t->hdr.heap;
+    d.url_len =url_len;
+    d.title =title != NULL ? t->hdr.heap + url_len : DOCTABLE_NONE;
+    d.title_len =title != NULL ? title_len : 0;
+    d.doclen =doclen;
+    d.hostid =host_id( url, url_len );
+    d.crawled =crawled;
+
+    struct iovec v[2] ={ { (void*)url, url_len }, { (void*)title, d.title_len } };
+    size_t len =url_len + d.title_len;
+    if( pwritev( t->stringsfd, v, title != NULL ? 2 : 1, t->hdr.heap ) != len )
+        goto err;
+    t->hdr.heap +=len;
+
+    uint64_t ordinal =doctable_find( t, docid );
+    if( ordinal == DOCTABLE_NONE ) {
+        ordinal =t->hdr.count;
+        if( ordinal == t->hdr.capacity ) {
+            uint64_t capacity =t->hdr.capacity * 2;
+            if( ftruncate( t->docsfd, sizeof( doctable_hdr_t ) + capacity * sizeof( doctable_doc_t ) ) != 0 )
+                goto err;
+            t->hdr.capacity =capacity;
+        }
+    } else {
+        // Keep the static rank that was computed for the document
+        doctable_doc_t old;
+        if( pread( t->docsfd, &old, sizeof( doctable_doc_t ), sizeof( doctable_hdr_t ) + ordinal * sizeof( doctable_doc_t ) )
+                != sizeof( doctable_doc_t ) )
+            goto err;
+        d.rank =old.rank;
+    }
+
+    if( pwrite( t->docsfd, &d, sizeof( doctable_doc_t ), sizeof( doctable_hdr_t ) + ordinal * sizeof( doctable_doc_t ) )
+            != sizeof( doctable_doc_t ) )
+        goto err;
+    if( ordinal == t->hdr.count ) {
+        t->hdr.count++;
+        if( ( t->ids->count + 1 ) * 10 > t->ids->capacity * 7 && ids_grow( t ) != 0 )
+            return -1;
+        slots_insert( t->slots, t->ids->capacity, &t->ids->count, docid, ordinal );
+    }
+    if( docs_writeHeader( t ) != 0 )
+        goto err;
+    return 0;
+
+err:
+    fprintf( stderr, "doctable_put(): %s\n", strerror( errno ) );
+    return -1;
+}
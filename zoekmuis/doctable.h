@@ -0,0 +1,126 @@
+/*
+ * Websearch - doctable.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Table with the metadata of every document, in fixed width entries that are
+ * numbered by ordinal. It is what the query tools need to rank and show a result,
+ * without reading the repository. The table is a directory with:
+ *  docs     doctable_hdr_t followed by one doctable_doc_t per ordinal
+ *  strings  heap with the URLs and titles the entries point into
+ *  ids      open addressing hash table from DOCID to ordinal
+ * All three are memory mapped by readers, which see the table as it was when
+ * they opened it. A document keeps its ordinal when it is crawled again; its
+ * entry is then overwritten in place and its new strings are appended.
+ */
+
+#ifndef DOCTABLE_H
+#define DOCTABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "docid.h"
+
+#define DOCTABLE_PATH "doctable/"
+#define DOCTABLE_MAGIC 0x54444d5a       // "ZMDT"
+#define DOCTABLE_IDSMAGIC 0x49444d5a    // "ZMDI"
+#define DOCTABLE_VERSION 1
+#define DOCTABLE_DOCS_INIT 1024         // Initial number of entries in `docs'
+#define DOCTABLE_SLOTS_INIT 4096        // Initial capacity of `ids', a power of two
+#define DOCTABLE_NONE UINT64_MAX        // Title of a document without one, such as an image
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;             // Number of entries
+    uint64_t capacity;          // Number of entries the file has room for
+    uint64_t heap;              // Size of the string heap
+} doctable_hdr_t;
+
+typedef struct {
+    uint64_t docid;
+    uint64_t url;               // Offset of the URL in the string heap
+    uint64_t title;             // Offset of the title, or DOCTABLE_NONE
+    uint32_t url_len, title_len;
+    uint32_t doclen;            // Number of words indexed for the document
+    uint32_t hostid;            // Hash of the host name
+    float rank;                 // Static rank
+    uint32_t pad;
+    int64_t crawled;            // Time of the crawl, in seconds since the epoch
+} doctable_doc_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t capacity;
+    uint64_t count;
+} doctable_idshdr_t;
+
+typedef struct {
+    uint64_t docid;
+    uint64_t ordinal;           // Ordinal + 1, zero is an empty slot
+} doctable_slot_t;
+
+typedef struct {
+    int writable;
+    int docsfd, stringsfd, idsfd;
+    doctable_hdr_t hdr;         // Header of `docs', as of opening for readers
+
+    const doctable_doc_t *docs; // Mapped entries, readers only
+    void *docsmap;
+    size_t docslen;
+    const char *strings;        // Mapped string heap, readers only
+    size_t stringslen;
+
+    void *idsmap;               // Mapping of `ids'
+    size_t idslen;
+    doctable_idshdr_t *ids;
+    doctable_slot_t *slots;
+} doctable_t;
+
+/* Open the document table, creating it if `writable'. Only one process can open
+   the table for writing. A table that does not exist yet opens empty for reading.
+   Returns -1 on error */
+int
+doctable_open( doctable_t* t, int writable );
+
+void
+doctable_close( doctable_t* t );
+
+/* Add or update the entry of `docid'. `title' is NULL for documents without one.
+   Returns -1 on error */
+int
+doctable_put( doctable_t* t, docid_t docid, const char* url, size_t url_len,
+        const char* title, size_t title_len, uint32_t doclen, int64_t crawled );
+
+/* Return 1 if entries were added or changed since a reader opened the table,
+   which it then has to open again to see them */
+int
+doctable_changed( const doctable_t* t );
+
+/* Return the number of entries */
+uint64_t
+doctable_count( const doctable_t* t );
+
+/* Return the ordinal of `docid', or DOCTABLE_NONE if it is not in the table */
+uint64_t
+doctable_find( const doctable_t* t, docid_t docid );
+
+/* Return the entry with `ordinal', or NULL if there is none. Readers only */
+const doctable_doc_t*
+doctable_get( const doctable_t* t, uint64_t ordinal );
+
+/* Return the entry of `docid', or NULL if it is not in the table. Readers only */
+const doctable_doc_t*
+doctable_lookup( const doctable_t* t, docid_t docid );
+
+/* Return the URL and the title of `d', which are not null-terminated.
+   The title is NULL if the document does not have one */
+const char*
+doctable_url( const doctable_t* t, const doctable_doc_t* d );
+
+const char*
+doctable_title( const doctable_t* t, const doctable_doc_t* d );
+
+#endif
@@ -8,17 +8,32 @@
  * The index_ functions are used by both the webspider and the webquery programs
  */
 
+#define _GNU_SOURCE
 #include "index.h"
+#include "hash.h"
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <string.h>
 
 char *strsep(char **stringp, const char *delim);
 
 #define TMP_SIZE 1024
+#define PAGE_ARENA_SIZE 4096
+#define PAGE_TABLE_INIT 256
+#define PAGE_TERMS_INCR 64
+#define PAGE_OCC_INCR 256
+#define PAGE_HASH_SEED 0x5a6f656b6d756973l
 
 size_t
 index_splitLink( char ***buffer, const char* link, size_t len ) {
@@ -68,55 +83,287 @@ compl: // Word complete, add to array
     return n-1;
 }
 
+/* Named HTML entities, sorted by name for bsearch() */
+typedef struct {
+    const char *name;
+    uint32_t cp;
+} tok_entity_t;
+
+static const tok_entity_t TOK_ENTITIES[] = {
+    { "AElig", 198 }, { "Aacute", 193 }, { "Acirc", 194 }, { "Agrave", 192 },
+    { "Aring", 197 }, { "Atilde", 195 }, { "Auml", 196 }, { "Ccedil", 199 },
+    { "ETH", 208 }, { "Eacute", 201 }, { "Ecirc", 202 }, { "Egrave", 200 },
+    { "Euml", 203 }, { "Iacute", 205 }, { "Icirc", 206 }, { "Igrave", 204 },
+    { "Iuml", 207 }, { "Ntilde", 209 }, { "OElig", 338 }, { "Oacute", 211 },
+    { "Ocirc", 212 }, { "Ograve", 210 }, { "Oslash", 216 }, { "Otilde", 213 },
+    { "Ouml", 214 }, { "Scaron", 352 }, { "THORN", 222 }, { "Uacute", 218 },
+    { "Ucirc", 219 }, { "Ugrave", 217 }, { "Uuml", 220 }, { "Yacute", 221 },
+    { "Yuml", 376 }, { "aacute", 225 }, { "acirc", 226 }, { "acute", 180 },
+    { "aelig", 230 }, { "agrave", 224 }, { "amp", 38 }, { "apos", 39 },
+    { "aring", 229 }, { "atilde", 227 }, { "auml", 228 }, { "bdquo", 8222 },
+    { "brvbar", 166 }, { "bull", 8226 }, { "ccedil", 231 }, { "cedil", 184 },
+    { "cent", 162 }, { "copy", 169 }, { "curren", 164 }, { "deg", 176 },
+    { "divide", 247 }, { "eacute", 233 }, { "ecirc", 234 }, { "egrave", 232 },
+    { "emsp", 8195 }, { "ensp", 8194 }, { "eth", 240 }, { "euml", 235 },
+    { "euro", 8364 }, { "frac12", 189 }, { "frac14", 188 }, { "frac34", 190 },
+    { "gt", 62 }, { "hellip", 8230 }, { "iacute", 237 }, { "icirc", 238 },
+    { "iexcl", 161 }, { "igrave", 236 }, { "iquest", 191 }, { "iuml", 239 },
+    { "laquo", 171 }, { "ldquo", 8220 }, { "lsquo", 8216 }, { "lt", 60 },
+    { "macr", 175 }, { "mdash", 8212 }, { "micro", 181 }, { "middot", 183 },
+    { "nbsp", 160 }, { "ndash", 8211 }, { "not", 172 }, { "ntilde", 241 },
+    { "oacute", 243 }, { "ocirc", 244 }, { "oelig", 339 }, { "ograve", 242 },
+    { "ordf", 170 }, { "ordm", 186 }, { "oslash", 248 }, { "otilde", 245 },
+    { "ouml", 246 }, { "para", 182 }, { "plusmn", 177 }, { "pound", 163 },
+    { "quot", 34 }, { "raquo", 187 }, { "rdquo", 8221 }, { "reg", 174 },
+    { "rsquo", 8217 }, { "sbquo", 8218 }, { "scaron", 353 }, { "sect", 167 },
+    { "shy", 173 }, { "sup1", 185 }, { "sup2", 178 }, { "sup3", 179 }, { "szlig", 223 },
+    { "thinsp", 8201 }, { "thorn", 254 }, { "times", 215 }, { "trade", 8482 },
+    { "uacute", 250 }, { "ucirc", 251 }, { "ugrave", 249 }, { "uml", 168 },
+    { "uuml", 252 }, { "yacute", 253 }, { "yen", 165 }, { "yuml", 255 }
+};
+
+#define TOK_ENTITY_MAXLEN 10    // Longest entity we decode, "&#x10ffff;"
+
+static int
+tok_entityCmp( const void* key, const void* elem ) {
+    return strcmp( (const char*)key, ((const tok_entity_t*)elem)->name );
+}
+
+static inline int
+tok_isAsciiAlnum( unsigned char c ) {
+    return ( c >= '0' && c <= '9' ) || ( (c|0x20) >= 'a' && (c|0x20) <= 'z' );
+}
+
+/* Letters and digits outside ASCII. Everything from Latin-1 upwards counts as a
+   word character, except the obvious symbol and punctuation blocks */
+static inline int
+tok_isWordChar( uint32_t cp ) {
+    if( cp < 0x80 )
+        return tok_isAsciiAlnum( cp );
+    if( cp < 0xc0 || cp == 0xd7 || cp == 0xf7 )
+        return 0;
+    if( ( cp >= 0x2000 && cp <= 0x2bff )        // Punctuation, symbols, arrows, shapes
+     || ( cp >= 0x3000 && cp <= 0x303f )        // CJK punctuation
+     || ( cp >= 0xfe00 && cp <= 0xfe0f )        // Variation selectors
+     || cp == 0xfeff || cp > 0x10ffff )
+        return 0;
+    return 1;
+}
+
+/* Lowercase the common alphabets. Every mapping keeps the length of the
+   UTF-8 encoding, so a token never grows while it is rewritten in place */
+static inline uint32_t
+tok_lower( uint32_t cp ) {
+    if( cp < 0x80 )
+        return ( cp >= 'A' && cp <= 'Z' ) ? cp + 0x20 : cp;
+    if( cp >= 0xc0 && cp <= 0xde && cp != 0xd7 )
+        return cp + 0x20;
+    if( cp >= 0x100 && cp <= 0x17f ) {
+        if( cp == 0x178 )
+            return 0xff;
+        if( ( cp >= 0x139 && cp <= 0x148 ) || ( cp >= 0x179 && cp <= 0x17e ) )
+            return ( cp & 1 ) ? cp + 1 : cp;
+        if( cp == 0x130 || cp == 0x131 || cp == 0x138 || cp == 0x149 || cp == 0x17f )
+            return cp;
+        return cp | 1;
+    }
+    if( cp >= 0x391 && cp <= 0x3a9 && cp != 0x3a2 )   // Greek
+        return cp + 0x20;
+    if( cp >= 0x410 && cp <= 0x42f )                  // Cyrillic
+        return cp + 0x20;
+    if( cp >= 0x400 && cp <= 0x40f )
+        return cp + 0x50;
+    return cp;
+}
+
+/* Decode one UTF-8 character from `s' into *cp.
+   Returns its length or 0 if the sequence is malformed */
+static size_t
+tok_utf8Decode( const unsigned char* s, size_t len, uint32_t* cp ) {
+    size_t n;
+    uint32_t c =s[0];
+    if( c < 0x80 ) { *cp =c; return 1; }
+    else if( c >= 0xc2 && c < 0xe0 ) { n =2; c &= 0x1f; }
+    else if( c >= 0xe0 && c < 0xf0 ) { n =3; c &= 0x0f; }
+    else if( c >= 0xf0 && c < 0xf5 ) { n =4; c &= 0x07; }
+    else return 0;
+
+    if( n > len ) return 0;
+    for( size_t i =1; i < n; i++ ) {
+        if( ( s[i] & 0xc0 ) != 0x80 ) return 0;
+        c =( c << 6 ) | ( s[i] & 0x3f );
+    }
+    // Reject overlong encodings and surrogates
+    if( ( n == 3 && c < 0x800 ) || ( n == 4 && c < 0x10000 ) || ( c >= 0xd800 && c <= 0xdfff ) )
+        return 0;
+    *cp =c;
+    return n;
+}
+
+static size_t
+tok_utf8Encode( unsigned char* s, uint32_t cp ) {
+    if( cp < 0x80 ) {
+        s[0] =cp;
+        return 1;
+    } else if( cp < 0x800 ) {
+        s[0] =0xc0 | ( cp >> 6 );
+        s[1] =0x80 | ( cp & 0x3f );
+        return 2;
+    } else if( cp < 0x10000 ) {
+        s[0] =0xe0 | ( cp >> 12 );
+        s[1] =0x80 | ( ( cp >> 6 ) & 0x3f );
+        s[2] =0x80 | ( cp & 0x3f );
+        return 3;
+    }
+    s[0] =0xf0 | ( cp >> 18 );
+    s[1] =0x80 | ( ( cp >> 12 ) & 0x3f );
+    s[2] =0x80 | ( ( cp >> 6 ) & 0x3f );
+    s[3] =0x80 | ( cp & 0x3f );
+    return 4;
+}
+
+/* Decode the entity at `s' (which starts with '&') into *cp.
+   Returns its length including the ';', or 0 if it is not terminated.
+   Unknown entities decode to a space */
+static size_t
+tok_entityDecode( const unsigned char* s, size_t len, uint32_t* cp ) {
+    char name[TOK_ENTITY_MAXLEN];
+    size_t n;
+
+    for( n =1; n < len && n < TOK_ENTITY_MAXLEN; n++ ) {
+        if( s[n] == ';' ) break;
+        if( !tok_isAsciiAlnum( s[n] ) && !( n == 1 && s[n] == '#' ) ) return 0;
+        name[n-1] =s[n];
+    }
+    if( n == len || s[n] != ';' || n == 1 )
+        return 0;
+    name[n-1] =0;
+
+    *cp =' ';
+    if( name[0] == '#' ) {
+        char *end;
+        int hex =( name[1] == 'x' || name[1] == 'X' );
+        unsigned long v =strtoul( name + 1 + hex, &end, hex ? 16 : 10 );
+        if( *end == 0 && end != name + 1 + hex && v > 0 && v <= 0x10ffff )
+            *cp =v;
+    } else {
+        const tok_entity_t *e =bsearch( name, TOK_ENTITIES,
+                sizeof( TOK_ENTITIES ) / sizeof( tok_entity_t ), sizeof( tok_entity_t ), tok_entityCmp );
+        if( e != NULL )
+            *cp =e->cp;
+    }
+    return n + 1;
+}
+
+/* Copy the run of ASCII letters and digits at `r' to `w', lowercased.
+   w <= r, the run may move towards the front of the buffer.
+   Returns the length of the run */
+static size_t
+tok_asciiRun( unsigned char* buf, size_t w, size_t r, size_t len ) {
+    size_t n =0;
+#ifdef __SSE2__
+    // Classify and lowercase 16 bytes at a time. Bytes >= 0x80 are negative as
+    // signed chars, so they fall outside every range
+    const __m128i d0 =_mm_set1_epi8( '0'-1 ), d1 =_mm_set1_epi8( '9'+1 );
+    const __m128i u0 =_mm_set1_epi8( 'A'-1 ), u1 =_mm_set1_epi8( 'Z'+1 );
+    const __m128i l0 =_mm_set1_epi8( 'a'-1 ), l1 =_mm_set1_epi8( 'z'+1 );
+    const __m128i caseb =_mm_set1_epi8( 0x20 );
+
+    while( r + n + 16 <= len ) {
+        __m128i v =_mm_loadu_si128( (const __m128i*)( buf + r + n ) );
+        __m128i digit =_mm_and_si128( _mm_cmpgt_epi8( v, d0 ), _mm_cmplt_epi8( v, d1 ) );
+        __m128i upper =_mm_and_si128( _mm_cmpgt_epi8( v, u0 ), _mm_cmplt_epi8( v, u1 ) );
+        __m128i lower =_mm_and_si128( _mm_cmpgt_epi8( v, l0 ), _mm_cmplt_epi8( v, l1 ) );
+        unsigned mask =_mm_movemask_epi8( _mm_or_si128( digit, _mm_or_si128( upper, lower ) ) );
+        v =_mm_add_epi8( v, _mm_and_si128( upper, caseb ) );
+
+        if( mask == 0xffff ) {
+            // The whole block has been read already, so storing it can not
+            // overwrite unread input
+            _mm_storeu_si128( (__m128i*)( buf + w + n ), v );
+            n += 16;
+            continue;
+        }
+        unsigned char tmp[16];
+        size_t k =__builtin_ctz( ~mask );
+        _mm_storeu_si128( (__m128i*)tmp, v );
+        memcpy( buf + w + n, tmp, k );
+        return n + k;
+    }
+#endif
+    while( r + n < len && tok_isAsciiAlnum( buf[r+n] ) ) {
+        buf[w+n] =tok_lower( buf[r+n] );
+        n++;
+    }
+    return n;
+}
+
+size_t
+index_keywordLen( const char* word, size_t len ) {
+    if( len <= IDX_MAX_KWLEN )
+        return len;
+    // Continuation bytes are 10xxxxxx
+    len =IDX_MAX_KWLEN;
+    while( len > 0 && ( (unsigned char)word[len] & 0xc0 ) == 0x80 )
+        len--;
+    return len;
+}
+
 char*
-index_tokInner( char** buffer ) {
+index_tokInner( char** buffer, char* end ) {
+    unsigned char *buf =(unsigned char*)*buffer;
+    size_t len =end - *buffer;
+    size_t r =0, w =0;
     char *first =NULL;
-    size_t i =0;
-    while( 1 ) {
-        // alpha-numeric character: convert to lower case
-        if( isalnum((*buffer)[i]) ) {
-            if( first == NULL )
-                first =*buffer + i;
-            (*buffer)[i] = tolower( (*buffer)[i] );
-        }
-        // HTML entity
-        else if( (*buffer)[i] == '&' ) {
-            int off =0;
-            for( int j=1; j < 7; j++ ) {
-                if( (*buffer)[i+j] == 0 )
-                    break;
-                if( (*buffer)[i+j] == ';' ) {
-                    off =j;
-                    break;
-                }
-            }
-            if( first != NULL )
-                (*buffer)[i] = 0;
-            i +=off;
-            if( first != NULL ){
-                *buffer +=i+1;
-                break;
-            }
 
+    while( r < len ) {
+        unsigned char c =buf[r];
+        uint32_t cp;
+        size_t n =0;
+
+        // Runs of plain ASCII take the fast path
+        if( tok_isAsciiAlnum( c ) ) {
+            if( first == NULL ) {
+                first =(char*)buf + r;
+                w =r;
+            }
+            n =tok_asciiRun( buf, w, r, len );
+            w += n;
+            r += n;
+            continue;
         }
-        // End of string
-        else if( (*buffer)[i] == 0 ) {
-            *buffer +=i;
-            break;
+        // Exception to handle combined words
+        if( c == '-' && first != NULL ) {
+            buf[w++] =c;
+            r++;
+            continue;
         }
-        // Any other character is a delimeter
-        else {
-            if( first != NULL ) {
-                // Exception to handle combined words 
-                if( (*buffer)[i] == '-' ) { i++; continue; }
 
-                (*buffer)[i] = 0;
-                *buffer +=i+1;
-                break;
+        if( c == '&' )
+            n =tok_entityDecode( buf + r, len - r, &cp );
+        else if( c >= 0x80 )
+            n =tok_utf8Decode( buf + r, len - r, &cp );
+
+        if( n != 0 && tok_isWordChar( cp ) ) {
+            if( first == NULL ) {
+                first =(char*)buf + r;
+                w =r;
             }
+            // An encoded character is never longer than its source
+            w += tok_utf8Encode( buf + w, tok_lower( cp ) );
+            r += n;
+            continue;
         }
-        i++;
+
+        // Any other character is a delimeter
+        r += n ? n : 1;
+        if( first != NULL )
+            break;
     }
+
+    if( first != NULL )
+        buf[w] =0;
+    *buffer =(char*)buf + r;
     return first;
 }
 
@@ -170,41 +417,193 @@ err:
     return -1;
 }
 
-int 
-index_appendLinkidx( docid_t link, docid_t referer ) {
-    char *docid_str =docid_tostr( link );
-    int err =index_append( IDX_LINKIDX, docid_str, &referer, 1 );
+size_t
+index_encodePositions( uint8_t* buf, const uint32_t* pos, size_t n ) {
+    size_t len =0;
+    uint32_t prev =0;
+    for( size_t i =0; i < n; i++ ) {
+        uint32_t delta =pos[i] - prev;
+        prev =pos[i];
+        while( delta >= 0x80 ) {
+            buf[len++] =(uint8_t)(delta | 0x80);
+            delta >>= 7;
+        }
+        buf[len++] =(uint8_t)delta;
+    }
+    return len;
+}
 
-    free( docid_str );
-    return err;
+size_t
+index_decodePositions( uint32_t* pos, size_t max, const uint8_t* buf, size_t len ) {
+    size_t n =0, i =0;
+    uint32_t prev =0;
+    while( i < len && n < max ) {
+        uint32_t delta =0;
+        int shift =0;
+        while( i < len ) {
+            delta |= (uint32_t)(buf[i] & 0x7f) << shift;
+            shift +=7;
+            if( !(buf[i++] & 0x80) )
+                break;
+        }
+        prev +=delta;
+        pos[n++] =prev;
+    }
+    return n;
 }
 
-int 
-index_appendHtmlInner( index_t idx, docid_t link, char* str ) {
-    char *word = NULL;
-    int err =0;
+int
+index_mapOpen( index_map_t* map, const char* path ) {
+    struct stat st;
+    map->data =NULL;
+    map->len =0;
+
+    int fd =open( path, O_RDONLY );
+    if( fd < 0 )
+        return -1;
+    if( fstat( fd, &st ) != 0 ) {
+        close( fd );
+        return -1;
+    }
+
+    if( st.st_size > 0 ) {
+        map->data =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+        if( map->data == MAP_FAILED ) {
+            map->data =NULL;
+            close( fd );
+            return -1;
+        }
+        map->len =st.st_size;
+    }
+    // The mapping stays valid after closing, even if the file is removed
+    close( fd );
+    return 0;
+}
 
-    int i=0;
+void
+index_mapClose( index_map_t* map ) {
+    if( map->data )
+        munmap( map->data, map->len );
+    map->data =NULL;
+    map->len =0;
+}
 
-    while( word = index_tokInner( &str ) ) {
-        if( strlen( word ) == 0 )
-            continue;
-        if( err =index_append( idx, word, &link, 1 ) != 0 )
+void
+index_mapAdvise( const index_map_t* map, size_t offs, size_t len, int advice ) {
+    if( map->data == NULL || offs >= map->len )
+        return;
+    size_t page =sysconf( _SC_PAGESIZE );
+    size_t begin =offs & ~(page-1);
+    size_t end =offs + len < map->len ? offs + len : map->len;
+    madvise( (char*)map->data + begin, end - begin, advice );
+}
+
+void
+index_pageCreate( index_page_t* page, docid_t docid ) {
+    memset( page, 0, sizeof( index_page_t ) );
+    page->docid =docid;
+}
+
+/* Copy `word' into the arena, starting a new block when the current one is full */
+static const char*
+arena_intern( index_arena_t** arena, const char* word, size_t len ) {
+    index_arena_t *a =*arena;
+    if( a == NULL || a->used + len+1 > a->size ) {
+        size_t size =len+1 > PAGE_ARENA_SIZE ? len+1 : PAGE_ARENA_SIZE;
+        a =malloc( sizeof( index_arena_t ) + size );
+        if( a == NULL ) return NULL;
+        a->next =*arena;
+        a->used =0;
+        a->size =size;
+        *arena =a;
+    }
+    char *copy =a->data + a->used;
+    memcpy( copy, word, len );
+    copy[len] =0;
+    a->used +=len+1;
+    return copy;
+}
+
+static int
+page_rehash( index_page_t* page ) {
+    size_t size =page->tablesize ? page->tablesize * 2 : PAGE_TABLE_INIT;
+    uint32_t *table =calloc( size, sizeof( uint32_t ) );
+    if( table == NULL ) return -1;
+
+    for( size_t i =0; i < page->nterms; i++ ) {
+        size_t h =page->terms[i].hash & (size-1);
+        while( table[h] )
+            h =(h+1) & (size-1);
+        table[h] =i+1;
+    }
+    free( page->table );
+    page->table =table;
+    page->tablesize =size;
+    return 0;
+}
+
+int
+index_pageAdd( index_page_t* page, index_t idx, const char* word ) {
+    return index_pageAddAt( page, idx, word, page->wordpos[idx] );
+}
+
+int
+index_pageAddAt( index_page_t* page, index_t idx, const char* word, uint32_t pos ) {
+    size_t len =index_keywordLen( word, strlen( word ) );
+    uint32_t hash =murmur64A( word, len, PAGE_HASH_SEED );
+
+    if( page->nterms * 2 >= page->tablesize && page_rehash( page ) != 0 )
+        return -1;
+
+    // Look the keyword up, the terms are shared by all indices
+    size_t h =hash & (page->tablesize-1);
+    index_pageterm_t *t =NULL;
+    for( ; page->table[h]; h =(h+1) & (page->tablesize-1) ) {
+        t =&page->terms[page->table[h]-1];
+        if( t->hash == hash && t->len == len && memcmp( t->word, word, len ) == 0 )
             break;
-         
+        t =NULL;
     }
-    return err;
+
+    if( t == NULL ) {
+        if( page->nterms == page->termsize ) {
+            page->terms =realloc( page->terms, sizeof( index_pageterm_t ) * (page->termsize =page->termsize*2 + PAGE_TERMS_INCR) );
+            if( page->terms == NULL ) return -1;
+        }
+        t =&page->terms[page->nterms];
+        memset( t, 0, sizeof( index_pageterm_t ) );
+        if( ( t->word =arena_intern( &page->arena, word, len ) ) == NULL )
+            return -1;
+        t->len =len;
+        t->hash =hash;
+        page->table[h] =++page->nterms;
+    }
+
+    if( page->nocc == page->occsize ) {
+        page->occ =realloc( page->occ, sizeof( index_pageocc_t ) * (page->occsize =page->occsize*2 + PAGE_OCC_INCR) );
+        if( page->occ == NULL ) return -1;
+    }
+    index_pageocc_t *o =&page->occ[page->nocc++];
+    o->term =t - page->terms;
+    o->idx =idx;
+    o->pos =pos;
+    if( pos >= page->wordpos[idx] )
+        page->wordpos[idx] =pos+1;
+
+    t->fields |= 1u << idx;
+    t->tf[idx]++;
+    return 0;
 }
 
 int
-index_appendWebidx( docid_t docid, const char* url, size_t len ) {
+index_pageAddUrl( index_page_t* page, const char* url, size_t len ) {
     char **buffer;
     size_t n =index_splitLink( &buffer, url, len );
     int err =0;
 
     for( int i =0; i < n; i++ ) {
         if( !err )
-                err = index_append( IDX_WEBIDX, buffer[i], &docid, 1 );
+                err = index_pageAdd( page, IDX_WEBIDX, buffer[i] );
         free( buffer[i] );
     }
 
@@ -213,46 +612,206 @@ index_appendWebidx( docid_t docid, const char* url, size_t len ) {
 }
 
 int
-index_appendRepository( docid_t docid, 
+index_pageAddInner( index_page_t* page, index_t idx, char* str ) {
+    char *word = NULL;
+    char *end =str + strlen( str );
+    int err =0;
+
+    while( word = index_tokInner( &str, end ) ) {
+        if( strlen( word ) == 0 )
+            continue;
+        if( ( err =index_pageAdd( page, idx, word ) ) != 0 )
+            break;
+    }
+    return err;
+}
+
+int
+index_pageFinish( index_page_t* page ) {
+    free( page->positions );
+    page->positions =malloc( sizeof( uint32_t ) * (page->nocc + 1) );
+    if( page->positions == NULL ) return -1;
+
+    // Counting sort: every keyword gets a run per index, which is filled
+    // backwards so the positions stay ascending
+    uint32_t *p =page->positions;
+    for( size_t i =0; i < page->nterms; i++ ) {
+        index_pageterm_t *t =&page->terms[i];
+        for( int f =0; f < IDX_FIELDS; f++ ) {
+            p +=t->tf[f];
+            t->pos[f] =t->tf[f] ? p : NULL;
+        }
+    }
+    for( size_t i =page->nocc; i-- > 0; ) {
+        const index_pageocc_t *o =&page->occ[i];
+        *--page->terms[o->term].pos[o->idx] =o->pos;
+    }
+    return 0;
+}
+
+void
+index_pageFree( index_page_t* page ) {
+    while( page->arena != NULL ) {
+        index_arena_t *next =page->arena->next;
+        free( page->arena );
+        page->arena =next;
+    }
+    free( page->terms );
+    free( page->table );
+    free( page->occ );
+    free( page->positions );
+    index_pageCreate( page, page->docid );
+}
+
+int 
+index_appendLinkidx( docid_t link, docid_t referer ) {
+    char *docid_str =docid_tostr( link );
+    int err =index_append( IDX_LINKIDX, docid_str, &referer, 1 );
+
+    free( docid_str );
+    return err;
+}
+
+int
+index_appendRepository( packstore_t* repo, docid_t docid, 
         const char* url, size_t url_len, 
         const char* title, size_t title_len, 
         const char* data, size_t len ) {
     
-    char *docid_str =docid_tostr( docid );
-
-    FILE* file =index_open( IDX_REPOSITORY, docid_str, IDX_OPEN_WRITE );
-    if( file == NULL ) goto err;
+    struct iovec iov[5];
+    int n =0;
 
     // Write the URL and a newline first, this provides a simple means of reversing DOCIDs
     if( url != NULL ) {
-        if( fwrite( (void*)url, sizeof( char ), url_len, file ) != url_len )
-            goto err;
-    
-        if( fwrite( (void*)"\n", sizeof( char ), 1, file ) != 1 )
-            goto err;
+        iov[n].iov_base =(void*)url; iov[n++].iov_len =url_len;
+        iov[n].iov_base =(void*)"\n"; iov[n++].iov_len =1;
     }
 
-    // Also write the title
+    // Also write the title, images have an empty line instead
     if( title != NULL ) {
-        if( fwrite( (void*)title, sizeof( char ), title_len, file ) != title_len )
-            goto err;
-    
-        if( fwrite( (void*)"\n", sizeof( char ), 1, file ) != 1 )
-            goto err;
+        iov[n].iov_base =(void*)title; iov[n++].iov_len =title_len;
+        iov[n].iov_base =(void*)"\n"; iov[n++].iov_len =1;
+    } else if( data != NULL ) {
+        iov[n].iov_base =(void*)"\n"; iov[n++].iov_len =1;
     }
 
     // Now write the body of the page
-    if( data != NULL )
-        if( fwrite( (void*)data, sizeof( char ), len, file ) != len )
-            goto err;
+    if( data != NULL ) {
+        iov[n].iov_base =(void*)data; iov[n++].iov_len =len;
+    }
 
-    free( docid_str );
-    fclose( file );
+    return packstore_putv( repo, docid, iov, n );
+}
+
+int
+index_readRepository( packstore_t* repo, packstore_cache_t* cache, docid_t docid, index_record_t* rec ) {
+    const char *data, *nl;
+    size_t len;
+    int err =packstore_get( repo, cache, docid, &data, &len );
+    if( err != 0 )
+        return err;
+
+    memset( rec, 0, sizeof( index_record_t ) );
+    rec->url =data;
+    if( ( nl =memchr( data, '\n', len ) ) == NULL ) {
+        rec->url_len =len;
+        return 0;
+    }
+    rec->url_len =nl - data;
+    len -=rec->url_len + 1;
+    data =nl + 1;
+
+    // Images end after their URL or have their alt texts after an empty line
+    if( len == 0 )
+        return 0;
+    if( *data == '\n' ) {
+        rec->text =data + 1;
+        rec->text_len =len - 1;
+        return 0;
+    }
+    rec->title =data;
+    if( ( nl =memchr( data, '\n', len ) ) == NULL ) {
+        rec->title_len =len;
+        return 0;
+    }
+    rec->title_len =nl - data;
+    rec->text =nl + 1;
+    rec->text_len =len - rec->title_len - 1;
     return 0;
+}
 
-err:    
-    fprintf( stderr, "index_appendRepository(): %s\n",strerror( errno ) );
-    return -1;
+const char*
+index_imageType( const char* data, size_t len ) {
+    static const struct {
+        const char *magic;
+        size_t len;
+        const char *type;
+    } signatures[] ={
+        { "\xff\xd8\xff", 3, "image/jpeg" },
+        { "\x89PNG\r\n\x1a\n", 8, "image/png" },
+        { "GIF87a", 6, "image/gif" },
+        { "GIF89a", 6, "image/gif" },
+        { "BM", 2, "image/bmp" },
+        { "II*\0", 4, "image/tiff" },
+        { "MM\0*", 4, "image/tiff" },
+        { "\0\0\1\0", 4, "image/x-icon" } };
+
+    for( size_t i =0; i < sizeof( signatures ) / sizeof( signatures[0] ); i++ )
+        if( len >= signatures[i].len && memcmp( data, signatures[i].magic, signatures[i].len ) == 0 )
+            return signatures[i].type;
+    // WebP is a RIFF container
+    if( len >= 12 && memcmp( data, "RIFF", 4 ) == 0 && memcmp( data + 8, "WEBP", 4 ) == 0 )
+        return "image/webp";
+    return NULL;
+}
+
+int
+index_appendImage( packstore_t* store, docid_t docid, const char* type, const char* data, size_t len ) {
+    struct iovec iov[3] ={
+        { (void*)type, strlen( type ) },
+        { (void*)"\n", 1 },
+        { (void*)data, len } };
+    return packstore_putv( store, docid, iov, 3 );
+}
 
+int
+index_exportImage( docid_t docid, const char* data, size_t len ) {
+    char path[64], tmp[64];
+    if( mkdir( IDX_COLORCACHE, 0755 ) != 0 && errno != EEXIST )
+        return -1;
+    snprintf( path, sizeof( path ), IDX_COLORCACHE "%Lx", (long long unsigned int)docid );
+    strcpy( tmp, IDX_COLORCACHE ".tmpXXXXXX" );
+    int fd =mkstemp( tmp );
+    if( fd < 0 )
+        return -1;
+    FILE *file =fdopen( fd, "w" );
+    int err =file == NULL || fwrite( data, 1, len, file ) != len;
+    if( file != NULL )
+        err |=fclose( file ) != 0;
+    else
+        close( fd );
+    if( err || rename( tmp, path ) != 0 ) {
+        unlink( tmp );
+        return -1;
+    }
+    return 0;
 }
 
+int
+index_readImage( packstore_t* store, docid_t docid, index_image_t* img ) {
+    const char *data, *nl;
+    size_t len;
+    int err =packstore_getFile( store, docid, &data, &len, &img->fd, &img->offs );
+    if( err != 0 )
+        return err;
+    if( ( nl =memchr( data, '\n', len ) ) == NULL ) {
+        fprintf( stderr, "index_readImage(): malformed record\n" );
+        return -1;
+    }
+    img->type =data;
+    img->type_len =nl - data;
+    img->data =nl + 1;
+    img->len =len - img->type_len - 1;
+    img->offs +=img->type_len + 1;
+    return 0;
+}
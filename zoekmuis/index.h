@@ -12,7 +12,9 @@
 #define INDEX_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include "docid.h"
+#include "packstore.h"
 
 typedef enum {
     IDX_WEBIDX =0,
@@ -38,6 +40,92 @@ static const char* IDX_PATH[] = {
     "repository/",
     "images/" };
 
+/* Copy of the image store for imgcompare, which reads a directory */
+#define IDX_COLORCACHE "colorcache/"
+
+/* Keyword indices (web, page, title and image) store one posting per document:
+   the DOCID, the number of occurrences of the keyword and the number of bytes its
+   word positions occupy in the accompanying position stream.
+   Positions are delta-encoded varints, in the same order as the postings.
+   Keyword indices are stored in segments (see segment.h); the link index is
+   not a keyword index and still holds plain referer DOCIDs, one file per link. */
+typedef struct {
+    docid_t docid;
+    uint32_t tf;
+    uint32_t poslen;
+} index_posting_t;
+
+/* Longest keyword in bytes. The dictionaries of the segments store keywords of
+   up to 64 KB, longer words are cut to this at a character boundary */
+#define IDX_MAX_KWLEN 255
+
+/* Worst case size of `n' encoded positions */
+#define IDX_POS_MAXBYTES( n ) ((n) * 5)
+
+/* Number of indices that can hold keywords, IDX_WEBIDX up to IDX_IMAGEIDX. Pages
+   keep their counts and positions of a keyword per index */
+#define IDX_FIELDS (IDX_IMAGEIDX+1)
+
+/* Block of memory the keywords of a page are interned in, freed as a whole */
+typedef struct index_arena {
+    struct index_arena *next;
+    size_t used, size;
+    char data[];
+} index_arena_t;
+
+/* A distinct keyword of a page with its counts in every index */
+typedef struct {
+    const char *word;           // Interned in the arena of the page
+    uint32_t len;
+    uint32_t hash;
+    uint32_t fields;            // Bitmask of the indices (1 << idx) the keyword occurs in
+    uint32_t tf[IDX_FIELDS];    // Term frequency per index
+    uint32_t *pos[IDX_FIELDS];  // Positions per index, set by index_pageFinish()
+} index_pageterm_t;
+
+/* One occurrence of a keyword, in order of appearance */
+typedef struct {
+    uint32_t term;
+    uint32_t idx;
+    uint32_t pos;
+} index_pageocc_t;
+
+/* Aggregates all keywords of a single page before they are written to the indices */
+typedef struct {
+    docid_t docid;
+    index_arena_t *arena;
+    index_pageterm_t *terms;    // Distinct keywords, in order of first occurrence
+    size_t nterms, termsize;
+    uint32_t *table;            // Open addressing on the keyword hash, term number + 1
+    size_t tablesize;           // Power of two
+    index_pageocc_t *occ;
+    size_t nocc, occsize;
+    uint32_t *positions;        // Positions grouped per keyword and index
+    uint32_t wordpos[IDX_FIELDS];   // Next word position, per index
+} index_page_t;
+
+/* A record of the repository. Images have no title, their text is the alt texts
+   of the pages they were seen on, one per line */
+typedef struct {
+    const char *url, *title, *text;
+    size_t url_len, title_len, text_len;
+} index_record_t;
+
+/* An image in the image store, a record of its content type, a newline and the
+   image itself. The image is also at `offs' in file `fd', for sendfile() */
+typedef struct {
+    const char *type, *data;
+    size_t type_len, len;
+    int fd;
+    uint64_t offs;
+} index_image_t;
+
+/* A read-only memory mapping of a complete index file */
+typedef struct {
+    void *data;
+    size_t len;
+} index_map_t;
+
 /* Split `link' into its constituent words
    `buffer' will point to an array of null-terminated char*'s
    Return the number of words/buffers written. */
@@ -48,12 +136,19 @@ index_splitLink( char*** buffer, const char* link, size_t len );
 int
 index_isNonTrivialKeyword( const char* keyword );
 
-/* Tokenize inner-text from an html element
-   Returns pointer to the first non-empty token,
-   *buffer is changed by removing non-letter characters and HTML-entities
-   buffer points after the null-character of the first non-empty token */
+/* Tokenize inner-text from an html element, up to `end' which must point to
+   the terminating null-character.
+   Returns pointer to the first non-empty token, lowercased and UTF-8 encoded,
+   with HTML-entities decoded. Letters outside ASCII are part of words.
+   *buffer is changed in place, tokens may move towards its front.
+   buffer points after the delimiter of the first non-empty token */
 char*
-index_tokInner( char** buffer );
+index_tokInner( char** buffer, char* end );
+
+/* Return how much of the `len' bytes of keyword `word' is kept, at most
+   IDX_MAX_KWLEN without splitting a UTF-8 sequence */
+size_t
+index_keywordLen( const char* word, size_t len );
 
 /* Open `keyword' in `idx' and return its FILE* */
 FILE*
@@ -69,24 +164,100 @@ index_remove( index_t idx, const char* keyword );
 int
 index_append( index_t idx, const char* keyword, const docid_t* ids, size_t len );
 
+/* Delta-encode `n' ascending positions from `pos' into `buf'
+   Returns the number of bytes written, at most IDX_POS_MAXBYTES( n ) */
+size_t
+index_encodePositions( uint8_t* buf, const uint32_t* pos, size_t n );
+
+/* Decode at most `max' positions from the `len' bytes in `buf' into `pos'
+   Returns the number of positions decoded */
+size_t
+index_decodePositions( uint32_t* pos, size_t max, const uint8_t* buf, size_t len );
+
+/* Map the file at `path' into memory. An empty file gives an empty mapping.
+   Returns -1 on error */
+int
+index_mapOpen( index_map_t* map, const char* path );
+
+void
+index_mapClose( index_map_t* map );
+
+/* Tell the kernel how `len' bytes from `offs' will be used, `advice' is one of the
+   MADV_ constants from sys/mman.h. The range is widened to whole pages */
+void
+index_mapAdvise( const index_map_t* map, size_t offs, size_t len, int advice );
+
+/* Initialize an empty page aggregate for `docid' */
+void
+index_pageCreate( index_page_t* page, docid_t docid );
+
+/* Add a single occurrence of `word' to the page at the next position in `idx' */
+int
+index_pageAdd( index_page_t* page, index_t idx, const char* word );
+
+/* Add an occurrence of `word' at position `pos' in `idx', used to restore a page.
+   The positions of a keyword must be added in ascending order */
+int
+index_pageAddAt( index_page_t* page, index_t idx, const char* word, uint32_t pos );
+
+/* Add all words in `url' to the web index of the page */
+int
+index_pageAddUrl( index_page_t* page, const char* url, size_t len );
+
+/* Split html-innertext `str' into tokens and add them to the page */
+int
+index_pageAddInner( index_page_t* page, index_t idx, char* str );
+
+/* Group the positions of every keyword per index, after the last word was added.
+   Sets the `pos' arrays of the keywords. Returns -1 on error */
+int
+index_pageFinish( index_page_t* page );
+
+void
+index_pageFree( index_page_t* page );
+
 /* Append or create link index entry `link' and add `referer' to it */
 int 
 index_appendLinkidx( docid_t link, docid_t referer );
 
-/* Split html-innertext `str' into tokens and add `link' to all these keywords in index `idx' */
-int 
-index_appendHtmlInner( index_t idx, docid_t link, char* str );
+/* What the webspider stores in the repository for a page without a title or
+   without paragraph text. They are not keywords of the page */
+#define IDX_UNTITLED "Untitled"
+#define IDX_NODESCRIPTION "No description"
 
-/* Append or create web index entries for all words in `link' and add `docid' to them */
+/* Store the repository record of `docid': its URL, title and `data', each
+   terminated by a newline. `title' and `data' may be NULL, without a title
+   `data' follows an empty line */
 int
-index_appendWebidx( docid_t docid, const char* url, size_t len );
-
-/* Create a repository file for `docid' containing `data' */
-int
-index_appendRepository( docid_t docid, 
+index_appendRepository( packstore_t* repo, docid_t docid, 
         const char* url, size_t url_len, 
         const char* title, size_t title_len, 
         const char* data, size_t len );
 
+/* Look up the repository record of `docid' and split it into `rec', which points
+   into the store or `cache' (see packstore_get()).
+   Returns 0 on success, 1 if there is no record and -1 on error */
+int
+index_readRepository( packstore_t* repo, packstore_cache_t* cache, docid_t docid, index_record_t* rec );
+
+/* Return the content type of the image in `data' by its signature, or NULL if
+   it is not a known image format */
+const char*
+index_imageType( const char* data, size_t len );
+
+/* Put an image of content type `type' in the image store. Returns -1 on error */
+int
+index_appendImage( packstore_t* store, docid_t docid, const char* type, const char* data, size_t len );
+
+/* Write the image of `docid' to IDX_COLORCACHE, replacing an older copy. It is
+   written to a temporary dotfile first, so imgcompare never reads half an image.
+   Returns -1 on error */
+int
+index_exportImage( docid_t docid, const char* data, size_t len );
+
+/* Look up the image of `docid'. Returns 0 on success, 1 if there is none and -1 on error */
+int
+index_readImage( packstore_t* store, docid_t docid, index_image_t* img );
+
 
 #endif
@@ -0,0 +1,153 @@
+/*
+ * Websearch - index_test.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Checks the coding of word positions and the tokenizer of the page aggregate.
+ * Prints every failed check and returns the number of failures
+ */
+
+#define _GNU_SOURCE
+#include "index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed =0;
+
+#define CHECK( cond ) do { if( !(cond) ) { \
+    fprintf( stderr, "%s:%d: failed `%s'\n", __FILE__, __LINE__, #cond ); failed++; } } while( 0 )
+
+/* Encode `n' positions, decode them again and compare */
+static void
+check_positions( const uint32_t* pos, size_t n ) {
+    uint8_t *buf =malloc( IDX_POS_MAXBYTES( n ) + 1 );
+    uint32_t *out =malloc( sizeof( uint32_t ) * (n+1) );
+    size_t len =index_encodePositions( buf, pos, n );
+    CHECK( len <= IDX_POS_MAXBYTES( n ) );
+    CHECK( index_decodePositions( out, n, buf, len ) == n );
+    CHECK( memcmp( pos, out, sizeof( uint32_t ) * n ) == 0 );
+    // Decoding stops at `max'
+    if( n > 1 )
+        CHECK( index_decodePositions( out, n-1, buf, len ) == n-1 );
+    free( buf );
+    free( out );
+}
+
+static void
+test_positions( void ) {
+    uint32_t small[] ={ 0, 1, 2, 3, 127, 128, 129, 16383, 16384 };
+    check_positions( small, sizeof( small ) / sizeof( small[0] ) );
+
+    // Gaps of every encoded length, up to the largest position
+    uint32_t wide[] ={ 5, 5 + 0x7f, 5 + 0x7f + 0x3fff, 0x1fffff + 0x3fff, 0xfffffff, 0xfffffffe, 0xffffffff };
+    check_positions( wide, sizeof( wide ) / sizeof( wide[0] ) );
+
+    uint32_t one =0xffffffff;
+    check_positions( &one, 1 );
+    check_positions( NULL, 0 );
+
+    uint32_t *many =malloc( sizeof( uint32_t ) * 10000 );
+    uint32_t p =0;
+    srand( 1 );
+    for( size_t i =0; i < 10000; i++ )
+        many[i] =p +=rand() % ( i % 100 == 0 ? 100000 : 20 );
+    check_positions( many, 10000 );
+    free( many );
+
+    // A truncated stream decodes what is complete
+    uint8_t buf[16];
+    uint32_t pos[2] ={ 1, 300 }, out[2];
+    size_t len =index_encodePositions( buf, pos, 2 );
+    CHECK( len == 3 );
+    CHECK( index_decodePositions( out, 2, buf, 1 ) == 1 && out[0] == 1 );
+}
+
+/* Tokenize `text' into a page and compare its keywords with the `n' in `words',
+   in order of first occurrence */
+static void
+check_tokens( const char* text, const char** words, size_t n ) {
+    index_page_t page;
+    char *copy =strdup( text );
+    index_pageCreate( &page, 1 );
+    CHECK( index_pageAddInner( &page, IDX_PAGEIDX, copy ) == 0 );
+    CHECK( index_pageFinish( &page ) == 0 );
+    if( page.nterms != n ) {
+        fprintf( stderr, "%s:%d: `%s' has %zu keywords, not %zu\n", __FILE__, __LINE__, text, page.nterms, n );
+        failed++;
+    }
+    for( size_t i =0; i < n && i < page.nterms; i++ ) {
+        if( page.terms[i].len != strlen( words[i] ) || memcmp( page.terms[i].word, words[i], page.terms[i].len ) != 0 ) {
+            fprintf( stderr, "%s:%d: `%s' keyword %zu is `%.*s', not `%s'\n", __FILE__, __LINE__,
+                    text, i, (int)page.terms[i].len, page.terms[i].word, words[i] );
+            failed++;
+        }
+    }
+    index_pageFree( &page );
+    free( copy );
+}
+
+static void
+test_tokenizer( void ) {
+    const char *ascii[] ={ "hello", "world", "co-op", "x86" };
+    check_tokens( "Hello, WORLD! co-op x86 hello", ascii, 4 );
+
+    // Long enough for the 16-byte fast path, with a delimiter inside a block
+    const char *runs[] ={ "abcdefghijklmnopqrstuvwxyz0123456789", "abcdefghijklmnop", "q" };
+    check_tokens( "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 abcdefghijklmnop.q", runs, 3 );
+
+    // Symbols such as the euro sign and unknown entities delimit words
+    const char *entities[] ={ "café", "naïve", "o", "neill", "5", "x" };
+    check_tokens( "Caf&eacute; na&#239;ve &amp; O&apos;Neill &euro;5 &bogus;x&#0;", entities, 6 );
+
+    const char *utf8[] ={ "école", "straße", "αβγ", "москва", "東京", "quoted" };
+    check_tokens( "ÉCOLE Straße ΑΒΓ МОСКВА 東京 — “quoted”", utf8, 6 );
+
+    // Invalid UTF-8 delimits words
+    const char *invalid[] ={ "ab", "cd", "ef" };
+    check_tokens( "ab\xc0\xaf" "cd\xed\xa0\x80" "ef\xff", invalid, 3 );
+
+    // Keywords are cut to IDX_MAX_KWLEN bytes without splitting a character
+    char text[IDX_MAX_KWLEN + 64], word[IDX_MAX_KWLEN + 64];
+    memset( text, 'a', IDX_MAX_KWLEN - 1 );
+    strcpy( text + IDX_MAX_KWLEN - 1, "éé" );
+    memcpy( word, text, IDX_MAX_KWLEN - 1 );
+    word[IDX_MAX_KWLEN - 1] =0;
+    const char *cut[] ={ word };
+    check_tokens( text, cut, 1 );
+    CHECK( index_keywordLen( text, strlen( text ) ) == IDX_MAX_KWLEN - 1 );
+    CHECK( index_keywordLen( text, IDX_MAX_KWLEN ) == IDX_MAX_KWLEN );
+    memset( text, 'b', IDX_MAX_KWLEN + 10 );
+    text[IDX_MAX_KWLEN + 10] =0;
+    CHECK( index_keywordLen( text, strlen( text ) ) == IDX_MAX_KWLEN );
+}
+
+static void
+test_page( void ) {
+    // Positions are counted per index and grouped per keyword
+    index_page_t page;
+    char title[] ="one two one", text[] ="two three two two";
+    index_pageCreate( &page, 1 );
+    CHECK( index_pageAddInner( &page, IDX_TITLEIDX, title ) == 0 );
+    CHECK( index_pageAddInner( &page, IDX_PAGEIDX, text ) == 0 );
+    CHECK( index_pageFinish( &page ) == 0 );
+    CHECK( page.nterms == 3 );
+    CHECK( page.wordpos[IDX_TITLEIDX] == 3 && page.wordpos[IDX_PAGEIDX] == 4 );
+    const index_pageterm_t *two =&page.terms[1];
+    CHECK( two->len == 3 && memcmp( two->word, "two", 3 ) == 0 );
+    CHECK( two->fields == ( (1u << IDX_TITLEIDX) | (1u << IDX_PAGEIDX) ) );
+    CHECK( two->tf[IDX_TITLEIDX] == 1 && two->pos[IDX_TITLEIDX][0] == 1 );
+    CHECK( two->tf[IDX_PAGEIDX] == 3 && two->pos[IDX_PAGEIDX][0] == 0
+            && two->pos[IDX_PAGEIDX][1] == 2 && two->pos[IDX_PAGEIDX][2] == 3 );
+    index_pageFree( &page );
+}
+
+int main( int argc, char** argv ) {
+    test_positions( );
+    test_tokenizer( );
+    test_page( );
+    if( failed )
+        fprintf( stderr, "%d checks failed\n", failed );
+    return failed;
+}
@@ -0,0 +1,79 @@
+/*
+ * Websearch - indexmerge_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Merges index segments according to the tiered merge policy in segment.c.
+ * Can be run once, or in the background next to a running webspider.
+ */
+
+#define _GNU_SOURCE
+#include "segment.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-f] [-w seconds] - Merge index segments\n", name );
+    fprintf( stderr, "\t-f\t\tmerge all segments into one\n" );
+    fprintf( stderr, "\t-w seconds\tkeep running, check for work every `seconds'\n" );
+}
+
+/* Run merges until the policy is satisfied, returns the number of merges or -1 */
+int
+merge_pass( int full ) {
+    int merges =0;
+    while( 1 ) {
+        segment_set_t set;
+        if( segment_setOpen( &set ) != 0 )
+            return -1;
+
+        size_t first =0, count;
+        if( full )
+            count =set.count > 1 ? set.count : 0;
+        else
+            count =segment_mergePolicy( &set.manifest, &first );
+
+        int err =0;
+        if( count )
+            err =segment_merge( &set, first, count );
+        segment_setClose( &set );
+
+        if( err )
+            return -1;
+        if( !count || full )
+            break;
+        merges++;
+    }
+    return merges;
+}
+
+int main( int argc, char** argv ) {
+    int full =0;
+    int wait =0;
+
+    for( int i =1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-f" ) == 0 )
+            full =1;
+        else if( strcmp( argv[i], "-w" ) == 0 && i+1 < argc )
+            wait =atoi( argv[++i] );
+        else {
+            show_help( *argv );
+            return 0;
+        }
+    }
+
+    do {
+        if( merge_pass( full ) < 0 ) {
+            fprintf( stderr, "ERROR: merging failed\n" );
+            return -1;
+        }
+        if( wait )
+            sleep( wait );
+    } while( wait );
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Websearch - linkgraph.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Compressed graph of the links between documents
+ */
+
+#define _GNU_SOURCE
+#include "linkgraph.h"
+#include "index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A link while the graph is built */
+typedef struct {
+    uint32_t to, from;
+} link_t;
+
+static int
+ordinal_compare( const void* left, const void* right ) {
+    uint64_t l =*(const uint64_t*)left, r =*(const uint64_t*)right;
+    return l < r ? -1 : l > r;
+}
+
+/* Add the links into the document of file `name' in the link index to `links'.
+   Returns -1 on error */
+static int
+load_file( const doctable_t* docs, const char* name, link_t** links, size_t* count, size_t* size,
+        docid_t** buf, size_t* bufsize ) {
+    char *end;
+    docid_t docid =strtoull( name, &end, 16 );
+    uint64_t to =*end ? DOCTABLE_NONE : doctable_find( docs, docid );
+    if( to == DOCTABLE_NONE || to >= UINT32_MAX )
+        return 0;
+
+    FILE *file =index_open( IDX_LINKIDX, name, IDX_OPEN_READ );
+    if( file == NULL )
+        return -1;
+    size_t n =0, got;
+    do {
+        if( n == *bufsize ) {
+            docid_t *b =realloc( *buf, sizeof( docid_t ) * ( *bufsize * 2 + 256 ) );
+            if( b == NULL ) {
+                fclose( file );
+                return -1;
+            }
+            *buf =b;
+            *bufsize =*bufsize * 2 + 256;
+        }
+        got =fread( *buf + n, sizeof( docid_t ), *bufsize - n, file );
+        n +=got;
+    } while( got > 0 );
+    fclose( file );
+
+    // A page that links to another twice counts once, links to itself not at all
+    uint64_t *from =*buf;
+    size_t m =0;
+    for( size_t i =0; i < n; i++ ) {
+        uint64_t o =doctable_find( docs, (*buf)[i] );
+        if( o != DOCTABLE_NONE && o != to && o < UINT32_MAX )
+            from[m++] =o;
+    }
+    qsort( from, m, sizeof( uint64_t ), ordinal_compare );
+
+    for( size_t i =0; i < m; i++ ) {
+        if( i > 0 && from[i] == from[i-1] )
+            continue;
+        if( *count == *size ) {
+            link_t *l =realloc( *links, sizeof( link_t ) * ( *size * 2 + 1024 ) );
+            if( l == NULL )
+                return -1;
+            *links =l;
+            *size =*size * 2 + 1024;
+        }
+        (*links)[*count].to =to;
+        (*links)[(*count)++].from =from[i];
+    }
+    return 0;
+}
+
+/* Encode the lists of `n' documents, whose neighbours are adj[off[v]] up to
+   adj[off[v+1]], into `buf' and replace `off' by their byte offsets.
+   Returns the number of bytes */
+static uint64_t
+encode_lists( uint8_t* buf, uint64_t* off, const uint32_t* adj, uint32_t n ) {
+    uint64_t len =0, first =off[0];
+    for( uint32_t v =0; v < n; v++ ) {
+        uint32_t deg =off[v+1] - first;
+        len +=index_encodePositions( buf + len, &deg, 1 );
+        len +=index_encodePositions( buf + len, adj + first, deg );
+        first =off[v+1];
+        off[v+1] =len;
+    }
+    off[0] =0;
+    return len;
+}
+
+int
+linkgraph_build( const doctable_t* docs ) {
+    link_t *links =NULL;
+    docid_t *buf =NULL;
+    uint64_t *outoff =NULL, *inoff =NULL, *at =NULL;
+    uint32_t *out =NULL, *in =NULL;
+    uint8_t *outbuf =NULL, *inbuf =NULL;
+    FILE *file =NULL;
+    size_t count =0, size =0, bufsize =0;
+    linkgraph_hdr_t hdr;
+
+    memset( &hdr, 0, sizeof( linkgraph_hdr_t ) );
+    if( doctable_count( docs ) >= UINT32_MAX ) {
+        errno =EFBIG;
+        goto err;
+    }
+    if( mkdir( LINKGRAPH_PATH, 0755 ) != 0 && errno != EEXIST )
+        goto err;
+    uint32_t n =doctable_count( docs );
+
+    DIR *dir =opendir( IDX_PATH[IDX_LINKIDX] );
+    struct dirent *ent;
+    if( dir == NULL ) goto err;
+    while( ( ent =readdir( dir ) ) != NULL ) {
+        if( ent->d_name[0] == '.' )
+            continue;
+        if( load_file( docs, ent->d_name, &links, &count, &size, &buf, &bufsize ) != 0 ) {
+            closedir( dir );
+            goto err;
+        }
+    }
+    closedir( dir );
+
+    // Every file holds all links into one document, so they only have to be put in order
+    outoff =calloc( (size_t)n + 1, sizeof( uint64_t ) );
+    inoff =calloc( (size_t)n + 1, sizeof( uint64_t ) );
+    at =malloc( sizeof( uint64_t ) * ( (size_t)n + 1 ) );
+    out =malloc( sizeof( uint32_t ) * ( count + 1 ) );
+    in =malloc( sizeof( uint32_t ) * ( count + 1 ) );
+    if( outoff == NULL || inoff == NULL || at == NULL || out == NULL || in == NULL )
+        goto err;
+    for( size_t i =0; i < count; i++ ) {
+        inoff[links[i].to + 1]++;
+        outoff[links[i].from + 1]++;
+    }
+    for( uint32_t v =0; v < n; v++ ) {
+        inoff[v+1] +=inoff[v];
+        outoff[v+1] +=outoff[v];
+    }
+    memcpy( at, inoff, sizeof( uint64_t ) * n );
+    for( size_t i =0; i < count; i++ )
+        in[at[links[i].to]++] =links[i].from;
+    // Going through the targets in order leaves the links from every page in order too
+    memcpy( at, outoff, sizeof( uint64_t ) * n );
+    for( uint32_t v =0; v < n; v++ )
+        for( uint64_t i =inoff[v]; i < inoff[v+1]; i++ )
+            out[at[in[i]]++] =v;
+    free( links );
+    links =NULL;
+
+    size_t maxlen =IDX_POS_MAXBYTES( count + (size_t)n ) + 1;
+    outbuf =malloc( maxlen );
+    inbuf =malloc( maxlen );
+    if( outbuf == NULL || inbuf == NULL )
+        goto err;
+    hdr.magic =LINKGRAPH_MAGIC;
+    hdr.version =LINKGRAPH_VERSION;
+    hdr.n =n;
+    hdr.nlinks =count;
+    hdr.outlen =encode_lists( outbuf, outoff, out, n );
+    hdr.inlen =encode_lists( inbuf, inoff, in, n );
+
+    // Readers keep the graph they opened until they see the new file
+    file =fopen( LINKGRAPH_TMP, "wb" );
+    if( file == NULL
+            || fwrite( &hdr, sizeof( linkgraph_hdr_t ), 1, file ) != 1
+            || fwrite( outoff, sizeof( uint64_t ), (size_t)n + 1, file ) != (size_t)n + 1
+            || fwrite( inoff, sizeof( uint64_t ), (size_t)n + 1, file ) != (size_t)n + 1
+            || fwrite( outbuf, 1, hdr.outlen, file ) != hdr.outlen
+            || fwrite( inbuf, 1, hdr.inlen, file ) != hdr.inlen
+            || fflush( file ) != 0 || fsync( fileno( file ) ) != 0 )
+        goto err;
+    int err =fclose( file );
+    file =NULL;
+    if( err != 0 || rename( LINKGRAPH_TMP, LINKGRAPH_FILE ) != 0 )
+        goto err;
+
+    free( buf );
+    free( outoff );
+    free( inoff );
+    free( at );
+    free( out );
+    free( in );
+    free( outbuf );
+    free( inbuf );
+    return 0;
+
+err:
+    fprintf( stderr, "linkgraph_build(): %s\n", strerror( errno ) );
+    if( file != NULL ) {
+        fclose( file );
+        unlink( LINKGRAPH_TMP );
+    }
+    free( links );
+    free( buf );
+    free( outoff );
+    free( inoff );
+    free( at );
+    free( out );
+    free( in );
+    free( outbuf );
+    free( inbuf );
+    return -1;
+}
+
+int
+linkgraph_open( linkgraph_t* g ) {
+    struct stat st;
+    memset( g, 0, sizeof( linkgraph_t ) );
+    g->fd =open( LINKGRAPH_FILE, O_RDONLY );
+    if( g->fd < 0 || fstat( g->fd, &st ) != 0 )
+        goto err;
+    if( st.st_size < sizeof( linkgraph_hdr_t ) ) {
+        errno =EINVAL;
+        goto err;
+    }
+    g->map =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, g->fd, 0 );
+    if( g->map == MAP_FAILED ) {
+        g->map =NULL;
+        goto err;
+    }
+    g->len =st.st_size;
+    const linkgraph_hdr_t *hdr =g->map;
+    if( hdr->magic != LINKGRAPH_MAGIC || hdr->version != LINKGRAPH_VERSION
+            || g->len != sizeof( linkgraph_hdr_t ) + 2 * sizeof( uint64_t ) * ( (size_t)hdr->n + 1 )
+                    + hdr->outlen + hdr->inlen ) {
+        errno =EINVAL;
+        goto err;
+    }
+    g->n =hdr->n;
+    g->nlinks =hdr->nlinks;
+    g->outoff =(const uint64_t*)( hdr + 1 );
+    g->inoff =g->outoff + g->n + 1;
+    g->out =(const uint8_t*)( g->inoff + g->n + 1 );
+    g->in =g->out + hdr->outlen;
+    return 0;
+
+err:
+    fprintf( stderr, "linkgraph_open(): %s\n", strerror( errno ) );
+    linkgraph_close( g );
+    return -1;
+}
+
+void
+linkgraph_close( linkgraph_t* g ) {
+    if( g->map )
+        munmap( g->map, g->len );
+    if( g->fd >= 0 )
+        close( g->fd );
+    memset( g, 0, sizeof( linkgraph_t ) );
+    g->fd =-1;
+}
+
+static inline uint32_t
+read_varint( const uint8_t** p ) {
+    uint32_t v =0;
+    int shift =0;
+    while( **p & 0x80 ) {
+        v |=(uint32_t)( *(*p)++ & 0x7f ) << shift;
+        shift +=7;
+    }
+    v |=(uint32_t)*(*p)++ << shift;
+    return v;
+}
+
+static void
+list_start( const uint8_t* list, linkgraph_iter_t* it ) {
+    it->p =list;
+    it->left =read_varint( &it->p );
+    it->prev =0;
+}
+
+uint32_t
+linkgraph_outdeg( const linkgraph_t* g, uint32_t v ) {
+    if( v >= g->n )
+        return 0;
+    const uint8_t *p =g->out + g->outoff[v];
+    return read_varint( &p );
+}
+
+uint32_t
+linkgraph_indeg( const linkgraph_t* g, uint32_t v ) {
+    if( v >= g->n )
+        return 0;
+    const uint8_t *p =g->in + g->inoff[v];
+    return read_varint( &p );
+}
+
+void
+linkgraph_out( const linkgraph_t* g, uint32_t v, linkgraph_iter_t* it ) {
+    memset( it, 0, sizeof( linkgraph_iter_t ) );
+    if( v < g->n )
+        list_start( g->out + g->outoff[v], it );
+}
+
+void
+linkgraph_in( const linkgraph_t* g, uint32_t v, linkgraph_iter_t* it ) {
+    memset( it, 0, sizeof( linkgraph_iter_t ) );
+    if( v < g->n )
+        list_start( g->in + g->inoff[v], it );
+}
+
+int
+linkgraph_next( linkgraph_iter_t* it, uint32_t* v ) {
+    if( it->left == 0 )
+        return 0;
+    it->left--;
+    *v =it->prev +=read_varint( &it->p );
+    return 1;
+}
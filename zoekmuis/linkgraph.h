@@ -0,0 +1,95 @@
+/*
+ * Websearch - linkgraph.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * The links between documents as a graph over the ordinals of the document
+ * table, built from the link index. The link index has a file per document with
+ * the DOCIDs of the pages that link to it, every time they were crawled; the
+ * graph has every link once, both from the page that links and to the page that
+ * is linked to, so the neighbours of a document in either direction are read at
+ * once. linkgraph/graph holds
+ *  linkgraph_hdr_t
+ *  uint64_t out[n+1]   offsets of the lists of the links from every document
+ *  uint64_t in[n+1]    offsets of the lists of the links to every document
+ *  the lists of links from documents, then those of the links to them
+ * A list is the number of neighbours followed by their ordinals in ascending
+ * order, as delta encoded varints like the positions of the index. The file is
+ * replaced as a whole. Documents that were added to the table after it was
+ * built have no links.
+ */
+
+#ifndef LINKGRAPH_H
+#define LINKGRAPH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "doctable.h"
+
+#define LINKGRAPH_PATH "linkgraph/"
+#define LINKGRAPH_FILE LINKGRAPH_PATH "graph"
+#define LINKGRAPH_TMP LINKGRAPH_PATH "graph.tmp"
+#define LINKGRAPH_MAGIC 0x474c4d5a      // "ZMLG"
+#define LINKGRAPH_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n;                 // Number of documents
+    uint32_t pad;
+    uint64_t nlinks;
+    uint64_t outlen, inlen;     // Bytes of the lists in either direction
+} linkgraph_hdr_t;
+
+typedef struct {
+    int fd;
+    void *map;
+    size_t len;
+    uint32_t n;
+    uint64_t nlinks;
+    const uint64_t *outoff, *inoff;
+    const uint8_t *out, *in;
+} linkgraph_t;
+
+/* Neighbours of a document in one direction */
+typedef struct {
+    const uint8_t *p;
+    uint32_t left;
+    uint32_t prev;
+} linkgraph_iter_t;
+
+/* Build the graph of the documents in `docs' from the link index and replace
+   the one on disk. Links from or to documents that are not in the table are
+   left out, as are links of a page to itself. Returns -1 on error */
+int
+linkgraph_build( const doctable_t* docs );
+
+/* Map the graph. Returns -1 on error, or if it was never built */
+int
+linkgraph_open( linkgraph_t* g );
+
+void
+linkgraph_close( linkgraph_t* g );
+
+/* Return the number of documents `v' links to */
+uint32_t
+linkgraph_outdeg( const linkgraph_t* g, uint32_t v );
+
+/* Return the number of documents that link to `v' */
+uint32_t
+linkgraph_indeg( const linkgraph_t* g, uint32_t v );
+
+/* Start iterating over the documents `v' links to */
+void
+linkgraph_out( const linkgraph_t* g, uint32_t v, linkgraph_iter_t* it );
+
+/* Start iterating over the documents that link to `v' */
+void
+linkgraph_in( const linkgraph_t* g, uint32_t v, linkgraph_iter_t* it );
+
+/* Set `v' to the next neighbour. Returns 0 when there are no more */
+int
+linkgraph_next( linkgraph_iter_t* it, uint32_t* v );
+
+#endif
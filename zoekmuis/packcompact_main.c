@@ -0,0 +1,50 @@
+/*
+ * Websearch - packcompact_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Compacts packed stores, dropping records that have been replaced.
+ * Can not run while the webspider is writing to the store.
+ */
+
+#include "packstore.h"
+#include "index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-z] [store ...] - Compact packed stores, the repository by default\n", name );
+    fprintf( stderr, "\t-z\tdeflate stores that are not compressed yet\n" );
+}
+
+int main( int argc, char** argv ) {
+    const char *def[] ={ IDX_PATH[IDX_REPOSITORY] };
+    const char **stores =def;
+    int count =1, mode =0, i =1;
+
+    if( i < argc && strcmp( argv[i], "-z" ) == 0 ) {
+        mode =PACKSTORE_DEFLATE;
+        i++;
+    }
+    if( i < argc ) {
+        if( argv[i][0] == '-' ) {
+            show_help( *argv );
+            return 0;
+        }
+        stores =(const char**)argv + i;
+        count =argc - i;
+    }
+
+    for( i =0; i < count; i++ ) {
+        long long reclaimed =packstore_compact( stores[i], mode );
+        if( reclaimed < 0 ) {
+            fprintf( stderr, "ERROR: could not compact `%s'\n", stores[i] );
+            return -1;
+        }
+        fprintf( stderr, "Compacted `%s', reclaimed %lld bytes\n", stores[i], reclaimed );
+    }
+    return 0;
+}
@@ -0,0 +1,808 @@
+/*
+ * Websearch - packstore.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Log-structured blob store with a memory mapped index, optionally deflated
+ */
+
+#define _GNU_SOURCE
+#include "packstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define PACKSTORE_INDEX "index"
+#define PACKSTORE_INDEX_TMP "index.tmp"
+#define PACKSTORE_COMPACT ".compact"
+
+static void
+store_path( const packstore_t* s, char* buf, const char* name ) {
+    snprintf( buf, PACKSTORE_PATHLEN + 32, "%s/%s", s->path, name );
+}
+
+static void
+data_path( const packstore_t* s, char* buf, uint32_t file ) {
+    snprintf( buf, PACKSTORE_PATHLEN + 32, "%s/data.%04u", s->path, file );
+}
+
+static inline uint64_t
+slot_hash( docid_t docid ) {
+    // DOCIDs are hashes already, just spread the high bits
+    return ( docid * 0x9e3779b97f4a7c15ull ) >> 17;
+}
+
+/* Point `docid' at `loc', the location is written last */
+static void
+slots_insert( packstore_slot_t* slots, uint64_t capacity, uint64_t* count, docid_t docid, uint64_t loc ) {
+    uint64_t h =slot_hash( docid ) & (capacity-1);
+    while( 1 ) {
+        packstore_slot_t *slot =&slots[h];
+        uint64_t cur =__atomic_load_n( &slot->loc, __ATOMIC_ACQUIRE );
+        if( cur == 0 ) {
+            slot->docid =docid;
+            __atomic_store_n( &slot->loc, loc, __ATOMIC_RELEASE );
+            (*count)++;
+            return;
+        }
+        if( slot->docid == docid ) {
+            __atomic_store_n( &slot->loc, loc, __ATOMIC_RELEASE );
+            return;
+        }
+        h =(h+1) & (capacity-1);
+    }
+}
+
+static uint64_t
+slots_find( const packstore_t* s, docid_t docid ) {
+    uint64_t capacity =s->hdr->capacity;
+    uint64_t h =slot_hash( docid ) & (capacity-1);
+    for( uint64_t i =0; i < capacity; i++ ) {
+        const packstore_slot_t *slot =&s->slots[h];
+        uint64_t loc =__atomic_load_n( &slot->loc, __ATOMIC_ACQUIRE );
+        if( loc == 0 )
+            return 0;
+        if( slot->docid == docid )
+            return loc;
+        h =(h+1) & (capacity-1);
+    }
+    return 0;
+}
+
+/* Create an empty index with `capacity' slots in `fd' */
+static int
+index_create( int fd, uint64_t capacity, uint32_t nextfile, uint32_t flags ) {
+    packstore_hdr_t hdr;
+    memset( &hdr, 0, sizeof( packstore_hdr_t ) );
+    hdr.magic =PACKSTORE_MAGIC;
+    hdr.version =PACKSTORE_VERSION;
+    hdr.capacity =capacity;
+    hdr.nextfile =nextfile;
+    hdr.flags =flags;
+
+    if( ftruncate( fd, sizeof( packstore_hdr_t ) + capacity * sizeof( packstore_slot_t ) ) != 0 )
+        return -1;
+    if( pwrite( fd, &hdr, sizeof( packstore_hdr_t ), 0 ) != sizeof( packstore_hdr_t ) )
+        return -1;
+    return 0;
+}
+
+static int
+index_map( packstore_t* s ) {
+    struct stat st;
+    if( fstat( s->fd, &st ) != 0 )
+        return -1;
+    int prot =s->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *base =mmap( NULL, st.st_size, prot, MAP_SHARED, s->fd, 0 );
+    if( base == MAP_FAILED )
+        return -1;
+
+    packstore_hdr_t *hdr =base;
+    if( st.st_size < sizeof( packstore_hdr_t ) || hdr->magic != PACKSTORE_MAGIC || hdr->version != PACKSTORE_VERSION
+            || st.st_size != sizeof( packstore_hdr_t ) + hdr->capacity * sizeof( packstore_slot_t ) ) {
+        munmap( base, st.st_size );
+        errno =EINVAL;
+        return -1;
+    }
+    s->base =base;
+    s->len =st.st_size;
+    s->hdr =hdr;
+    s->slots =(packstore_slot_t*)( hdr + 1 );
+    return 0;
+}
+
+/* Double the capacity of the index. The new index replaces the old one
+   atomically, readers that still map the old one keep a consistent view */
+static int
+index_grow( packstore_t* s ) {
+    char path[PACKSTORE_PATHLEN + 32], tmp[PACKSTORE_PATHLEN + 32];
+    store_path( s, path, PACKSTORE_INDEX );
+    store_path( s, tmp, PACKSTORE_INDEX_TMP );
+
+    int fd =open( tmp, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) return -1;
+    uint64_t capacity =s->hdr->capacity * 2;
+    if( flock( fd, LOCK_EX ) != 0 || index_create( fd, capacity, s->hdr->nextfile, s->hdr->flags ) != 0 )
+        goto err;
+
+    size_t len =sizeof( packstore_hdr_t ) + capacity * sizeof( packstore_slot_t );
+    void *base =mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( base == MAP_FAILED ) goto err;
+    packstore_hdr_t *hdr =base;
+    packstore_slot_t *slots =(packstore_slot_t*)( hdr + 1 );
+    for( uint64_t i =0; i < s->hdr->capacity; i++ )
+        if( s->slots[i].loc )
+            slots_insert( slots, capacity, &hdr->count, s->slots[i].docid, s->slots[i].loc );
+
+    if( msync( base, len, MS_SYNC ) != 0 || rename( tmp, path ) != 0 ) {
+        munmap( base, len );
+        goto err;
+    }
+
+    munmap( s->base, s->len );
+    close( s->fd );
+    s->fd =fd;
+    s->base =base;
+    s->len =len;
+    s->hdr =hdr;
+    s->slots =slots;
+    return 0;
+
+err:
+    fprintf( stderr, "index_grow(): %s\n", strerror( errno ) );
+    close( fd );
+    unlink( tmp );
+    return -1;
+}
+
+/* Open the data file to append to, starting a new one if there is none,
+   the last one is full or `next' is set */
+static int
+data_openAppend( packstore_t* s, int next ) {
+    char path[PACKSTORE_PATHLEN + 32];
+    if( s->datafd >= 0 )
+        close( s->datafd );
+    s->datafd =-1;
+
+    if( s->hdr->nextfile > 1 && !next ) {
+        s->datafile =s->hdr->nextfile - 1;
+        data_path( s, path, s->datafile );
+        s->datafd =open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+        if( s->datafd < 0 ) return -1;
+        off_t end =lseek( s->datafd, 0, SEEK_END );
+        if( end < 0 ) return -1;
+        s->dataend =end;
+        if( s->dataend < PACKSTORE_FILE_MAX )
+            return 0;
+        close( s->datafd );
+    }
+
+    if( s->hdr->nextfile >= (1u << 16) ) {
+        errno =EFBIG;
+        return -1;
+    }
+    s->datafile =s->hdr->nextfile++;
+    data_path( s, path, s->datafile );
+    s->datafd =open( path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644 );
+    s->dataend =0;
+    return s->datafd < 0 ? -1 : 0;
+}
+
+int
+packstore_open( packstore_t* s, const char* path, int mode ) {
+    char file[PACKSTORE_PATHLEN + 32];
+    int writable =mode & PACKSTORE_WRITE;
+    memset( s, 0, sizeof( packstore_t ) );
+    s->fd =s->datafd =-1;
+    s->writable =writable;
+    pthread_mutex_init( &s->lock, NULL );
+    pthread_mutex_init( &s->wlock, NULL );
+    if( strlen( path ) >= PACKSTORE_PATHLEN ) {
+        errno =ENAMETOOLONG;
+        goto err;
+    }
+    strcpy( s->path, path );
+
+    if( writable && mkdir( path, 0755 ) != 0 && errno != EEXIST )
+        goto err;
+    store_path( s, file, PACKSTORE_INDEX );
+    s->fd =open( file, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644 );
+    if( s->fd < 0 ) {
+        // A store that was never written to is empty
+        if( !writable && errno == ENOENT )
+            return 0;
+        goto err;
+    }
+    if( writable ) {
+        struct stat st;
+        if( flock( s->fd, LOCK_EX | LOCK_NB ) != 0 || fstat( s->fd, &st ) != 0 )
+            goto err;
+        if( st.st_size == 0 && index_create( s->fd, PACKSTORE_SLOTS_INIT, 1, mode & PACKSTORE_DEFLATE ) != 0 )
+            goto err;
+    }
+    if( index_map( s ) != 0 )
+        goto err;
+    if( writable && data_openAppend( s, 0 ) != 0 )
+        goto err;
+    return 0;
+
+err:
+    fprintf( stderr, "packstore_open(): %s: %s\n", path, strerror( errno ) );
+    packstore_close( s );
+    return -1;
+}
+
+static int
+block_write( packstore_t* s );
+
+void
+packstore_close( packstore_t* s ) {
+    if( s->writable && s->hdr != NULL )
+        block_write( s );
+    if( s->base )
+        munmap( s->base, s->len );
+    if( s->fd >= 0 )
+        close( s->fd );
+    if( s->datafd >= 0 )
+        close( s->datafd );
+    for( size_t i =0; i < s->nmaps; i++ ) {
+        packstore_map_t *m =&s->maps[i];
+        if( m->data )
+            munmap( m->data, m->len );
+        if( m->fd >= 0 )
+            close( m->fd );
+        while( m->old != NULL ) {
+            packstore_map_t *old =m->old;
+            munmap( old->data, old->len );
+            m->old =old->old;
+            free( old );
+        }
+    }
+    free( s->maps );
+    free( s->block );
+    free( s->pending );
+    pthread_mutex_destroy( &s->lock );
+    pthread_mutex_destroy( &s->wlock );
+    s->maps =NULL;
+    s->nmaps =0;
+    s->block =NULL;
+    s->pending =NULL;
+    s->blocklen =s->blocksize =s->npending =s->pendingsize =0;
+    s->base =NULL;
+    s->hdr =NULL;
+    s->fd =s->datafd =-1;
+}
+
+/* Add a record to the block that is being built */
+static int
+block_append( packstore_t* s, const packstore_rechdr_t* hdr, const struct iovec* iov, int n ) {
+    size_t need =s->blocklen + sizeof( packstore_rechdr_t ) + hdr->len;
+    if( need > UINT32_MAX ) {
+        errno =EFBIG;
+        return -1;
+    }
+    // A block is written to the current data file, unless that is full
+    if( s->blocklen == 0 && s->dataend >= PACKSTORE_FILE_MAX && data_openAppend( s, 1 ) != 0 )
+        return -1;
+
+    if( need > s->blocksize ) {
+        size_t size =need > PACKSTORE_BLOCK_SIZE * 2 ? need : PACKSTORE_BLOCK_SIZE * 2;
+        char *block =realloc( s->block, size );
+        if( block == NULL ) return -1;
+        s->block =block;
+        s->blocksize =size;
+    }
+    if( s->npending == s->pendingsize ) {
+        size_t size =s->pendingsize ? s->pendingsize * 2 : 64;
+        packstore_slot_t *pending =realloc( s->pending, sizeof( packstore_slot_t ) * size );
+        if( pending == NULL ) return -1;
+        s->pending =pending;
+        s->pendingsize =size;
+    }
+
+    packstore_slot_t *slot =&s->pending[s->npending++];
+    slot->docid =hdr->docid;
+    slot->loc =PACKSTORE_LOC( s->datafile, PACKSTORE_BLOCK_OFFS( s->dataend, s->blocklen ) );
+    memcpy( s->block + s->blocklen, hdr, sizeof( packstore_rechdr_t ) );
+    s->blocklen +=sizeof( packstore_rechdr_t );
+    for( int i =0; i < n; i++ ) {
+        memcpy( s->block + s->blocklen, iov[i].iov_base, iov[i].iov_len );
+        s->blocklen +=iov[i].iov_len;
+    }
+    return 0;
+}
+
+/* Deflate the block that is being built and append it, then publish its records */
+static int
+block_write( packstore_t* s ) {
+    packstore_blkhdr_t hdr;
+    char *out =NULL;
+    if( s->blocklen == 0 )
+        return 0;
+
+    uLongf clen =compressBound( s->blocklen );
+    if( ( out =malloc( clen ) ) == NULL )
+        goto err;
+    if( compress2( (Bytef*)out, &clen, (const Bytef*)s->block, s->blocklen, Z_DEFAULT_COMPRESSION ) != Z_OK
+            || clen > UINT32_MAX ) {
+        errno =EIO;
+        goto err;
+    }
+    hdr.magic =PACKSTORE_BLKMAGIC;
+    hdr.clen =clen;
+    hdr.ulen =s->blocklen;
+    hdr.pad =0;
+
+    struct iovec v[2] ={ { &hdr, sizeof( packstore_blkhdr_t ) }, { out, clen } };
+    ssize_t w =writev( s->datafd, v, 2 );
+    if( w != sizeof( packstore_blkhdr_t ) + clen ) {
+        // Do not leave a partial block behind, the records stay pending
+        if( w >= 0 ) {
+            if( ftruncate( s->datafd, s->dataend ) != 0 ) goto err;
+            errno =EIO;
+        }
+        goto err;
+    }
+    s->dataend +=w;
+    free( out );
+    out =NULL;
+
+    // Only now the records can be found
+    for( size_t i =0; i < s->npending; i++ ) {
+        if( ( s->hdr->count + 1 ) * 10 > s->hdr->capacity * 7 && index_grow( s ) != 0 )
+            return -1;
+        slots_insert( s->slots, s->hdr->capacity, &s->hdr->count, s->pending[i].docid, s->pending[i].loc );
+    }
+    s->blocklen =0;
+    s->npending =0;
+    return 0;
+
+err:
+    fprintf( stderr, "block_write(): %s\n", strerror( errno ) );
+    free( out );
+    return -1;
+}
+
+int
+packstore_flush( packstore_t* s ) {
+    pthread_mutex_lock( &s->wlock );
+    int err =block_write( s );
+    pthread_mutex_unlock( &s->wlock );
+    return err;
+}
+
+static int
+store_putv( packstore_t* s, docid_t docid, const struct iovec* iov, int n ) {
+    packstore_rechdr_t hdr;
+    struct iovec v[n+1];
+    size_t len =0;
+
+    for( int i =0; i < n; i++ ) {
+        len +=iov[i].iov_len;
+        v[i+1] =iov[i];
+    }
+    if( len > UINT32_MAX ) {
+        errno =EFBIG;
+        goto err;
+    }
+
+    hdr.magic =PACKSTORE_RECMAGIC;
+    hdr.len =len;
+    hdr.docid =docid;
+    if( s->hdr->flags & PACKSTORE_DEFLATE ) {
+        if( block_append( s, &hdr, iov, n ) != 0 )
+            goto err;
+        return s->blocklen >= PACKSTORE_BLOCK_SIZE ? block_write( s ) : 0;
+    }
+
+    if( s->dataend > 0 && s->dataend + sizeof( packstore_rechdr_t ) + len > PACKSTORE_FILE_MAX
+            && data_openAppend( s, 1 ) != 0 )
+        goto err;
+    if( ( s->hdr->count + 1 ) * 10 > s->hdr->capacity * 7 && index_grow( s ) != 0 )
+        return -1;
+
+    v[0].iov_base =&hdr;
+    v[0].iov_len =sizeof( packstore_rechdr_t );
+
+    ssize_t w =writev( s->datafd, v, n+1 );
+    if( w != sizeof( packstore_rechdr_t ) + len ) {
+        // Do not leave a partial record behind
+        if( w >= 0 ) {
+            if( ftruncate( s->datafd, s->dataend ) != 0 ) goto err;
+            errno =EIO;
+        }
+        goto err;
+    }
+
+    uint64_t loc =PACKSTORE_LOC( s->datafile, s->dataend );
+    s->dataend +=w;
+    slots_insert( s->slots, s->hdr->capacity, &s->hdr->count, docid, loc );
+    return 0;
+
+err:
+    fprintf( stderr, "packstore_putv(): %s\n", strerror( errno ) );
+    return -1;
+}
+
+int
+packstore_putv( packstore_t* s, docid_t docid, const struct iovec* iov, int n ) {
+    pthread_mutex_lock( &s->wlock );
+    int err =store_putv( s, docid, iov, n );
+    pthread_mutex_unlock( &s->wlock );
+    return err;
+}
+
+int
+packstore_put( packstore_t* s, docid_t docid, const void* data, size_t len ) {
+    struct iovec iov ={ (void*)data, len };
+    return packstore_putv( s, docid, &iov, 1 );
+}
+
+/* Return the mapping of data file `file', mapping it again if it is smaller
+   than `need' bytes. Older mappings stay valid until the store is closed */
+static const char*
+data_map( packstore_t* s, uint32_t file, size_t need ) {
+    char path[PACKSTORE_PATHLEN + 32];
+    const char *data =NULL;
+
+    pthread_mutex_lock( &s->lock );
+    if( file >= s->nmaps ) {
+        packstore_map_t *maps =realloc( s->maps, sizeof( packstore_map_t ) * (file+1) );
+        if( maps == NULL ) goto out;
+        memset( maps + s->nmaps, 0, sizeof( packstore_map_t ) * (file+1 - s->nmaps) );
+        for( size_t i =s->nmaps; i <= file; i++ )
+            maps[i].fd =-1;
+        s->maps =maps;
+        s->nmaps =file+1;
+    }
+
+    packstore_map_t *m =&s->maps[file];
+    if( m->len < need ) {
+        struct stat st;
+        if( m->fd < 0 ) {
+            data_path( s, path, file );
+            if( ( m->fd =open( path, O_RDONLY ) ) < 0 ) goto out;
+        }
+        void *map =MAP_FAILED;
+        if( fstat( m->fd, &st ) == 0 && st.st_size >= need )
+            map =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, m->fd, 0 );
+        if( map == MAP_FAILED ) goto out;
+
+        if( m->data != NULL ) {
+            packstore_map_t *old =malloc( sizeof( packstore_map_t ) );
+            if( old == NULL ) {
+                munmap( map, st.st_size );
+                goto out;
+            }
+            *old =*m;
+            m->old =old;
+        }
+        m->data =map;
+        m->len =st.st_size;
+    }
+    data =m->data;
+out:
+    pthread_mutex_unlock( &s->lock );
+    return data;
+}
+
+void
+packstore_cacheCreate( packstore_cache_t* c ) {
+    memset( c, 0, sizeof( packstore_cache_t ) );
+}
+
+void
+packstore_cacheFree( packstore_cache_t* c ) {
+    for( int i =0; i < PACKSTORE_CACHE_BLOCKS; i++ )
+        free( c->block[i].data );
+    packstore_cacheCreate( c );
+}
+
+/* Return the inflated block at `offs' in data file `file'. On a miss it replaces
+   the least recently used block of `cache' */
+static const packstore_cblock_t*
+block_load( packstore_t* s, packstore_cache_t* cache, uint32_t file, uint64_t offs ) {
+    uint64_t loc =PACKSTORE_LOC( file, offs );
+    packstore_cblock_t *b =&cache->block[0];
+    for( int i =0; i < PACKSTORE_CACHE_BLOCKS; i++ ) {
+        if( cache->block[i].loc == loc ) {
+            cache->block[i].used =++cache->clock;
+            return &cache->block[i];
+        }
+        if( cache->block[i].used < b->used )
+            b =&cache->block[i];
+    }
+
+    packstore_blkhdr_t hdr;
+    const char *map =data_map( s, file, offs + sizeof( packstore_blkhdr_t ) );
+    if( map == NULL ) return NULL;
+    memcpy( &hdr, map + offs, sizeof( packstore_blkhdr_t ) );
+    if( hdr.magic != PACKSTORE_BLKMAGIC ) {
+        errno =EIO;
+        return NULL;
+    }
+    if( ( map =data_map( s, file, offs + sizeof( packstore_blkhdr_t ) + hdr.clen ) ) == NULL )
+        return NULL;
+
+    b->loc =0;
+    if( hdr.ulen > b->size ) {
+        char *data =realloc( b->data, hdr.ulen );
+        if( data == NULL ) return NULL;
+        b->data =data;
+        b->size =hdr.ulen;
+    }
+    uLongf ulen =hdr.ulen;
+    if( uncompress( (Bytef*)b->data, &ulen, (const Bytef*)map + offs + sizeof( packstore_blkhdr_t ), hdr.clen ) != Z_OK
+            || ulen != hdr.ulen ) {
+        errno =EIO;
+        return NULL;
+    }
+    b->loc =loc;
+    b->len =ulen;
+    b->used =++cache->clock;
+    return b;
+}
+
+/* Read the record of `docid' at `loc' */
+static int
+record_get( packstore_t* s, packstore_cache_t* cache, docid_t docid, uint64_t loc, const char** data, size_t* len ) {
+    const char *map;
+    size_t avail;
+    uint32_t file =PACKSTORE_LOC_FILE( loc );
+    uint64_t offs =PACKSTORE_LOC_OFFS( loc );
+    int deflated =s->hdr->flags & PACKSTORE_DEFLATE;
+    if( deflated ) {
+        if( cache == NULL ) {
+            errno =EINVAL;
+            goto err;
+        }
+        const packstore_cblock_t *b =block_load( s, cache, file, PACKSTORE_OFFS_BLOCK( offs ) );
+        if( b == NULL ) goto err;
+        map =b->data;
+        avail =b->len;
+        offs =PACKSTORE_OFFS_REC( offs );
+    } else {
+        avail =offs + sizeof( packstore_rechdr_t );
+        if( ( map =data_map( s, file, avail ) ) == NULL ) goto err;
+    }
+
+    packstore_rechdr_t hdr;
+    if( offs + sizeof( packstore_rechdr_t ) > avail ) {
+        errno =EIO;
+        goto err;
+    }
+    memcpy( &hdr, map + offs, sizeof( packstore_rechdr_t ) );
+    if( hdr.magic != PACKSTORE_RECMAGIC || hdr.docid != docid
+            || ( deflated && offs + sizeof( packstore_rechdr_t ) + hdr.len > avail ) ) {
+        errno =EIO;
+        goto err;
+    }
+    if( !deflated && ( map =data_map( s, file, offs + sizeof( packstore_rechdr_t ) + hdr.len ) ) == NULL )
+        goto err;
+    *data =map + offs + sizeof( packstore_rechdr_t );
+    *len =hdr.len;
+    return 0;
+
+err:
+    fprintf( stderr, "packstore_get(): %s\n", strerror( errno ) );
+    return -1;
+}
+
+/* Copy the latest record of `docid' in the block that is being built into the
+   least recently used block of `cache'. Returns 1 if there is none */
+static int
+pending_get( packstore_t* s, packstore_cache_t* cache, docid_t docid, const char** data, size_t* len ) {
+    int err =1;
+    pthread_mutex_lock( &s->wlock );
+    for( size_t i =s->npending; i-- > 0; ) {
+        if( s->pending[i].docid != docid )
+            continue;
+        packstore_rechdr_t hdr;
+        const char *rec =s->block + PACKSTORE_OFFS_REC( PACKSTORE_LOC_OFFS( s->pending[i].loc ) );
+        memcpy( &hdr, rec, sizeof( packstore_rechdr_t ) );
+
+        packstore_cblock_t *b =&cache->block[0];
+        for( int j =1; j < PACKSTORE_CACHE_BLOCKS; j++ )
+            if( cache->block[j].used < b->used )
+                b =&cache->block[j];
+        b->loc =0;
+        if( hdr.len > b->size ) {
+            char *copy =realloc( b->data, hdr.len );
+            if( copy == NULL ) {
+                fprintf( stderr, "packstore_get(): %s\n", strerror( errno ) );
+                err =-1;
+                break;
+            }
+            b->data =copy;
+            b->size =hdr.len;
+        }
+        memcpy( b->data, rec + sizeof( packstore_rechdr_t ), hdr.len );
+        b->len =hdr.len;
+        b->used =++cache->clock;
+        *data =b->data;
+        *len =hdr.len;
+        err =0;
+        break;
+    }
+    pthread_mutex_unlock( &s->wlock );
+    return err;
+}
+
+int
+packstore_get( packstore_t* s, packstore_cache_t* cache, docid_t docid, const char** data, size_t* len ) {
+    if( s->hdr == NULL )
+        return 1;
+    // The writer also sees the records that are not published yet
+    int err;
+    if( s->writable && cache != NULL && ( s->hdr->flags & PACKSTORE_DEFLATE )
+            && ( err =pending_get( s, cache, docid, data, len ) ) != 1 )
+        return err;
+    uint64_t loc =slots_find( s, docid );
+    if( loc == 0 )
+        return 1;
+    return record_get( s, cache, docid, loc, data, len );
+}
+
+int
+packstore_getFile( packstore_t* s, docid_t docid, const char** data, size_t* len, int* fd, uint64_t* offs ) {
+    if( s->hdr != NULL && ( s->hdr->flags & PACKSTORE_DEFLATE ) ) {
+        fprintf( stderr, "packstore_getFile(): the store is deflated\n" );
+        return -1;
+    }
+    if( s->hdr == NULL )
+        return 1;
+    uint64_t loc =slots_find( s, docid );
+    if( loc == 0 )
+        return 1;
+    if( record_get( s, NULL, docid, loc, data, len ) != 0 )
+        return -1;
+
+    // The record was read, so its data file is open
+    pthread_mutex_lock( &s->lock );
+    *fd =s->maps[PACKSTORE_LOC_FILE( loc )].fd;
+    pthread_mutex_unlock( &s->lock );
+    *offs =PACKSTORE_LOC_OFFS( loc ) + sizeof( packstore_rechdr_t );
+    return 0;
+}
+
+int
+packstore_changed( const packstore_t* s ) {
+    char path[PACKSTORE_PATHLEN + 32];
+    struct stat cur, st;
+    store_path( s, path, PACKSTORE_INDEX );
+    if( stat( path, &cur ) != 0 )
+        return 0;
+    if( s->fd < 0 )
+        return 1;
+    return fstat( s->fd, &st ) == 0 && ( st.st_ino != cur.st_ino || st.st_dev != cur.st_dev );
+}
+
+size_t
+packstore_count( const packstore_t* s ) {
+    return s->hdr ? s->hdr->count : 0;
+}
+
+static int
+slot_compareLoc( const void* left, const void* right ) {
+    uint64_t l =((const packstore_slot_t*)left)->loc, r =((const packstore_slot_t*)right)->loc;
+    return l < r ? -1 : (l > r);
+}
+
+size_t
+packstore_list( const packstore_t* s, docid_t* docs, size_t max ) {
+    size_t n =0;
+    if( s->hdr == NULL )
+        return 0;
+    packstore_slot_t *live =malloc( sizeof( packstore_slot_t ) * ( max + 1 ) );
+    if( live == NULL ) {
+        fprintf( stderr, "packstore_list(): %s\n", strerror( errno ) );
+        return 0;
+    }
+    for( uint64_t i =0; i < s->hdr->capacity && n < max; i++ ) {
+        live[n].loc =__atomic_load_n( &s->slots[i].loc, __ATOMIC_ACQUIRE );
+        if( live[n].loc ) {
+            live[n].docid =s->slots[i].docid;
+            n++;
+        }
+    }
+    qsort( live, n, sizeof( packstore_slot_t ), slot_compareLoc );
+    for( size_t i =0; i < n; i++ )
+        docs[i] =live[i].docid;
+    free( live );
+    return n;
+}
+
+/* Total size of the data files of `s' */
+static long long
+data_size( const packstore_t* s ) {
+    char path[PACKSTORE_PATHLEN + 32];
+    long long size =0;
+    struct stat st;
+    for( uint32_t f =1; f < s->hdr->nextfile; f++ ) {
+        data_path( s, path, f );
+        if( stat( path, &st ) == 0 )
+            size +=st.st_size;
+    }
+    return size;
+}
+
+static void
+remove_dir( const char* path ) {
+    char file[PACKSTORE_PATHLEN + 288];
+    DIR *dir =opendir( path );
+    struct dirent *ent;
+    if( dir == NULL ) return;
+    while( ( ent =readdir( dir ) ) != NULL ) {
+        if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+            continue;
+        snprintf( file, sizeof( file ), "%s/%s", path, ent->d_name );
+        unlink( file );
+    }
+    closedir( dir );
+    rmdir( path );
+}
+
+long long
+packstore_compact( const char* path, int mode ) {
+    char tmp[PACKSTORE_PATHLEN + 32];
+    packstore_t old, new;
+    packstore_cache_t cache;
+    docid_t *docs =NULL;
+    long long reclaimed =-1;
+
+    // Holding the old store for writing keeps writers out
+    if( packstore_open( &old, path, PACKSTORE_WRITE ) != 0 )
+        return -1;
+
+    size_t len =strlen( old.path );
+    while( len > 1 && old.path[len-1] == '/' )
+        len--;
+    snprintf( tmp, sizeof( tmp ), "%.*s" PACKSTORE_COMPACT, (int)len, old.path );
+    remove_dir( tmp );
+    mode =PACKSTORE_WRITE | ( ( mode | old.hdr->flags ) & PACKSTORE_DEFLATE );
+    if( packstore_open( &new, tmp, mode ) != 0 ) {
+        packstore_close( &old );
+        return -1;
+    }
+    packstore_cacheCreate( &cache );
+
+    // Copy the latest record of every DOCID, in the order they are stored
+    size_t count =old.hdr->count;
+    if( ( docs =malloc( sizeof( docid_t ) * ( count + 1 ) ) ) == NULL
+            || packstore_list( &old, docs, count ) != count )
+        goto out;
+    for( size_t i =0; i < count; i++ ) {
+        const char *data;
+        size_t n;
+        if( packstore_get( &old, &cache, docs[i], &data, &n ) != 0
+                || packstore_put( &new, docs[i], data, n ) != 0 )
+            goto out;
+    }
+    if( packstore_flush( &new ) != 0 || fdatasync( new.datafd ) != 0 || msync( new.base, new.len, MS_SYNC ) != 0 )
+        goto out;
+
+    // Swap both directories in one step
+    reclaimed =data_size( &old ) - data_size( &new );
+    if( renameat2( AT_FDCWD, tmp, AT_FDCWD, old.path, RENAME_EXCHANGE ) != 0 ) {
+        fprintf( stderr, "packstore_compact(): %s\n", strerror( errno ) );
+        reclaimed =-1;
+    }
+
+out:
+    free( docs );
+    packstore_cacheFree( &cache );
+    packstore_close( &new );
+    packstore_close( &old );
+    remove_dir( tmp );
+    return reclaimed;
+}
@@ -0,0 +1,199 @@
+/*
+ * Websearch - packstore.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Log-structured store of blobs keyed by DOCID, used for the repository.
+ * A store is a directory with:
+ *  data.NNNN  append-only data files, each record is a packstore_rechdr_t
+ *             followed by its data
+ *  index      open addressing hash table from DOCID to the location of the
+ *             latest record, memory mapped by readers and the writer alike
+ * A record is replaced by appending a new one, the old one becomes garbage
+ * until the store is compacted.
+ *
+ * A store created with PACKSTORE_DEFLATE collects its records in blocks of about
+ * PACKSTORE_BLOCK_SIZE bytes, which are written deflated as a packstore_blkhdr_t
+ * followed by the compressed data. The location of such a record is that of its
+ * block plus its offset in the uncompressed block, so reading a record only
+ * inflates one block. Readers keep the last blocks they inflated in a
+ * packstore_cache_t. Records become visible when their block is written.
+ *
+ * There is a single writing process at a time, in which any number of threads
+ * can write. Readers can use the store while it is being written to. A slot of
+ * the index is published by storing its location last, in one atomic write.
+ */
+
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "docid.h"
+
+struct iovec;
+
+#define PACKSTORE_MAGIC 0x4b504d5a     // "ZMPK"
+#define PACKSTORE_RECMAGIC 0x52504d5a  // "ZMPR"
+#define PACKSTORE_BLKMAGIC 0x42504d5a  // "ZMPB"
+#define PACKSTORE_VERSION 1
+#define PACKSTORE_PATHLEN 256
+#define PACKSTORE_FILE_MAX (1l << 30)  // Start a new data file beyond this size
+#define PACKSTORE_SLOTS_INIT 4096      // Initial capacity of the index, a power of two
+#define PACKSTORE_BLOCK_SIZE (64 << 10) // Uncompressed size at which a block is written
+#define PACKSTORE_CACHE_BLOCKS 8        // Inflated blocks kept by a packstore_cache_t
+
+/* Modes of packstore_open() */
+#define PACKSTORE_WRITE 1
+#define PACKSTORE_DEFLATE 2             // Compress the store if it is created
+
+/* A location packs the data file number (from 1) in the top 16 bits
+   and the offset of the record in the other 48. Zero is an empty slot */
+#define PACKSTORE_LOC( file, offs ) ( ((uint64_t)(file) << 48) | (uint64_t)(offs) )
+#define PACKSTORE_LOC_FILE( loc ) ( (uint32_t)((loc) >> 48) )
+#define PACKSTORE_LOC_OFFS( loc ) ( (loc) & ((1ull << 48) - 1) )
+
+/* In a deflated store the offset is that of the block in the top 32 bits and that
+   of the record in the inflated block in the low 16. Records start within the
+   first PACKSTORE_BLOCK_SIZE bytes of a block, so this always fits */
+#define PACKSTORE_BLOCK_OFFS( block, rec ) ( ((uint64_t)(block) << 16) | (uint64_t)(rec) )
+#define PACKSTORE_OFFS_BLOCK( offs ) ( (offs) >> 16 )
+#define PACKSTORE_OFFS_REC( offs ) ( (offs) & 0xffff )
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;          // Number of slots
+    uint64_t count;             // Number of used slots
+    uint32_t nextfile;          // Number of the next data file
+    uint32_t flags;             // PACKSTORE_DEFLATE
+} packstore_hdr_t;
+
+typedef struct {
+    uint64_t docid;
+    uint64_t loc;
+} packstore_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;               // Length of the data
+    uint64_t docid;
+} packstore_rechdr_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t clen;              // Length of the compressed data
+    uint32_t ulen;              // Length of the records in the block
+    uint32_t pad;
+} packstore_blkhdr_t;
+
+/* A data file as mapped by a reader */
+typedef struct packstore_map {
+    void *data;
+    size_t len;
+    int fd;                     // Kept open for packstore_getFile()
+    struct packstore_map *old;  // Smaller mappings of the same file, kept until close
+} packstore_map_t;
+
+typedef struct {
+    char path[PACKSTORE_PATHLEN];
+    int writable;
+    int fd;                     // The index, locked by the writer
+    void *base;                 // Mapping of the index
+    size_t len;
+    packstore_hdr_t *hdr;
+    packstore_slot_t *slots;
+
+    pthread_mutex_t wlock;      // Serializes writers
+    int datafd;                 // Data file the writer appends to
+    uint32_t datafile;
+    uint64_t dataend;
+
+    char *block;                // Records of the block that is being built
+    size_t blocklen, blocksize;
+    packstore_slot_t *pending;  // Their DOCIDs and locations, published with the block
+    size_t npending, pendingsize;
+
+    packstore_map_t *maps;      // Mappings of the data files, by number
+    size_t nmaps;
+    pthread_mutex_t lock;       // Protects `maps'
+} packstore_t;
+
+typedef struct {
+    uint64_t loc;               // Location of the block, 0 if unused
+    char *data;
+    size_t len, size;
+    uint64_t used;              // Time of last use
+} packstore_cblock_t;
+
+/* Inflated blocks of a deflated store, owned by one thread */
+typedef struct {
+    packstore_cblock_t block[PACKSTORE_CACHE_BLOCKS];
+    uint64_t clock;
+} packstore_cache_t;
+
+/* Open the store in directory `path'. With PACKSTORE_WRITE in `mode' it is created
+   if needed, deflated if `mode' has PACKSTORE_DEFLATE too. Only one process can
+   open a store for writing. Returns -1 on error */
+int
+packstore_open( packstore_t* s, const char* path, int mode );
+
+void
+packstore_close( packstore_t* s );
+
+/* Append a record for `docid' made of `n' pieces and point the index at it.
+   Returns -1 on error */
+int
+packstore_putv( packstore_t* s, docid_t docid, const struct iovec* iov, int n );
+
+int
+packstore_put( packstore_t* s, docid_t docid, const void* data, size_t len );
+
+/* Write the block that is being built, if any. Returns -1 on error */
+int
+packstore_flush( packstore_t* s );
+
+void
+packstore_cacheCreate( packstore_cache_t* c );
+
+void
+packstore_cacheFree( packstore_cache_t* c );
+
+/* Find the latest record of `docid'. On success *data points into the mapped
+   data file and stays valid until the store is closed. In a deflated store it
+   points into `cache' instead, and stays valid until the next call with `cache'.
+   The writer of a deflated store also finds the records of the unwritten block.
+   Returns 0 on success, 1 if there is no record and -1 on error */
+int
+packstore_get( packstore_t* s, packstore_cache_t* cache, docid_t docid, const char** data, size_t* len );
+
+/* Like packstore_get(), but also return a descriptor of the data file and the
+   offset of the data in it, for sendfile(). The descriptor stays open until the
+   store is closed. Not for deflated stores */
+int
+packstore_getFile( packstore_t* s, docid_t docid, const char** data, size_t* len, int* fd, uint64_t* offs );
+
+/* Return 1 if the index of the store was replaced since it was opened, after which
+   new records can only be found by opening it again */
+int
+packstore_changed( const packstore_t* s );
+
+/* Return the number of documents in the store */
+size_t
+packstore_count( const packstore_t* s );
+
+/* Fill `docs' with at most `max' DOCIDs in the store, in the order their records
+   are stored, which is the fastest order to read them in. Returns the number written */
+size_t
+packstore_list( const packstore_t* s, docid_t* docs, size_t max );
+
+/* Rewrite the store at `path' so it only contains the latest record of every
+   DOCID, deflated if `mode' has PACKSTORE_DEFLATE or the store already was.
+   Must not run while the store is open for writing.
+   Returns the number of bytes reclaimed or -1 on error */
+long long
+packstore_compact( const char* path, int mode );
+
+#endif
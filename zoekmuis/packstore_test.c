@@ -0,0 +1,132 @@
+/*
+ * Websearch - packstore_test.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Checks that the records of a packed store, plain and deflated, are found
+ * before and after their block is written, when the index grows, when a record
+ * is replaced and after the store is opened again.
+ * Prints every failed check and returns the number of failures
+ */
+
+#define _GNU_SOURCE
+#include "packstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NDOCS 10000             // Enough to grow the index past PACKSTORE_SLOTS_INIT
+
+static int failed =0;
+
+#define CHECK( cond ) do { if( !(cond) ) { \
+    fprintf( stderr, "%s:%d: failed `%s'\n", __FILE__, __LINE__, #cond ); failed++; } } while( 0 )
+
+static docid_t
+doc( size_t i ) {
+    return ( i + 1 ) * 0x9e3779b97f4a7c15ull;
+}
+
+/* Fill `buf' with version `v' of the record of document `i' and return its length.
+   Some records are larger than a block */
+static size_t
+make_record( char* buf, size_t i, int v ) {
+    size_t len =snprintf( buf, 64, "%zu v%d ", i, v );
+    size_t pad =i % 997 == 0 ? PACKSTORE_BLOCK_SIZE + 1000 : ( i * 31 + v ) % 300;
+    for( size_t j =0; j < pad; j++ )
+        buf[len++] ='a' + ( i + j ) % 26;
+    return len;
+}
+
+/* Return the version of document `i' that test_store() stored last */
+static int
+latest( size_t i ) {
+    return i % 3 ? 0 : i >= NDOCS - 7 ? 2 : 1;
+}
+
+/* Check that the latest version of document `i' is `v' */
+static void
+check_record( packstore_t* s, packstore_cache_t* cache, size_t i, int v ) {
+    static char expect[PACKSTORE_BLOCK_SIZE + 2048];
+    const char *data;
+    size_t len, elen =make_record( expect, i, v );
+    int err =packstore_get( s, cache, doc( i ), &data, &len );
+    if( err != 0 || len != elen || memcmp( data, expect, len ) != 0 ) {
+        fprintf( stderr, "%s:%d: record %zu is not version %d\n", __FILE__, __LINE__, i, v );
+        failed++;
+    }
+}
+
+static void
+test_store( const char* path, int mode ) {
+    static char buf[PACKSTORE_BLOCK_SIZE + 2048];
+    packstore_t s, reader;
+    packstore_cache_t cache;
+    packstore_cacheCreate( &cache );
+
+    CHECK( packstore_open( &s, path, PACKSTORE_WRITE | mode ) == 0 );
+    CHECK( packstore_open( &reader, path, 0 ) == 0 );
+    for( size_t i =0; i < NDOCS; i++ ) {
+        CHECK( packstore_put( &s, doc( i ), buf, make_record( buf, i, 0 ) ) == 0 );
+        // The writer finds a record right away, also while its block is not written
+        check_record( &s, &cache, i, 0 );
+    }
+    // Replace every third record, some of them while the old one is in the same block
+    for( size_t i =0; i < NDOCS; i +=3 )
+        CHECK( packstore_put( &s, doc( i ), buf, make_record( buf, i, 1 ) ) == 0 );
+    for( size_t i =NDOCS - 7; i < NDOCS; i +=3 )
+        CHECK( packstore_put( &s, doc( i ), buf, make_record( buf, i, 2 ) ) == 0 );
+    for( size_t i =0; i < NDOCS; i++ )
+        check_record( &s, &cache, i, latest( i ) );
+    CHECK( packstore_flush( &s ) == 0 );
+    CHECK( packstore_count( &s ) == NDOCS );
+
+    // The index grew, so a reader that was open before has to open it again
+    CHECK( packstore_changed( &reader ) );
+    packstore_close( &reader );
+    CHECK( packstore_open( &reader, path, 0 ) == 0 );
+    CHECK( !packstore_changed( &reader ) );
+    packstore_cacheFree( &cache );
+    for( size_t i =0; i < NDOCS; i++ )
+        check_record( &reader, &cache, i, latest( i ) );
+    const char *data;
+    size_t len;
+    CHECK( packstore_get( &reader, &cache, doc( NDOCS ), &data, &len ) == 1 );
+
+    docid_t *docs =malloc( sizeof( docid_t ) * NDOCS );
+    CHECK( packstore_list( &reader, docs, NDOCS ) == NDOCS );
+    free( docs );
+    packstore_close( &reader );
+    packstore_close( &s );
+
+    // Everything is still there after the writer is opened again
+    CHECK( packstore_open( &s, path, PACKSTORE_WRITE ) == 0 );
+    CHECK( packstore_put( &s, doc( 1 ), buf, make_record( buf, 1, 3 ) ) == 0 );
+    check_record( &s, &cache, 1, 3 );
+    check_record( &s, &cache, 0, 1 );
+    packstore_close( &s );
+    CHECK( packstore_open( &reader, path, 0 ) == 0 );
+    check_record( &reader, &cache, 1, 3 );
+    packstore_close( &reader );
+    packstore_cacheFree( &cache );
+}
+
+int main( int argc, char** argv ) {
+    char dir[] ="/tmp/packstore_test.XXXXXX", plain[64], deflated[64], cmd[128];
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+    snprintf( plain, sizeof( plain ), "%s/plain", dir );
+    snprintf( deflated, sizeof( deflated ), "%s/deflated", dir );
+
+    test_store( plain, 0 );
+    test_store( deflated, PACKSTORE_DEFLATE );
+
+    snprintf( cmd, sizeof( cmd ), "rm -rf %s", dir );
+    if( system( cmd ) != 0 )
+        fprintf( stderr, "Could not remove %s\n", dir );
+    if( failed )
+        fprintf( stderr, "%d checks failed\n", failed );
+    return failed;
+}
@@ -0,0 +1,208 @@
+/*
+ * Websearch - pagerank.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * PageRank over the link index, and the ranks as the query tools read them
+ */
+
+#define _GNU_SOURCE
+#include "pagerank.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* One iteration, split into tasks of PAGERANK_TASK_DOCS documents */
+typedef struct {
+    const linkgraph_t *g;
+    double *rank, *next;
+    double *share;              // What every document passes on along each of its links
+    double *sum;                // Per task, rank of the documents without links or change in rank
+    double base;                // Rank every document gets without links
+    int spread;                 // Whether the tasks compute `share' or `next'
+} pagerank_job_t;
+
+/* Either pass `share' on from the documents of the task, or collect what the
+   links into them bring in */
+static void
+rank_task( void* arg, size_t task ) {
+    pagerank_job_t *j =arg;
+    const linkgraph_t *g =j->g;
+    uint32_t first =task * PAGERANK_TASK_DOCS;
+    uint32_t last =g->n - first > PAGERANK_TASK_DOCS ? first + PAGERANK_TASK_DOCS : g->n;
+    double sum =0;
+
+    if( j->spread ) {
+        // Documents without links spread their rank over all documents
+        for( uint32_t v =first; v < last; v++ ) {
+            uint32_t outdeg =linkgraph_outdeg( g, v );
+            if( outdeg )
+                j->share[v] =j->rank[v] / outdeg;
+            else
+                sum +=j->rank[v];
+        }
+    } else {
+        for( uint32_t v =first; v < last; v++ ) {
+            linkgraph_iter_t it;
+            uint32_t u;
+            double in =0;
+            linkgraph_in( g, v, &it );
+            while( linkgraph_next( &it, &u ) )
+                in +=j->share[u];
+            j->next[v] =j->base + PAGERANK_DAMPING * in;
+            sum +=fabs( j->next[v] - j->rank[v] );
+        }
+    }
+    j->sum[task] =sum;
+}
+
+/* Run one pass of `j' and return the sum of the task sums, added up in the
+   same order every time */
+static double
+run_pass( taskpool_t* pool, pagerank_job_t* j, size_t ntasks, int spread ) {
+    double sum =0;
+    j->spread =spread;
+    taskpool_run( pool, rank_task, j, ntasks );
+    for( size_t t =0; t < ntasks; t++ )
+        sum +=j->sum[t];
+    return sum;
+}
+
+uint32_t
+pagerank_compute( const linkgraph_t* g, taskpool_t* pool, float* rank ) {
+    size_t ntasks =( (size_t)g->n + PAGERANK_TASK_DOCS - 1 ) / PAGERANK_TASK_DOCS;
+    pagerank_job_t j;
+    uint32_t it =0;
+    j.g =g;
+    j.rank =malloc( sizeof( double ) * g->n );
+    j.next =malloc( sizeof( double ) * g->n );
+    j.share =calloc( g->n, sizeof( double ) );
+    j.sum =malloc( sizeof( double ) * ntasks );
+    if( j.rank == NULL || j.next == NULL || j.share == NULL || j.sum == NULL ) {
+        fprintf( stderr, "pagerank_compute(): %s\n", strerror( errno ) );
+        goto done;
+    }
+
+    for( uint32_t v =0; v < g->n; v++ )
+        j.rank[v] =1.0 / g->n;
+    while( it < PAGERANK_MAX_ITERATIONS ) {
+        double dangling =run_pass( pool, &j, ntasks, 1 );
+        j.base =( 1 - PAGERANK_DAMPING + PAGERANK_DAMPING * dangling ) / g->n;
+        double change =run_pass( pool, &j, ntasks, 0 );
+        double *swap =j.rank;
+        j.rank =j.next;
+        j.next =swap;
+        it++;
+        if( change < PAGERANK_EPSILON )
+            break;
+    }
+
+    for( uint32_t v =0; v < g->n; v++ )
+        rank[v] =j.rank[v] * g->n;
+
+done:
+    free( j.rank );
+    free( j.next );
+    free( j.share );
+    free( j.sum );
+    return it;
+}
+
+int
+pagerank_write( const float* rank, uint64_t count, uint32_t iterations ) {
+    pagerank_hdr_t hdr;
+    memset( &hdr, 0, sizeof( pagerank_hdr_t ) );
+    hdr.magic =PAGERANK_MAGIC;
+    hdr.version =PAGERANK_VERSION;
+    hdr.count =count;
+    hdr.iterations =iterations;
+    for( uint64_t i =0; i < count; i++ )
+        if( rank[i] > hdr.max )
+            hdr.max =rank[i];
+
+    // Readers keep the ranks they opened until they see the new file
+    FILE *file =fopen( PAGERANK_TMP, "wb" );
+    if( file == NULL ) goto err;
+    if( fwrite( &hdr, sizeof( pagerank_hdr_t ), 1, file ) != 1
+            || fwrite( rank, sizeof( float ), count, file ) != count
+            || fflush( file ) != 0 || fsync( fileno( file ) ) != 0 ) {
+        fclose( file );
+        goto err;
+    }
+    if( fclose( file ) != 0 || rename( PAGERANK_TMP, PAGERANK_FILE ) != 0 )
+        goto err;
+    return 0;
+
+err:
+    fprintf( stderr, "pagerank_write(): %s\n", strerror( errno ) );
+    unlink( PAGERANK_TMP );
+    return -1;
+}
+
+int
+pagerank_open( pagerank_t* p ) {
+    struct stat st;
+    memset( p, 0, sizeof( pagerank_t ) );
+    p->fd =open( PAGERANK_FILE, O_RDONLY );
+    if( p->fd < 0 )
+        return errno == ENOENT ? 0 : -1;
+    if( fstat( p->fd, &st ) != 0 )
+        goto err;
+    if( st.st_size < sizeof( pagerank_hdr_t ) ) {
+        errno =EINVAL;
+        goto err;
+    }
+    p->map =mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, p->fd, 0 );
+    if( p->map == MAP_FAILED ) {
+        p->map =NULL;
+        goto err;
+    }
+    p->len =st.st_size;
+    const pagerank_hdr_t *hdr =p->map;
+    if( hdr->magic != PAGERANK_MAGIC || hdr->version != PAGERANK_VERSION
+            || p->len != sizeof( pagerank_hdr_t ) + hdr->count * sizeof( float ) ) {
+        errno =EINVAL;
+        goto err;
+    }
+    p->rank =(const float*)( hdr + 1 );
+    p->count =hdr->count;
+    p->max =hdr->max;
+    return 0;
+
+err:
+    fprintf( stderr, "pagerank_open(): %s\n", strerror( errno ) );
+    pagerank_close( p );
+    return -1;
+}
+
+void
+pagerank_close( pagerank_t* p ) {
+    if( p->map )
+        munmap( p->map, p->len );
+    if( p->fd >= 0 )
+        close( p->fd );
+    memset( p, 0, sizeof( pagerank_t ) );
+    p->fd =-1;
+}
+
+int
+pagerank_changed( const pagerank_t* p ) {
+    struct stat now, st;
+    if( stat( PAGERANK_FILE, &now ) != 0 )
+        return p->fd >= 0;
+    if( p->fd < 0 || fstat( p->fd, &st ) != 0 )
+        return 1;
+    return now.st_ino != st.st_ino || now.st_dev != st.st_dev;
+}
+
+float
+pagerank_get( const pagerank_t* p, uint64_t ordinal ) {
+    return ordinal < p->count ? p->rank[ordinal] : 1;
+}
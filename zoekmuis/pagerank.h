@@ -0,0 +1,77 @@
+/*
+ * Websearch - pagerank.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * PageRank of the documents, computed from the link index by ./pagerank and
+ * used by the query tools as a static score. The ranks are iterated over the
+ * link graph (see linkgraph.h) until they settle. The result is kept in
+ * doctable/rank: a pagerank_hdr_t followed by a float per ordinal, scaled so
+ * that the average document has rank 1. The file is replaced as a whole, so
+ * readers always see a complete set of ranks; documents that were crawled
+ * after it was written have none yet.
+ */
+
+#ifndef PAGERANK_H
+#define PAGERANK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "doctable.h"
+#include "linkgraph.h"
+#include "taskpool.h"
+
+#define PAGERANK_FILE DOCTABLE_PATH "rank"
+#define PAGERANK_TMP DOCTABLE_PATH "rank.tmp"
+#define PAGERANK_MAGIC 0x52504d5a       // "ZMPR"
+#define PAGERANK_VERSION 1
+#define PAGERANK_DAMPING 0.85           // Chance that a surfer follows a link
+#define PAGERANK_EPSILON 1e-7           // Total change in rank at which the ranks have settled
+#define PAGERANK_MAX_ITERATIONS 100
+#define PAGERANK_TASK_DOCS 16384        // Documents per task of an iteration
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;             // Number of ranks
+    float max;                  // Highest rank
+    uint32_t iterations;        // It took to compute them
+} pagerank_hdr_t;
+
+/* The ranks as read by the query tools */
+typedef struct {
+    int fd;
+    void *map;
+    size_t len;
+    const float *rank;
+    uint64_t count;             // 0 if the ranks have not been computed
+    float max;
+} pagerank_t;
+
+/* Compute the ranks of the documents in `g' into `rank', with the tasks of
+   every iteration on `pool'. Returns the number of iterations, 0 on error */
+uint32_t
+pagerank_compute( const linkgraph_t* g, taskpool_t* pool, float* rank );
+
+/* Replace the ranks on disk by `count' ranks. Returns -1 on error */
+int
+pagerank_write( const float* rank, uint64_t count, uint32_t iterations );
+
+/* Map the ranks. There are none if they were never computed.
+   Returns -1 on error */
+int
+pagerank_open( pagerank_t* p );
+
+void
+pagerank_close( pagerank_t* p );
+
+/* Return 1 if the ranks were computed again since they were opened */
+int
+pagerank_changed( const pagerank_t* p );
+
+/* Return the rank of `ordinal'. A document without one counts as average */
+float
+pagerank_get( const pagerank_t* p, uint64_t ordinal );
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Websearch - pagerank_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Computes the PageRank of all documents from the link index, for the query
+ * tools to rank with. The link graph is built from the link index first, unless
+ * the one of the previous run is good enough. It only reads the index and the
+ * document table, so it can run while the webspider is crawling; the query tools
+ * pick up the new ranks when it is done.
+ */
+
+#define _GNU_SOURCE
+#include "pagerank.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-j n] [-g] - Compute the PageRank of all documents\n", name );
+    fprintf( stderr, "\t-j n\tnumber of threads, one per core by default\n" );
+    fprintf( stderr, "\t-g\trank the link graph as it is, without reading the link index\n" );
+}
+
+int main( int argc, char** argv ) {
+    long cores =sysconf( _SC_NPROCESSORS_ONLN );
+    int nthreads =cores > 0 ? cores : 1, build =1;
+
+    for( int i =1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-j" ) == 0 && i+1 < argc && ( nthreads =atoi( argv[++i] ) ) > 0 )
+            continue;
+        if( strcmp( argv[i], "-g" ) == 0 ) {
+            build =0;
+            continue;
+        }
+        show_help( *argv );
+        return 0;
+    }
+
+    if( build ) {
+        doctable_t docs;
+        if( doctable_open( &docs, 0 ) != 0 )
+            return -1;
+        int err =doctable_count( &docs ) == 0 ? -1 : linkgraph_build( &docs );
+        doctable_close( &docs );
+        if( err != 0 ) {
+            fprintf( stderr, "ERROR: could not build the link graph\n" );
+            return -1;
+        }
+    }
+
+    linkgraph_t g;
+    if( linkgraph_open( &g ) != 0 )
+        return -1;
+    if( g.n == 0 ) {
+        fprintf( stderr, "ERROR: the document table is empty\n" );
+        linkgraph_close( &g );
+        return -1;
+    }
+
+    // The thread that runs the iterations works on them too
+    taskpool_t pool;
+    float *rank =malloc( sizeof( float ) * g.n );
+    uint32_t iterations =0;
+    if( rank != NULL && taskpool_create( &pool, nthreads - 1 ) == 0 ) {
+        iterations =pagerank_compute( &g, &pool, rank );
+        taskpool_free( &pool );
+    }
+    if( iterations == 0 || pagerank_write( rank, g.n, iterations ) != 0 ) {
+        fprintf( stderr, "ERROR: computing the PageRank failed\n" );
+        free( rank );
+        linkgraph_close( &g );
+        return -1;
+    }
+    fprintf( stderr, "Ranked %u documents with %llu links in %u iterations on %d threads\n",
+            g.n, (unsigned long long)g.nlinks, iterations, nthreads );
+    free( rank );
+    linkgraph_close( &g );
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * Websearch - pipeline.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * The multi-threaded crawling pipeline of the webspider
+ */
+
+#define _GNU_SOURCE
+#include "pipeline.h"
+#include "webspider.h"
+#include "docid.h"
+#include "index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXURL 100000           // Maximum size of a URL
+
+/* A downloaded page on its way to the parsers */
+typedef struct {
+    docid_t docid;
+    char *html;
+    size_t length;
+    char *url;
+} fetched_t;
+
+static int
+isValidDomain( const char* url ) {
+#ifdef RESTRICT_DOMAIN
+      if((strstr(url,"leidenuniv.nl") != NULL) || (strstr(url,"liacs.nl") != NULL))
+        return 1;
+      return 0;
+#else
+    return 1;
+#endif
+}
+
+static void
+pipeline_fail( pipeline_t* p ) {
+    pthread_mutex_lock( &p->lock );
+    p->err =-1;
+    pthread_cond_broadcast( &p->cond );
+    pthread_mutex_unlock( &p->lock );
+}
+
+/* Take the next URL from the frontier into `url'.
+   Waits while other pages are still being parsed, as they may add new links.
+   Returns 0 when there is nothing left to crawl */
+static int
+frontier_next( pipeline_t* p, char* url, size_t maxlen ) {
+    pthread_mutex_lock( &p->lock );
+    while( !p->done && !p->err ) {
+        if( p->downloads >= p->config.maxdownloads ) {
+            p->done =1;
+            break;
+        }
+        if( queue_getCurrent( p->frontier, url, maxlen ) != 0 ) {
+            queue_pop( p->frontier ); // Pop the current url
+            p->downloads++;
+            p->inflight++;
+            printf( "\nDownload #: %zu   Weblinks: %zu   Queue Size: %zu\n",
+                    p->downloads, p->frontier->count, queue_bytesInUse( p->frontier ) );
+            pthread_mutex_unlock( &p->lock );
+            return 1;
+        }
+        if( p->inflight == 0 ) {
+            fprintf( stderr, "No more urls in queue... exiting\n" );
+            p->done =1;
+            break;
+        }
+        pthread_cond_wait( &p->cond, &p->lock );
+    }
+    pthread_cond_broadcast( &p->cond );
+    pthread_mutex_unlock( &p->lock );
+    return 0;
+}
+
+/* Finish a page taken from the frontier and queue the links in `u', if any */
+static void
+frontier_done( pipeline_t* p, const webspider_update_t* u ) {
+    pthread_mutex_lock( &p->lock );
+    for( size_t i =0; u != NULL && i < u->nlinks; i++ ) {
+        const webspider_link_t *l =&u->links[i];
+        if( queue_push( p->frontier, l->url, l->len, l->docid ) != 0 ) {
+            fprintf( stderr, "Queue is full, dropping the remaining links of this page\n" );
+            break;
+        }
+    }
+    p->inflight--;
+    pthread_cond_broadcast( &p->cond );
+    pthread_mutex_unlock( &p->lock );
+}
+
+static void*
+fetcher( void* arg ) {
+    pipeline_t *p =arg;
+    char *urlspace =malloc( sizeof(char) * MAXURL );
+    char *htmlpage, *abs_url;
+
+    while( frontier_next( p, urlspace, MAXURL ) ) {
+        if( isValidDomain( urlspace ) == 0 ) {
+            fprintf( stderr, "Alas, '%s' is not within the allowed domain... skipping.\n", urlspace );
+            frontier_done( p, NULL );
+            continue;
+        }
+
+        fprintf( stderr, "Retrieving '%s'\n", urlspace );
+
+        size_t length =get_webpage( &htmlpage, &abs_url, urlspace );
+
+        if( !length ) { // Some error occured
+            fprintf( stderr, "Got error while obtaining '%s'\n", abs_url );
+            free( abs_url );
+            frontier_done( p, NULL );
+            continue;
+        }
+
+        fetched_t *f =malloc( sizeof( fetched_t ) );
+        size_t abs_url_len =docid_sanitizeUrl( abs_url, strlen( abs_url )+1 );
+        f->docid =docid_make( abs_url, abs_url_len );
+        f->html =htmlpage;
+        f->length =length;
+        f->url =abs_url;
+        fprintf( stderr, "Got %zu bytes from '%s' (DOCID 0x%Lx)\n", length, abs_url, (long long unsigned int)f->docid );
+
+        // Waits if the parsers are behind
+        ringbuf_push( &p->fetched, f );
+    }
+
+    free( urlspace );
+    return NULL;
+}
+
+static void*
+parser( void* arg ) {
+    pipeline_t *p =arg;
+    void *item;
+
+    while( ringbuf_pop( &p->fetched, &item ) ) {
+        fetched_t *f =item;
+        webspider_update_t *u =webspider_updateCreate( f->docid );
+        int err =-1;
+
+        if( u == NULL || ( err =parse_webpage( f->html, f->length, f->url, u ) ) < 0 ) {
+            fprintf( stderr, "ERROR: parse_webpage() returned %d\n", err );
+            frontier_done( p, NULL );
+            if( u ) webspider_updateFree( u );
+        } else {
+            frontier_done( p, u );
+
+            // Images are downloaded by the image workers, the page goes to the writer
+            for( size_t i =0; i < u->nimages; i++ ) {
+                webspider_image_t *img =malloc( sizeof( webspider_image_t ) );
+                *img =u->images[i];
+                ringbuf_push( &p->images, img );
+            }
+            u->nimages =0;
+            ringbuf_push( &p->updates, u );
+        }
+
+        free( f->html );
+        free( f->url );
+        free( f );
+    }
+    return NULL;
+}
+
+static void*
+imageworker( void* arg ) {
+    pipeline_t *p =arg;
+    void *item;
+
+    while( ringbuf_pop( &p->images, &item ) ) {
+        webspider_image_t *img =item;
+        webspider_update_t *u =webspider_fetchImage( img, &p->imagestore );
+        if( u != NULL )
+            ringbuf_push( &p->updates, u );
+        webspider_imageFree( img );
+        free( img );
+    }
+    return NULL;
+}
+
+/* Store the builder as a segment, after which the log can be emptied */
+static int
+writer_flush( pipeline_t* p ) {
+    int err;
+    // Pages must be in the repository before they can be found
+    if( packstore_flush( &p->repo ) != 0 )
+        return -1;
+    if( ( err =segment_builderFlush( &p->seg ) ) != 0 ) {
+        fprintf( stderr, "ERROR: segment_builderFlush() returned %d\n", err );
+        return -1;
+    }
+    return wal_checkpoint( &p->wal );
+}
+
+static void*
+indexwriter( void* arg ) {
+    pipeline_t *p =arg;
+    webspider_update_t *batch[PIPELINE_WAL_BATCH];
+    void *item;
+
+    while( ringbuf_pop( &p->updates, &item ) ) {
+        // Group commit: log everything that is waiting with a single sync
+        size_t n =0;
+        batch[n++] =item;
+        while( n < PIPELINE_WAL_BATCH && ringbuf_tryPop( &p->updates, &item ) )
+            batch[n++] =item;
+
+        for( size_t i =0; i < n && !p->err; i++ )
+            if( webspider_logUpdate( batch[i], &p->wal ) != 0 )
+                pipeline_fail( p );
+        if( !p->err && wal_commit( &p->wal ) != 0 )
+            pipeline_fail( p );
+
+        for( size_t i =0; i < n; i++ ) {
+            if( !p->err && webspider_store( batch[i], &p->seg, &p->repo, &p->docs ) != 0 )
+                pipeline_fail( p );
+            webspider_updateFree( batch[i] );
+        }
+
+        if( !p->err && segment_builderFull( &p->seg ) && writer_flush( p ) != 0 )
+            pipeline_fail( p );
+    }
+
+    if( writer_flush( p ) != 0 )
+        pipeline_fail( p );
+    return NULL;
+}
+
+static int
+replay_update( const char* data, size_t len, void* arg ) {
+    pipeline_t *p =arg;
+    webspider_update_t *u =webspider_decodeUpdate( data, len );
+    if( u == NULL )
+        return 1;
+    int err =webspider_store( u, &p->seg, &p->repo, &p->docs );
+    webspider_updateFree( u );
+    return err ? -1 : 0;
+}
+
+void
+pipeline_defaults( pipeline_config_t* config ) {
+    long cores =sysconf( _SC_NPROCESSORS_ONLN );
+    config->fetchers =16;       // Fetching is mostly waiting for the network
+    config->parsers =cores > 0 ? cores : 1;
+    config->imageworkers =8;
+    config->maxdownloads =2000;
+}
+
+static pthread_t*
+start_threads( int n, void* (*fn)( void* ), pipeline_t* p ) {
+    pthread_t *threads =malloc( sizeof( pthread_t ) * n );
+    for( int i =0; i < n; i++ )
+        pthread_create( &threads[i], NULL, fn, p );
+    return threads;
+}
+
+static void
+join_threads( pthread_t* threads, int n ) {
+    for( int i =0; i < n; i++ )
+        pthread_join( threads[i], NULL );
+    free( threads );
+}
+
+int
+pipeline_run( const pipeline_config_t* config, queue_t* frontier ) {
+    pipeline_t p;
+    memset( &p, 0, sizeof( pipeline_t ) );
+    p.config =*config;
+    p.frontier =frontier;
+    pthread_mutex_init( &p.lock, NULL );
+    pthread_cond_init( &p.cond, NULL );
+
+    if( ringbuf_create( &p.fetched, config->parsers * PIPELINE_QUEUE_PER_THREAD ) != 0
+            || ringbuf_create( &p.images, config->imageworkers * PIPELINE_QUEUE_PER_THREAD ) != 0
+            || ringbuf_create( &p.updates, (config->parsers + config->imageworkers) * PIPELINE_QUEUE_PER_THREAD ) != 0 ) {
+        fprintf( stderr, "pipeline_run(): out of memory\n" );
+        return -1;
+    }
+    segment_builderCreate( &p.seg );
+
+    if( packstore_open( &p.repo, IDX_PATH[IDX_REPOSITORY], PACKSTORE_WRITE | PACKSTORE_DEFLATE ) != 0 ) {
+        segment_builderFree( &p.seg );
+        return -1;
+    }
+    if( doctable_open( &p.docs, 1 ) != 0 ) {
+        packstore_close( &p.repo );
+        segment_builderFree( &p.seg );
+        return -1;
+    }
+    if( packstore_open( &p.imagestore, IDX_PATH[IDX_IMAGES], PACKSTORE_WRITE ) != 0 ) {
+        doctable_close( &p.docs );
+        packstore_close( &p.repo );
+        segment_builderFree( &p.seg );
+        return -1;
+    }
+
+    // Recover the updates of a crawl that did not finish
+    if( wal_open( &p.wal, SEGMENT_WAL ) != 0 ) {
+        packstore_close( &p.imagestore );
+        doctable_close( &p.docs );
+        packstore_close( &p.repo );
+        segment_builderFree( &p.seg );
+        return -1;
+    }
+    long recovered =wal_replay( &p.wal, replay_update, &p );
+    if( recovered < 0 ) {
+        fprintf( stderr, "pipeline_run(): could not replay the write-ahead log\n" );
+        wal_close( &p.wal );
+        packstore_close( &p.imagestore );
+        doctable_close( &p.docs );
+        packstore_close( &p.repo );
+        segment_builderFree( &p.seg );
+        return -1;
+    }
+    if( recovered > 0 )
+        fprintf( stderr, "Recovered %ld updates from the write-ahead log\n", recovered );
+
+    pthread_t *writer =start_threads( 1, indexwriter, &p );
+    pthread_t *imageworkers =start_threads( config->imageworkers, imageworker, &p );
+    pthread_t *parsers =start_threads( config->parsers, parser, &p );
+    pthread_t *fetchers =start_threads( config->fetchers, fetcher, &p );
+
+    // Shut down front to back, every stage drains its input before stopping
+    join_threads( fetchers, config->fetchers );
+    ringbuf_close( &p.fetched );
+    join_threads( parsers, config->parsers );
+    ringbuf_close( &p.images );
+    join_threads( imageworkers, config->imageworkers );
+    ringbuf_close( &p.updates );
+    join_threads( writer, 1 );
+
+    wal_close( &p.wal );
+    packstore_close( &p.imagestore );
+    doctable_close( &p.docs );
+    packstore_close( &p.repo );
+    segment_builderFree( &p.seg );
+    ringbuf_free( &p.fetched );
+    ringbuf_free( &p.images );
+    ringbuf_free( &p.updates );
+    pthread_cond_destroy( &p.cond );
+    pthread_mutex_destroy( &p.lock );
+    return p.err;
+}
@@ -0,0 +1,76 @@
+/*
+ * Websearch - pipeline.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * The multi-threaded crawling pipeline of the webspider:
+ *
+ *   frontier -> fetchers -> parsers -> index writer
+ *                              \-> image workers -/
+ *
+ * Fetchers take URLs from the BFS queue and download them, parsers turn the pages
+ * into updates and push newly found links back onto the queue, image workers
+ * download the images found by the parsers and a single index writer stores all
+ * updates. The stages are connected by bounded ring buffers, so a slow stage
+ * makes the stages before it wait instead of piling up pages in memory.
+ *
+ * The index writer logs every update to the write-ahead log before storing it,
+ * and empties the log after each segment flush. Updates left in the log by a
+ * crash are replayed when the next crawl starts.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include "queue.h"
+#include "ringbuf.h"
+#include "segment.h"
+#include "packstore.h"
+#include "doctable.h"
+#include "wal.h"
+
+#define PIPELINE_QUEUE_PER_THREAD 4    // Ring buffer slots per consuming thread
+#define PIPELINE_WAL_BATCH 64          // Maximum number of updates per group commit
+
+typedef struct {
+    int fetchers;
+    int parsers;
+    int imageworkers;
+    size_t maxdownloads;        // Maximum number of downloads we will attempt
+} pipeline_config_t;
+
+typedef struct {
+    pipeline_config_t config;
+
+    // The BFS queue, shared by fetchers and parsers
+    queue_t *frontier;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t inflight;            // Pages taken from the frontier whose links are not yet known
+    size_t downloads;
+    int done;
+
+    ringbuf_t fetched;          // Downloaded pages, for the parsers
+    ringbuf_t images;           // Images, for the image workers
+    ringbuf_t updates;          // Parsed pages and images, for the index writer
+
+    segment_builder_t seg;
+    packstore_t repo;           // The repository
+    doctable_t docs;
+    packstore_t imagestore;     // Downloaded images, written by the image workers
+    wal_t wal;                  // Holds every update that is not yet in a segment
+    int err;
+} pipeline_t;
+
+/* Fill `config' with the defaults */
+void
+pipeline_defaults( pipeline_config_t* config );
+
+/* Crawl starting from the URLs in `frontier' until it is exhausted or the
+   download limit is reached. Returns 0 on success */
+int
+pipeline_run( const pipeline_config_t* config, queue_t* frontier );
+
+#endif
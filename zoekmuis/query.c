@@ -0,0 +1,1275 @@
+/*
+ * Websearch - query.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * The query engine shared by webquery and webqueryd
+ */
+
+#define _GNU_SOURCE
+#include "query.h"
+#include "ranklist.h"
+#include "index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+
+#define DOCID_STRLEN 16
+
+#define IMGCOMPARE_PATH "../imgcompare/imgcompare"
+#define IMGCOMPARE_LIMIT 25
+
+#define QUERY_MAX_TERMS 32             // Keywords in a query
+#define QUERY_BM25_K1 1.2              // Saturation of the term frequency
+#define QUERY_BOUND_SLACK 1.0001       // Upper bounds are raised by this much against rounding
+#define QUERY_RANGE_DOCS 65536         // Documents of a segment per task
+#define QUERY_MAX_RANGES 64            // Tasks per segment
+#define QUERY_SLOTS (IDX_FIELDS+1)     // Dictionary entries of a word in a segment, the last is SEGMENT_UNIFIED
+#define QUERY_RANK_WEIGHT 1.0          // Score of a document with a very high PageRank
+
+static const char* MODE_NAME[] ={ "web", "images", "color" };
+
+/* BM25F weight and length normalization of every index. Only the page text
+   varies enough in length to normalize it */
+static const double FIELD_WEIGHT[IDX_FIELDS] ={ 2.0, 0, 1.0, 3.0, 1.0 };
+static const double FIELD_B[IDX_FIELDS] ={ 0, 0, 0.75, 0, 0 };
+static const index_t UFIELD[SEGMENT_UFIELDS] =SEGMENT_UFIELD_INDICES;
+
+/* Words of which a document needs one, or that exclude it if `not'. A word
+   can have several keywords, which are all needed */
+typedef struct {
+    const char *word[QUERY_MAX_TERMS];  // The keywords of all words
+    size_t group[QUERY_MAX_TERMS];      // Word every keyword belongs to
+    double idf[QUERY_MAX_TERMS];        // Over all segments, set before evaluating
+    size_t count;
+    size_t need[QUERY_MAX_TERMS];       // Keywords of every word
+    size_t words;
+    int not;
+} query_clause_t;
+
+typedef struct {
+    char buf[QUERY_MAX_KWSIZE+1];       // The keywords point in here
+    query_clause_t clause[QUERY_MAX_TERMS];
+    size_t count;
+} query_parsed_t;
+
+/* Postings of one keyword in one index of a segment, sorted by DOCID */
+typedef struct {
+    const index_posting_t *cur, *end;
+    index_t idx;
+    uint32_t maxtf;                     // Highest tf in the list, 0 if unknown
+} query_list_t;
+
+/* A keyword while it is evaluated in one segment */
+typedef struct {
+    query_list_t *list;                 // One per index the keyword is in
+    size_t count;
+    const segment_uposting_t *ucur, *uend;  // Or its combined list, if the segment has them
+    segment_uposting_t umax;            // Highest tf in the combined list per index
+    double idf;
+    double ub;                          // Highest score it can add to a document
+    size_t group;                       // Word of the clause it belongs to
+} query_term_t;
+
+/* A clause while it is evaluated in one segment */
+typedef struct {
+    query_term_t *term;                 // The keywords that are in the segment
+    size_t count;
+    uint64_t df;                        // Number of postings in all lists
+    double ub;                          // Highest score it can add to a document
+    const size_t *need;                 // Keywords of every word of the clause
+    int grouped;                        // Whether a word has more than one
+    int not;
+} query_eclause_t;
+
+/* Scores documents and keeps the lowest score that still makes the top k */
+typedef struct {
+    const doctable_t *docs;
+    double avgdl;                       // Average document length
+    const pagerank_t *ranks;            // Static scores, NULL to rank without them
+    double rankub;                      // Highest static score
+    float *heap;                        // Best k scores so far, the lowest on top
+    size_t k, len;
+    float *shared;                      // Highest of those lowest scores of all tasks
+} query_scorer_t;
+
+/* A document while it is scored. Its entry in the document table is looked up
+   once it is needed */
+typedef struct {
+    docid_t docid;
+    int found;                          // Whether it was looked up
+    uint64_t ordinal;                   // DOCTABLE_NONE if it is not in the table
+    double dl;                          // Length
+} query_doc_t;
+
+/* The documents of a segment in a range of DOCIDs, which one thread evaluates.
+   DOCIDs are hashes, so equal ranges hold about as many documents */
+typedef struct {
+    size_t seg;
+    docid_t lo, hi;                     // Inclusive
+    query_scorer_t s;
+    rankelem_t *elem;                   // Documents that may make the top k
+    size_t count, size;
+    uint64_t ns, scorens;               // Time it took and of that scoring, if timed
+} query_task_t;
+
+/* A query, split into tasks that run in parallel */
+typedef struct {
+    segment_set_t *set;
+    const query_parsed_t *q;
+    const uint32_t *found;              // Dictionary entries, see make_ranklist()
+    size_t nwords;
+    index_t from_idx, to_idx;
+    query_task_t *task;
+    int timed;                          // Whether the tasks keep time
+} query_job_t;
+
+/* Nanoseconds since some point in the past */
+static uint64_t
+clock_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Return the length of the character reference at `str' (which starts with '&'),
+   or 0 if it is a plain ampersand */
+static size_t
+charref_len( const char* str, size_t len ) {
+    size_t i =1;
+    if( i < len && str[i] == '#' ) i++;
+    if( i > 1 && i < len && ( str[i] == 'x' || str[i] == 'X' ) ) i++;
+    size_t start =i;
+    while( i < len && i < 12 && isalnum( (unsigned char)str[i] ) ) i++;
+    return i > start && i < len && str[i] == ';' ? i+1 : 0;
+}
+
+/* Write `len' bytes of `str' to `out' as HTML text. Crawled text keeps its
+   character references, they can not form markup */
+static void
+write_html( FILE* out, const char* str, size_t len ) {
+    for( size_t i =0; i < len; i++ ) {
+        size_t ref;
+        switch( str[i] ) {
+            case '&':
+                if( ( ref =charref_len( str + i, len - i ) ) > 0 ) {
+                    fwrite( str + i, 1, ref, out );
+                    i +=ref-1;
+                } else
+                    fputs( "&amp;", out );
+                break;
+            case '<': fputs( "&lt;", out ); break;
+            case '>': fputs( "&gt;", out ); break;
+            case '"': fputs( "&quot;", out ); break;
+            case '\'': fputs( "&#39;", out ); break;
+            default: fputc( str[i], out );
+        }
+    }
+}
+
+/* Return `len' cut to at most `max' bytes, without splitting a character */
+static size_t
+cut_utf8( const char* str, size_t len, size_t max ) {
+    if( len <= max )
+        return len;
+    while( max > 0 && ( (unsigned char)str[max] & 0xc0 ) == 0x80 )
+        max--;
+    return max;
+}
+
+/* Write `str' to `out' for use in a query string */
+static void
+write_urlparam( FILE* out, const char* str ) {
+    for( ; *str; str++ ) {
+        unsigned char ch =*str;
+        if( isalnum( ch ) || ch == '-' || ch == '_' || ch == '.' || ch == '~' )
+            fputc( ch, out );
+        else
+            fprintf( out, "%%%02X", ch );
+    }
+}
+
+/* Write `len' bytes of `str' to `out' as a JSON string */
+static void
+write_json( FILE* out, const char* str, size_t len ) {
+    fputc( '"', out );
+    for( size_t i =0; i < len; i++ ) {
+        unsigned char ch =str[i];
+        if( ch == '"' || ch == '\\' )
+            fprintf( out, "\\%c", ch );
+        else if( ch < 0x20 )
+            fprintf( out, "\\u%04x", ch );
+        else
+            fputc( ch, out );
+    }
+    fputc( '"', out );
+}
+
+/* Parse `query' into `q'. Words are ANDed together, unless joined by OR, which
+   binds stronger; NOT or a leading `-' excludes a word. Every word is split into
+   keywords the same way the webspider does, a word with several keywords (such
+   as `o'neill') needs all of them: `a OR o'neill' finds a, or o together with
+   neill, and `-o'neill' only excludes documents with both. Returns the number of
+   keywords */
+static size_t
+parse_query( query_parsed_t* q, const char* query ) {
+    size_t nwords =0, last =0, lastn =0;
+    int or =0, not =0;
+    char *s =q->buf;
+    snprintf( q->buf, sizeof( q->buf ), "%s", query );
+    q->count =0;
+
+    while( 1 ) {
+        while( isspace( (unsigned char)*s ) ) s++;
+        if( *s == 0 ) break;
+        char *tok =s;
+        while( *s && !isspace( (unsigned char)*s ) ) s++;
+        if( *s ) *s++ =0;
+
+        if( strcmp( tok, "AND" ) == 0 ) continue;
+        if( strcmp( tok, "OR" ) == 0 ) {
+            or =1;
+            continue;
+        }
+        if( strcmp( tok, "NOT" ) == 0 || ( tok[0] == '-' && tok[1] ) ) {
+            not =1;
+            if( tok[0] == '-' ) tok++;
+            else continue;
+        }
+
+        // The previous word was split into clauses before it turned out to be
+        // joined by OR, so its keywords go back together
+        if( or && lastn > 1 && last + lastn == q->count ) {
+            query_clause_t *c =&q->clause[last];
+            for( size_t i =1; i < lastn; i++ ) {
+                c->word[i] =q->clause[last+i].word[0];
+                c->group[i] =0;
+            }
+            c->count =c->need[0] =lastn;
+            q->count =last + 1;
+        }
+
+        // A word on its own gets a clause per keyword, as they all are needed.
+        // One that is joined by OR or excluded keeps its keywords together
+        char *end =tok + strlen( tok ), *word;
+        size_t start =q->count;
+        query_clause_t *c =NULL;
+        while( nwords < QUERY_MAX_TERMS && ( word =index_tokInner( &tok, end ) ) != NULL ) {
+            // Long words are cut like they were when they were indexed
+            word[index_keywordLen( word, strlen( word ) )] =0;
+            query_clause_t *k =c;
+            if( k == NULL && or && q->count > 0 && !not && !q->clause[q->count-1].not ) {
+                k =&q->clause[q->count-1];
+                k->need[k->words++] =0;
+            } else if( k == NULL ) {
+                k =&q->clause[q->count++];
+                k->count =0;
+                k->need[0] =0;
+                k->words =1;
+                k->not =not;
+            }
+            k->word[k->count] =word;
+            k->group[k->count++] =k->words - 1;
+            k->need[k->words-1]++;
+            if( or || not )
+                c =k;
+            nwords++;
+            if( tok >= end ) break;
+        }
+        last =start;
+        lastn =or || not ? 0 : q->count - start;
+        or =not =0;
+    }
+    return nwords;
+}
+
+/* Return the first posting from `cur' on with a DOCID of at least `docid'.
+   Looks 1, 2, 4... postings ahead before searching, so skipping a few postings
+   costs a few comparisons and skipping many a logarithmic number */
+static inline const index_posting_t*
+gallop( const index_posting_t* cur, const index_posting_t* end, docid_t docid ) {
+    if( cur == end || cur->docid >= docid )
+        return cur;
+    size_t step =1;
+    while( cur + step < end && cur[step].docid < docid ) {
+        cur +=step;
+        step *=2;
+    }
+    const index_posting_t *lo =cur + 1, *hi =cur + step < end ? cur + step : end;
+    while( lo < hi ) {
+        const index_posting_t *mid =lo + (hi-lo)/2;
+        if( mid->docid < docid )
+            lo =mid + 1;
+        else
+            hi =mid;
+    }
+    return lo;
+}
+
+static inline const segment_uposting_t*
+ugallop( const segment_uposting_t* cur, const segment_uposting_t* end, docid_t docid ) {
+    if( cur == end || cur->docid >= docid )
+        return cur;
+    size_t step =1;
+    while( cur + step < end && cur[step].docid < docid ) {
+        cur +=step;
+        step *=2;
+    }
+    const segment_uposting_t *lo =cur + 1, *hi =cur + step < end ? cur + step : end;
+    while( lo < hi ) {
+        const segment_uposting_t *mid =lo + (hi-lo)/2;
+        if( mid->docid < docid )
+            lo =mid + 1;
+        else
+            hi =mid;
+    }
+    return lo;
+}
+
+/* Move the lists of the keywords of `c' from `from' on to `docid' and return
+   the lowest DOCID they are at now. `*done' is set when all of them are exhausted */
+static docid_t
+clause_seek( query_eclause_t* c, size_t from, docid_t docid, int* done ) {
+    docid_t min =UINT64_MAX;
+    int left =0;
+    for( size_t i =from; i < c->count; i++ ) {
+        query_term_t *t =&c->term[i];
+        if( t->ucur != NULL ) {
+            t->ucur =ugallop( t->ucur, t->uend, docid );
+            if( t->ucur != t->uend ) {
+                left =1;
+                if( t->ucur->docid < min )
+                    min =t->ucur->docid;
+            }
+        }
+        for( size_t j =0; j < t->count; j++ ) {
+            query_list_t *l =&t->list[j];
+            l->cur =gallop( l->cur, l->end, docid );
+            if( l->cur == l->end ) continue;
+            left =1;
+            if( l->cur->docid < min )
+                min =l->cur->docid;
+        }
+    }
+    *done =!left;
+    return min;
+}
+
+/* Return 1 if `t', moved to `docid', is in document `docid' */
+static int
+term_at( const query_term_t* t, docid_t docid ) {
+    if( t->ucur != NULL && t->ucur != t->uend && t->ucur->docid == docid )
+        return 1;
+    for( size_t i =0; i < t->count; i++ )
+        if( t->list[i].cur != t->list[i].end && t->list[i].cur->docid == docid )
+            return 1;
+    return 0;
+}
+
+/* Return 1 if document `docid', which has a keyword of `c', has all keywords
+   of one of its words. The lists of `c' have to be moved to `docid' */
+static int
+clause_matches( const query_eclause_t* c, docid_t docid ) {
+    if( !c->grouped )
+        return 1;
+    // Keywords that are not in the segment are not in `c', so their words never match
+    size_t have[QUERY_MAX_TERMS] ={ 0 };
+    for( size_t i =0; i < c->count; i++ )
+        if( term_at( &c->term[i], docid ) && ++have[c->term[i].group] == c->need[c->term[i].group] )
+            return 1;
+    return 0;
+}
+
+static int
+clause_compare( const void* left, const void* right ) {
+    const query_eclause_t *l =left, *r =right;
+    if( l->not != r->not )
+        return l->not - r->not;
+    return l->df < r->df ? -1 : l->df > r->df;
+}
+
+static int
+term_compare( const void* left, const void* right ) {
+    const query_term_t *l =left, *r =right;
+    return l->ub < r->ub ? -1 : l->ub > r->ub;
+}
+
+/* Return the highest score `t' can give a document. A document is at least as
+   long as the occurrences in it, which bounds the length normalization. The
+   score of a keyword stays below its idf, which is all that is known of
+   segments that were written without the highest tf */
+static double
+term_bound( const query_term_t* t, double avgdl ) {
+    double u =0;
+    for( int i =0; t->ucur != NULL && i < SEGMENT_UFIELDS; i++ ) {
+        double b =FIELD_B[UFIELD[i]];
+        u +=FIELD_WEIGHT[UFIELD[i]] * t->umax.tf[i] / ( 1 - b + b * t->umax.tf[i] / avgdl );
+    }
+    for( size_t i =0; i < t->count; i++ ) {
+        const query_list_t *l =&t->list[i];
+        if( l->maxtf == 0 )
+            return t->idf;
+        double b =FIELD_B[l->idx];
+        u +=FIELD_WEIGHT[l->idx] * l->maxtf / ( 1 - b + b * l->maxtf / avgdl );
+    }
+    return t->idf * u / ( QUERY_BM25_K1 + u ) * QUERY_BOUND_SLACK;
+}
+
+static void
+doc_lookup( const query_scorer_t* s, query_doc_t* d ) {
+    if( d->found )
+        return;
+    const doctable_doc_t *e =doctable_get( s->docs, d->ordinal =doctable_find( s->docs, d->docid ) );
+    if( e == NULL || e->docid != d->docid )
+        d->ordinal =DOCTABLE_NONE;
+    d->dl =d->ordinal != DOCTABLE_NONE && e->doclen ? e->doclen : s->avgdl;
+    d->found =1;
+}
+
+/* BM25F weight of `tf' occurrences in index `idx' of `d' */
+static inline double
+field_weight( index_t idx, double tf, query_doc_t* d, const query_scorer_t* s ) {
+    double b =FIELD_B[idx], dl =tf;
+    if( b != 0 ) {
+        doc_lookup( s, d );
+        if( d->dl > tf )
+            dl =d->dl;
+    }
+    return FIELD_WEIGHT[idx] * tf / ( 1 - b + b * dl / s->avgdl );
+}
+
+/* BM25F score of `d' for `t', whose lists are at `d' or past it */
+static double
+term_score( const query_term_t* t, query_doc_t* d, const query_scorer_t* s ) {
+    double u =0;
+    if( t->ucur != NULL && t->ucur != t->uend && t->ucur->docid == d->docid ) {
+        for( int i =0; i < SEGMENT_UFIELDS; i++ )
+            if( t->ucur->fields & (1 << i) )
+                u +=field_weight( UFIELD[i], t->ucur->tf[i], d, s );
+    }
+    for( size_t i =0; i < t->count; i++ ) {
+        const query_list_t *l =&t->list[i];
+        if( l->cur != l->end && l->cur->docid == d->docid )
+            u +=field_weight( l->idx, l->cur->tf, d, s );
+    }
+    return u > 0 ? t->idf * u / ( QUERY_BM25_K1 + u ) : 0;
+}
+
+static double
+clause_score( const query_eclause_t* c, query_doc_t* d, const query_scorer_t* s ) {
+    double score =0;
+    for( size_t i =0; i < c->count; i++ )
+        score +=term_score( &c->term[i], d, s );
+    return score;
+}
+
+/* Static score of `d', which grows with its PageRank up to QUERY_RANK_WEIGHT.
+   An average document gets half of that */
+static double
+doc_rank( query_doc_t* d, const query_scorer_t* s ) {
+    if( s->ranks == NULL )
+        return 0;
+    doc_lookup( s, d );
+    double pr =pagerank_get( s->ranks, d->ordinal );
+    return QUERY_RANK_WEIGHT * pr / ( pr + 1 );
+}
+
+/* Return the number of keywords of `c', sorted by upper bound, that together
+   with `rest' can not bring a document above `theta'. Documents that only have
+   those are not worth looking at */
+static size_t
+clause_essential( const query_eclause_t* c, double rest, float theta ) {
+    size_t n =0;
+    double sum =rest;
+    while( n < c->count && sum + c->term[n].ub <= theta )
+        sum +=c->term[n++].ub;
+    return n;
+}
+
+/* Return the score a document has to beat to make the top k. The k scores of
+   the task itself came before it, so they win a tie; those of another task only
+   keep out the documents that score lower */
+static float
+scorer_theta( const query_scorer_t* s ) {
+    float theta =s->len < s->k ? -1 : s->heap[0], shared;
+    __atomic_load( s->shared, &shared, __ATOMIC_RELAXED );
+    shared =nextafterf( shared, -INFINITY );
+    return shared > theta ? shared : theta;
+}
+
+static void
+scorer_push( query_scorer_t* s, float score ) {
+    size_t i;
+    if( s->len < s->k ) {
+        i =s->len++;
+        while( i > 0 && s->heap[(i-1)/2] > score ) {
+            s->heap[i] =s->heap[(i-1)/2];
+            i =(i-1)/2;
+        }
+        s->heap[i] =score;
+    } else if( score > s->heap[0] ) {
+        i =0;
+        while( 1 ) {
+            size_t low =i, left =2*i + 1, right =left + 1;
+            float min =score;
+            if( left < s->len && s->heap[left] < min )
+                min =s->heap[low =left];
+            if( right < s->len && s->heap[right] < min )
+                low =right;
+            if( low == i )
+                break;
+            s->heap[i] =s->heap[low];
+            i =low;
+        }
+        s->heap[i] =score;
+    }
+    if( s->len < s->k )
+        return;
+
+    // Let the other tasks of the query skip what can not beat these k either
+    float shared;
+    __atomic_load( s->shared, &shared, __ATOMIC_RELAXED );
+    while( s->heap[0] > shared && !__atomic_compare_exchange( s->shared, &shared, &s->heap[0], 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+/* Return the entry + 1 of `word' in index `idx' of segment `s', or 0 if it is
+   not there, through the term cache of `e' */
+static uint32_t
+lookup_term( query_engine_t* e, const segment_t* s, index_t idx, const char* word ) {
+    uint32_t term;
+    if( termcache_get( &e->terms, s->name, idx, word, &term ) )
+        return term;
+    const segment_term_t *t =segment_lookup( s, idx, word );
+    term =t == NULL ? 0 : t - s->terms + 1;
+    termcache_put( &e->terms, s->name, idx, word, term );
+    return term;
+}
+
+/* Score `d' for clause `c' of the query of `j', or with its static score if `c'
+   is NULL, and count the time it takes in `t' if the query is timed */
+static double
+score_doc( const query_job_t* j, query_task_t* t, const query_eclause_t* c, query_doc_t* d ) {
+    uint64_t start =j->timed ? clock_ns() : 0;
+    double score =c != NULL ? clause_score( c, d, &t->s ) : doc_rank( d, &t->s );
+    if( j->timed )
+        t->scorens +=clock_ns() - start;
+    return score;
+}
+
+/* Add the documents of task `t' that match the query and can make the top k
+   to the task. The clauses are intersected rarest first: every candidate of the
+   rarest one is looked up in the others, and a clause that does not have it
+   tells where to go on from. Candidates are scored as they go, and given up as
+   soon as the clauses that are left can not bring them into the top k. The
+   keywords of the first clause that can not do so on their own are not used to
+   find candidates at all (MaxScore), which skips their postings */
+static void
+eval_task( const query_job_t* j, query_task_t* t ) {
+    query_scorer_t *s =&t->s;
+    segment_set_t *set =j->set;
+    const query_parsed_t *q =j->q;
+    const uint32_t *found =j->found + t->seg * j->nwords * QUERY_SLOTS;
+    query_eclause_t clause[QUERY_MAX_TERMS];
+    query_term_t terms[QUERY_MAX_TERMS];
+    query_list_t lists[QUERY_MAX_TERMS * IDX_FIELDS];
+    size_t nterms =0, nlists =0, npos =0;
+    segment_t *sg =&set->segs[t->seg];
+
+    for( size_t i =0; i < q->count; i++ ) {
+        query_eclause_t *c =&clause[i];
+        c->term =terms + nterms;
+        c->count =0;
+        c->df =0;
+        c->ub =0;
+        c->not =q->clause[i].not;
+        c->need =q->clause[i].need;
+        c->grouped =q->clause[i].count > q->clause[i].words;
+        for( size_t w =0; w < q->clause[i].count; w++ ) {
+            query_term_t *qt =&c->term[c->count];
+            qt->group =q->clause[i].group[w];
+            qt->list =lists + nlists;
+            qt->count =0;
+            qt->ucur =qt->uend =NULL;
+            qt->idf =q->clause[i].idf[w];
+            if( found[IDX_FIELDS] ) {
+                const segment_term_t *st =&sg->terms[found[IDX_FIELDS]-1];
+                qt->ucur =segment_upostings( sg, st );
+                qt->uend =qt->ucur + st->df;
+                qt->umax =qt->ucur[-1];
+                c->df +=st->df;
+            }
+            for( index_t idx =j->from_idx; idx <= j->to_idx; idx++ ) {
+                if( found[idx] == 0 ) continue;
+                const segment_term_t *st =&sg->terms[found[idx]-1];
+                query_list_t *l =&qt->list[qt->count++];
+                l->cur =sg->postings + st->post_off / sizeof( index_posting_t );
+                l->end =l->cur + st->df;
+                l->idx =idx;
+                l->maxtf =st->maxtf;
+                c->df +=st->df;
+            }
+            found +=QUERY_SLOTS;
+            if( qt->count == 0 && qt->ucur == NULL ) continue;
+            nlists +=qt->count;
+            qt->ub =term_bound( qt, s->avgdl );
+            c->ub +=qt->ub;
+            c->count++;
+        }
+        nterms +=c->count;
+        if( !c->not ) {
+            // A word that is not in the segment means no document in it matches
+            if( c->count == 0 ) return;
+            npos++;
+        }
+    }
+    if( npos == 0 ) return;
+    qsort( clause, q->count, sizeof( query_eclause_t ), clause_compare );
+    qsort( clause[0].term, clause[0].count, sizeof( query_term_t ), term_compare );
+
+    // Every document gets its static score on top of what its keywords add
+    double rest =s->rankub;
+    for( size_t i =1; i < npos; i++ )
+        rest +=clause[i].ub;
+    float theta =scorer_theta( s );
+    size_t essential =clause_essential( &clause[0], rest, theta );
+
+    docid_t docid =t->lo;
+    int done =0;
+    while( essential < clause[0].count ) {
+        docid =clause_seek( &clause[0], essential, docid, &done );
+        if( done || docid > t->hi ) break;
+        clause_seek( &clause[0], 0, docid, &done );
+        if( !clause_matches( &clause[0], docid ) ) {
+            if( docid == UINT64_MAX ) break;
+            docid++;
+            continue;
+        }
+
+        query_doc_t d ={ docid, 0 };
+        double score =score_doc( j, t, &clause[0], &d ), left =rest;
+        docid_t next =docid;
+        size_t i;
+        for( i =1; i < npos && score + left > theta; i++ ) {
+            next =clause_seek( &clause[i], 0, docid, &done );
+            if( done || next != docid ) break;
+            if( !clause_matches( &clause[i], docid ) ) {
+                done =docid == UINT64_MAX;
+                next =docid + 1;
+                break;
+            }
+            score +=score_doc( j, t, &clause[i], &d );
+            left -=clause[i].ub;
+        }
+        if( done ) break;
+        if( next != docid ) {
+            docid =next;
+            continue;
+        }
+
+        if( i == npos )
+            score +=score_doc( j, t, NULL, &d );
+        int skip =i < npos || (float)score <= theta || segment_setSuperseded( set, t->seg, docid );
+        for( i =npos; i < q->count && !skip; i++ ) {
+            int exhausted;
+            skip =clause_seek( &clause[i], 0, docid, &exhausted ) == docid && !exhausted
+                    && clause_matches( &clause[i], docid );
+        }
+        if( !skip ) {
+            if( t->count == t->size ) {
+                size_t size =t->size ? t->size * 2 : 64;
+                rankelem_t *elem =realloc( t->elem, sizeof( rankelem_t ) * size );
+                if( elem == NULL ) break;
+                t->elem =elem;
+                t->size =size;
+            }
+            t->elem[t->count].docid =docid;
+            t->elem[t->count++].rank =(float)score;
+            scorer_push( s, (float)score );
+        }
+        // The other tasks may have raised the bar as well
+        float now =scorer_theta( s );
+        if( now != theta ) {
+            theta =now;
+            essential =clause_essential( &clause[0], rest, theta );
+        }
+        if( docid == UINT64_MAX ) break;
+        docid++;
+    }
+}
+
+static void
+rank_task( void* arg, size_t task ) {
+    query_job_t *j =arg;
+    query_task_t *t =&j->task[task];
+    if( !j->timed ) {
+        eval_task( j, t );
+        return;
+    }
+    uint64_t start =clock_ns();
+    eval_task( j, t );
+    t->ns =clock_ns() - start;
+}
+
+/* Add the best `k' documents for `query' to `r', and maybe some more. The
+   segments are split into tasks that run on the pool of the engine, each of
+   which keeps its own top k; they are added to `r' in the order of the
+   segments, so the ranking does not depend on which task finishes first. If
+   `timing' is not NULL, the time of every phase is added to it. The tasks read
+   the postings and score the documents in turn, so their time is split between
+   the two by how long they spent scoring */
+static void
+make_ranklist( ranklist_t *r, query_engine_t* e, const char* query, query_mode_t mode, size_t k,
+        query_timing_t* timing ) {
+    uint64_t start =timing != NULL ? clock_ns() : 0;
+    segment_set_t *set =&e->set;
+    index_t from_idx =IDX_WEBIDX, to_idx =IDX_TITLEIDX;
+    if( mode == QUERY_IMAGES ) {
+        from_idx =IDX_IMAGEIDX;
+        to_idx =IDX_IMAGEIDX;
+    }
+
+    query_parsed_t q;
+    size_t nwords =parse_query( &q, query );
+    if( nwords == 0 || set->count == 0 )
+        return;
+
+    // Large segments are split when there are threads to share them
+    size_t ntasks =0;
+    for( size_t seg =0; seg < set->count; seg++ ) {
+        size_t ranges =e->pool.nthreads ? 1 + set->segs[seg].ndocs / QUERY_RANGE_DOCS : 1;
+        ntasks +=ranges < QUERY_MAX_RANGES ? ranges : QUERY_MAX_RANGES;
+    }
+
+    // Every word is looked up in every segment once, in the order of the clauses
+    uint32_t *found =calloc( QUERY_SLOTS * nwords * set->count, sizeof( uint32_t ) );
+    query_task_t *task =calloc( ntasks, sizeof( query_task_t ) );
+    float *heaps =malloc( sizeof( float ) * k * ntasks );
+    if( found == NULL || task == NULL || heaps == NULL ) {
+        free( found );
+        free( task );
+        free( heaps );
+        return;
+    }
+    for( size_t seg =0, w =0; seg < set->count; seg++ ) {
+        segment_t *sg =&set->segs[seg];
+        // The text indices are read at once from the combined lists of newer segments
+        int unified =mode == QUERY_WEB && sg->hdr.version >= 2;
+        for( size_t i =0; i < q.count; i++ ) {
+            for( size_t j =0; j < q.clause[i].count; j++, w++ ) {
+                uint32_t *term =found + w * QUERY_SLOTS;
+                if( unified ) {
+                    term[IDX_FIELDS] =lookup_term( e, sg, SEGMENT_UNIFIED, q.clause[i].word[j] );
+                    continue;
+                }
+                // The link index is keyed by DOCID, not by keyword
+                for( index_t idx =from_idx; idx <= to_idx; idx++ )
+                    if( idx != IDX_LINKIDX )
+                        term[idx] =lookup_term( e, sg, idx, q.clause[i].word[j] );
+            }
+        }
+    }
+
+    // The document frequency of a keyword is the number of documents with it, or
+    // in older segments that of the index it is most common in
+    double n =0;
+    for( size_t seg =0; seg < set->count; seg++ )
+        n +=set->segs[seg].ndocs;
+    for( size_t i =0, w =0; i < q.count; i++ ) {
+        for( size_t j =0; j < q.clause[i].count; j++, w++ ) {
+            double df =0;
+            for( size_t seg =0; seg < set->count; seg++ ) {
+                const uint32_t *term =found + ( seg * nwords + w ) * QUERY_SLOTS;
+                uint32_t max =0;
+                for( index_t idx =0; idx < QUERY_SLOTS; idx++ )
+                    if( term[idx] && set->segs[seg].terms[term[idx]-1].df > max )
+                        max =set->segs[seg].terms[term[idx]-1].df;
+                df +=max;
+            }
+            q.clause[i].idf[j] =log( 1 + ( n - df + 0.5 ) / ( df + 0.5 ) );
+        }
+    }
+
+    // Images are hardly ever linked to, so only web results have a static score
+    const pagerank_t *ranks =mode == QUERY_WEB && e->ranks.count ? &e->ranks : NULL;
+    double rankmax =ranks != NULL && ranks->max > 1 ? ranks->max : 1;
+    double rankub =ranks != NULL ? QUERY_RANK_WEIGHT * rankmax / ( rankmax + 1 ) * QUERY_BOUND_SLACK : 0;
+
+    float shared =-1;
+    for( size_t seg =0, t =0; seg < set->count; seg++ ) {
+        size_t ranges =e->pool.nthreads ? 1 + set->segs[seg].ndocs / QUERY_RANGE_DOCS : 1;
+        if( ranges > QUERY_MAX_RANGES ) ranges =QUERY_MAX_RANGES;
+        for( size_t i =0; i < ranges; i++, t++ ) {
+            task[t].seg =seg;
+            task[t].lo =UINT64_MAX / ranges * i + ( i > 0 );
+            task[t].hi =i + 1 < ranges ? UINT64_MAX / ranges * ( i+1 ) : UINT64_MAX;
+            query_scorer_t s ={ &e->docs, e->avgdoclen, ranks, rankub, heaps + t * k, k, 0, &shared };
+            task[t].s =s;
+        }
+    }
+    query_job_t job ={ set, &q, found, nwords, from_idx, to_idx, task, timing != NULL };
+    uint64_t lookup =timing != NULL ? clock_ns() : 0;
+    taskpool_run( &e->pool, rank_task, &job, ntasks );
+    uint64_t run =timing != NULL ? clock_ns() : 0;
+
+    uint64_t ns =0, scorens =0;
+    for( size_t t =0; t < ntasks; t++ ) {
+        for( size_t i =0; i < task[t].count; i++ )
+            ranklist_add( r, task[t].elem[i].docid, task[t].elem[i].rank );
+        free( task[t].elem );
+        ns +=task[t].ns;
+        scorens +=task[t].scorens;
+    }
+    if( timing != NULL ) {
+        double scoring =ns > 0 ? (double)( run - lookup ) * scorens / ns : 0;
+        timing->dictionary +=( lookup - start ) / 1e9;
+        timing->postings +=( run - lookup - scoring ) / 1e9;
+        timing->scoring +=( scoring + clock_ns() - run ) / 1e9;
+    }
+    free( heaps );
+    free( task );
+    free( found );
+}
+
+/* Run imgcompare for `source' and return its output, which is already unlinked */
+static FILE*
+make_imgcompare( docid_t source ) {
+    char cmd[1024], out[] ="imgcompare.XXXXXX";
+    int fd =mkstemp( out );
+    if( fd < 0 )
+        return NULL;
+    close( fd );
+    sprintf( cmd, "%s " IDX_COLORCACHE "%Lx " IDX_COLORCACHE " %s", IMGCOMPARE_PATH, (long long unsigned int)source, out );
+    FILE *file =system( cmd ) == 0 ? fopen( out, "r" ) : NULL;
+    unlink( out );
+    return file;
+}
+
+/* Fill `rec' with what is shown of `docid'. The URL and the title come from the
+   document table, the repository is only read for the preview if `preview' is set
+   or for documents that are not in the table yet. Returns 0 on success */
+static int
+read_result( const doctable_t* docs, packstore_t* repo, packstore_cache_t* cache, docid_t docid, int preview, index_record_t* rec ) {
+    const doctable_doc_t *d =doctable_lookup( docs, docid );
+    if( d == NULL || ( rec->url =doctable_url( docs, d ) ) == NULL )
+        return index_readRepository( repo, cache, docid, rec );
+
+    rec->url_len =d->url_len;
+    rec->title =doctable_title( docs, d );
+    rec->title_len =d->title_len;
+    rec->text ="";
+    rec->text_len =0;
+
+    index_record_t full;
+    if( preview && rec->title != NULL && index_readRepository( repo, cache, docid, &full ) == 0 && full.text != NULL ) {
+        rec->text =full.text;
+        rec->text_len =full.text_len;
+    }
+    return 0;
+}
+
+/* Return the average length of the documents in `docs' */
+static double
+average_doclen( const doctable_t* docs ) {
+    double sum =0;
+    uint64_t n =0, count =doctable_count( docs );
+    for( uint64_t i =0; i < count; i++ ) {
+        const doctable_doc_t *d =doctable_get( docs, i );
+        if( d == NULL || d->doclen == 0 ) continue;
+        sum +=d->doclen;
+        n++;
+    }
+    return n ? sum / n : 1;
+}
+
+int
+query_open( query_engine_t* e ) {
+    memset( e, 0, sizeof( query_engine_t ) );
+    if( packstore_open( &e->repo, IDX_PATH[IDX_REPOSITORY], 0 ) != 0 ) {
+        fprintf( stderr, "Could not open the repository\n" );
+        return -1;
+    }
+    if( doctable_open( &e->docs, 0 ) != 0 ) {
+        fprintf( stderr, "Could not open the document table\n" );
+        packstore_close( &e->repo );
+        return -1;
+    }
+    if( segment_setOpen( &e->set ) != 0 ) {
+        fprintf( stderr, "Could not open the index\n" );
+        doctable_close( &e->docs );
+        packstore_close( &e->repo );
+        return -1;
+    }
+    if( packstore_open( &e->images, IDX_PATH[IDX_IMAGES], 0 ) != 0 ) {
+        fprintf( stderr, "Could not open the image store\n" );
+        segment_setClose( &e->set );
+        doctable_close( &e->docs );
+        packstore_close( &e->repo );
+        return -1;
+    }
+    e->imageurl =QUERY_IMAGEURL;
+    e->avgdoclen =average_doclen( &e->docs );
+    // Without ranks the results are ranked by their keywords alone
+    pagerank_open( &e->ranks );
+    resultcache_create( &e->cache, 0 );
+    termcache_create( &e->terms, 0 );
+    taskpool_create( &e->pool, 0 );
+    // Queries keep coming under load, a refresh must not wait for a gap between them
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init( &attr );
+    pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+    pthread_rwlock_init( &e->lock, &attr );
+    pthread_rwlockattr_destroy( &attr );
+    return 0;
+}
+
+void
+query_close( query_engine_t* e ) {
+    segment_setClose( &e->set );
+    doctable_close( &e->docs );
+    pagerank_close( &e->ranks );
+    packstore_close( &e->repo );
+    packstore_close( &e->images );
+    resultcache_free( &e->cache );
+    termcache_free( &e->terms );
+    taskpool_free( &e->pool );
+    pthread_rwlock_destroy( &e->lock );
+}
+
+int
+query_refresh( query_engine_t* e ) {
+    int changed =0, err =0;
+    pthread_rwlock_wrlock( &e->lock );
+
+    int r =segment_setRefresh( &e->set );
+    if( r < 0 )
+        err =-1;
+    else
+        changed |=r;
+
+    if( doctable_changed( &e->docs ) ) {
+        doctable_t docs;
+        if( doctable_open( &docs, 0 ) == 0 ) {
+            doctable_close( &e->docs );
+            e->docs =docs;
+            e->avgdoclen =average_doclen( &e->docs );
+            changed =1;
+        } else
+            err =-1;
+    }
+
+    if( pagerank_changed( &e->ranks ) ) {
+        pagerank_t ranks;
+        if( pagerank_open( &ranks ) == 0 ) {
+            pagerank_close( &e->ranks );
+            e->ranks =ranks;
+            changed =1;
+        } else
+            err =-1;
+    }
+
+    // New data files are mapped as they are needed, only a new index means reopening
+    if( packstore_changed( &e->repo ) ) {
+        packstore_close( &e->repo );
+        if( packstore_open( &e->repo, IDX_PATH[IDX_REPOSITORY], 0 ) != 0 )
+            err =-1;
+        e->generation++;
+        changed =1;
+    }
+    if( packstore_changed( &e->images ) ) {
+        packstore_close( &e->images );
+        if( packstore_open( &e->images, IDX_PATH[IDX_IMAGES], 0 ) != 0 )
+            err =-1;
+        changed =1;
+    }
+
+    // Results that were cached before are stale now
+    if( changed )
+        e->version++;
+    pthread_rwlock_unlock( &e->lock );
+    return err ? -1 : changed;
+}
+
+void
+query_cacheSize( query_engine_t* e, size_t results, size_t terms ) {
+    resultcache_free( &e->cache );
+    resultcache_create( &e->cache, results );
+    termcache_free( &e->terms );
+    termcache_create( &e->terms, terms );
+}
+
+int
+query_threads( query_engine_t* e, size_t n ) {
+    taskpool_free( &e->pool );
+    return taskpool_create( &e->pool, n );
+}
+
+void
+query_ctxCreate( query_ctx_t* c ) {
+    packstore_cacheCreate( &c->cache );
+    c->generation =0;
+    ranklist_create( &c->rank );
+    c->timed =0;
+    memset( &c->timing, 0, sizeof( query_timing_t ) );
+}
+
+void
+query_ctxFree( query_ctx_t* c ) {
+    packstore_cacheFree( &c->cache );
+    ranklist_free( &c->rank );
+}
+
+/* Write the part of the results before the first one */
+static void
+write_head( FILE* out, query_engine_t* e, query_mode_t mode, query_format_t format, const char* query, const index_record_t* source ) {
+    docid_t docid =strtoull( query, NULL, 16 );
+    if( format == QUERY_JSON ) {
+        fprintf( out, "{\"query\":" );
+        write_json( out, query, strlen( query ) );
+        fprintf( out, ",\"mode\":\"%s\",", MODE_NAME[mode] );
+        if( source != NULL ) {
+            fprintf( out, "\"source\":{\"docid\":\"%Lx\",\"url\":", (long long unsigned int)docid );
+            write_json( out, source->url, source->url_len );
+            fprintf( out, ",\"image\":\"%s%Lx\"},", e->imageurl, (long long unsigned int)docid );
+        }
+        fprintf( out, "\"results\":[" );
+        return;
+    }
+
+    if( mode != QUERY_COLOR ) {
+        fprintf( out, "<h2>Results for `" );
+        write_html( out, query, strlen( query ) );
+        fprintf( out, "'</h2>" );
+    } else if( source != NULL ) {
+        fprintf( out, "<h2>Images similar to:</h2>" );
+        fprintf( out, "<div class=\"img-query\">\n" );
+        fprintf( out, "\t<a href=\"" );
+        write_html( out, source->url, source->url_len );
+        fprintf( out, "\"><img src=\"%s%Lx\"/></a>\n", e->imageurl, (long long unsigned int)docid );
+        fprintf( out, "</div>" );
+    }
+}
+
+/* Write links to the previous page and, if there are `more' results, the next */
+static void
+write_pages( FILE* out, query_mode_t mode, const char* query, size_t page, int more ) {
+    fprintf( out, "<div class=\"pages\">" );
+    if( page > 0 ) {
+        fprintf( out, "<a href=\"?type=%s&q=", MODE_NAME[mode] );
+        write_urlparam( out, query );
+        fprintf( out, "&page=%zu\">&laquo; Previous</a> ", page - 1 );
+    }
+    fprintf( out, "Page %zu", page + 1 );
+    if( more ) {
+        fprintf( out, " <a href=\"?type=%s&q=", MODE_NAME[mode] );
+        write_urlparam( out, query );
+        fprintf( out, "&page=%zu\">Next &raquo;</a>", page + 1 );
+    }
+    fprintf( out, "</div>\n" );
+}
+
+/* Write result number `n' */
+static void
+write_result( FILE* out, query_engine_t* e, query_mode_t mode, query_format_t format, docid_t docid, const index_record_t* rec, int n ) {
+    size_t url_len =cut_utf8( rec->url, rec->url_len, QUERY_MAX_URLSIZE );
+    size_t title_len =cut_utf8( rec->title, rec->title_len, QUERY_MAX_TITLESIZE );
+    size_t preview_len =cut_utf8( rec->text, rec->text_len, QUERY_MAX_PREVIEWSIZE-1 );
+
+    if( format == QUERY_JSON ) {
+        fprintf( out, "%s{\"docid\":\"%Lx\",\"url\":", n ? "," : "", (long long unsigned int)docid );
+        write_json( out, rec->url, url_len );
+        if( mode == QUERY_WEB ) {
+            fprintf( out, ",\"title\":" );
+            write_json( out, rec->title, title_len );
+            fprintf( out, ",\"preview\":" );
+            write_json( out, rec->text, preview_len );
+        } else
+            fprintf( out, ",\"image\":\"%s%Lx\"", e->imageurl, (long long unsigned int)docid );
+        fprintf( out, "}" );
+        return;
+    }
+
+    if( mode == QUERY_WEB ) {
+        fprintf( out, "<div class=\"result\">\n" );
+        // Everything that was crawled is escaped, pages may contain markup
+        fprintf( out, "\t<h3><a href=\"" );
+        write_html( out, rec->url, url_len );
+        fprintf( out, "\">" );
+        write_html( out, rec->title, title_len );
+        fprintf( out, "</a></h3>\n\t<cite>" );
+        write_html( out, rec->url, url_len );
+        fprintf( out, "</cite>\n\t<p>" );
+        write_html( out, rec->text, preview_len );
+        fprintf( out, "...</p>\n" );
+        fprintf( out, "</div>\n" );
+    } else {
+        fprintf( out, "<div class=\"img-result\">\n" );
+        // Images are served from the image store, not by the site they were found on
+        fprintf( out, "\t<a href=\"" );
+        write_html( out, rec->url, url_len );
+        fprintf( out, "\"><img src=\"%s%Lx\"/></a>\n", e->imageurl, (long long unsigned int)docid );
+        if( mode == QUERY_IMAGES )
+            fprintf( out, "\t<a class=\"color-link\" href=\"?color&q=%Lx\">find by color</a>", (long long unsigned int)docid );
+        fprintf( out, "</div>" );
+    }
+}
+
+/* Answer `query' like query_run(), with the engine already locked. A color query
+   reads its results from `imgcompare_out', which is closed */
+static int
+run_query( query_engine_t* e, query_ctx_t* c, query_mode_t mode, query_format_t format,
+        const char* query, size_t page, FILE* imgcompare_out, FILE* out ) {
+    ranklist_t *r =&c->rank;
+    index_record_t rec;
+    docid_t docid;
+    int source =0;
+    size_t pagesize =mode == QUERY_WEB ? QUERY_PAGESIZE : QUERY_IMAGES_PAGESIZE;
+    size_t first =0, last =0;
+    int more =0;
+
+    if( c->generation != e->generation ) {
+        // The cached blocks are of a repository that has been replaced
+        packstore_cacheFree( &c->cache );
+        packstore_cacheCreate( &c->cache );
+        c->generation =e->generation;
+    }
+    ranklist_clear( r );
+
+    switch( mode ) {
+        case QUERY_WEB:
+        case QUERY_IMAGES:
+            // Only the page that is shown has to be in order, and one more
+            // result tells whether there is a next page
+            first =page * pagesize;
+            make_ranklist( r, e, query, mode, first + pagesize + 1, c->timed ? &c->timing : NULL );
+            uint64_t start =c->timed ? clock_ns() : 0;
+            last =ranklist_top( r, first, pagesize + 1 );
+            if( c->timed )
+                c->timing.scoring +=( clock_ns() - start ) / 1e9;
+            if( last > first + pagesize ) {
+                more =1;
+                last--;
+            }
+            break;
+        case QUERY_COLOR:
+            docid =strtoull( query, NULL, 16 );
+            source =read_result( &e->docs, &e->repo, &c->cache, docid, 0, &rec ) == 0;
+            break;
+    }
+    write_head( out, e, mode, format, query, source ? &rec : NULL );
+
+    size_t i =first;
+    int n =0;
+
+    while( 1 ) {
+        if( mode == QUERY_COLOR ) {
+            char docid_str[DOCID_STRLEN+2];
+            if( i == IMGCOMPARE_LIMIT ) break;
+            if( imgcompare_out == NULL || fgets( docid_str, DOCID_STRLEN+1, imgcompare_out ) == NULL ) break;
+            docid =strtoull( docid_str, NULL, 16 );
+        } else {
+            if( i >= last ) break;
+
+            docid =r->first[i].docid;
+        }
+        i++;
+
+        // The record points straight into the mapped tables
+        if( read_result( &e->docs, &e->repo, &c->cache, docid, mode == QUERY_WEB, &rec ) != 0 )
+            continue;
+        if( mode == QUERY_WEB && rec.title == NULL )
+            continue;
+        write_result( out, e, mode, format, docid, &rec, n++ );
+    }
+
+    if( imgcompare_out != NULL )
+        fclose( imgcompare_out );
+
+    if( format == QUERY_JSON )
+        fprintf( out, "],\"count\":%d,\"page\":%zu,\"more\":%s}\n",
+                n, mode == QUERY_COLOR ? 0 : page, more ? "true" : "false" );
+    else if( i == first )
+        fprintf( out, "<p>Your query returned no results</p>" );
+    else if( page > 0 || more )
+        write_pages( out, mode, query, page, more );
+    return n;
+}
+
+/* Count the time since `start' that is not in any other phase as rendering */
+static void
+end_timing( query_timing_t* t, uint64_t start ) {
+    double rest =( clock_ns() - start ) / 1e9 - t->dictionary - t->postings - t->scoring;
+    t->rendering =rest > 0 ? rest : 0;
+}
+
+int
+query_run( query_engine_t* e, query_ctx_t* c, query_mode_t mode, query_format_t format,
+        const char* query, size_t page, FILE* out ) {
+    // Queries that only differ in spacing have the same results
+    char norm[QUERY_MAX_KWSIZE+1], key[QUERY_MAX_KWSIZE+64];
+    size_t len =0;
+    for( const char *s =query; *s && len < QUERY_MAX_KWSIZE; s++ ) {
+        if( !isspace( (unsigned char)*s ) )
+            norm[len++] =*s;
+        else if( len > 0 && norm[len-1] != ' ' )
+            norm[len++] =' ';
+    }
+    if( len > 0 && norm[len-1] == ' ' ) len--;
+    norm[len] =0;
+
+    pthread_rwlock_rdlock( &e->lock );
+    memset( &c->timing, 0, sizeof( query_timing_t ) );
+    uint64_t start =c->timed ? clock_ns() : 0;
+    int keylen =snprintf( key, sizeof( key ), "%d %d %zu %s", mode, format, page, norm );
+    int n =e->cache.budget ? resultcache_get( &e->cache, key, keylen, e->version, out ) : -1;
+    if( n < 0 ) {
+        FILE *imgcompare_out =NULL;
+        if( mode == QUERY_COLOR ) {
+            // imgcompare takes a while, a refresh must not wait for it
+            pthread_rwlock_unlock( &e->lock );
+            if( ( imgcompare_out =make_imgcompare( strtoull( norm, NULL, 16 ) ) ) == NULL )
+                fprintf( stderr, "imgcompare returned with errors\n" );
+            pthread_rwlock_rdlock( &e->lock );
+        }
+
+        char *buf =NULL;
+        size_t size =0;
+        FILE *mem =e->cache.budget ? open_memstream( &buf, &size ) : NULL;
+        if( mem == NULL )
+            n =run_query( e, c, mode, format, norm, page, imgcompare_out, out );
+        else {
+            n =run_query( e, c, mode, format, norm, page, imgcompare_out, mem );
+            if( fclose( mem ) == 0 ) {
+                fwrite( buf, 1, size, out );
+                resultcache_put( &e->cache, key, keylen, e->version, buf, size, n );
+            } else
+                free( buf );
+        }
+    }
+    pthread_rwlock_unlock( &e->lock );
+    if( c->timed )
+        end_timing( &c->timing, start );
+    return n;
+}
+
+int
+query_image( query_engine_t* e, docid_t docid, char* type, size_t size, int* fd, uint64_t* offs, size_t* len ) {
+    index_image_t img;
+    pthread_rwlock_rdlock( &e->lock );
+    int err =index_readImage( &e->images, docid, &img );
+    if( err == 0 ) {
+        // The store may be opened again once the lock is released, keep the file open
+        if( ( *fd =dup( img.fd ) ) < 0 )
+            err =-1;
+        snprintf( type, size, "%.*s", (int)img.type_len, img.type );
+        *offs =img.offs;
+        *len =img.len;
+    }
+    pthread_rwlock_unlock( &e->lock );
+    return err;
+}
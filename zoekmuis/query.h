@@ -0,0 +1,129 @@
+/*
+ * Websearch - query.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * The query engine shared by webquery and webqueryd. An engine keeps the segments,
+ * the document table and the repository open, so it can answer any number of
+ * queries. Queries from several threads can run at once, every thread with its
+ * own query_ctx_t; query_refresh() picks up what the webspider and indexmerge
+ * wrote in the meantime.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "segment.h"
+#include "packstore.h"
+#include "doctable.h"
+#include "ranklist.h"
+#include "resultcache.h"
+#include "termcache.h"
+#include "taskpool.h"
+#include "pagerank.h"
+
+#define QUERY_MAX_KWSIZE 2048
+#define QUERY_MAX_TITLESIZE 80
+#define QUERY_MAX_URLSIZE 1024
+#define QUERY_MAX_PREVIEWSIZE 512
+#define QUERY_PAGESIZE 10               // Web results per page
+#define QUERY_IMAGES_PAGESIZE 40        // Image results per page
+#define QUERY_IMAGEURL "http://localhost:8090/image/"  // Where webqueryd serves the images
+
+typedef enum {
+    QUERY_WEB,
+    QUERY_IMAGES,
+    QUERY_COLOR                 // Images similar to the one whose DOCID is the keyword
+} query_mode_t;
+
+typedef enum {
+    QUERY_HTML,                 // The result list of the search page
+    QUERY_JSON
+} query_format_t;
+
+typedef struct {
+    pthread_rwlock_t lock;      // Read by queries, written by refreshes, which go first
+    segment_set_t set;
+    packstore_t repo;
+    doctable_t docs;
+    pagerank_t ranks;           // Static scores of the documents, if they were computed
+    packstore_t images;
+    const char *imageurl;       // Images are linked to as imageurl/<docid>
+    double avgdoclen;           // Average document length, for BM25F
+    uint64_t generation;        // Bumped every time the repository is opened again
+    uint64_t version;           // Bumped by every refresh that changes anything
+    resultcache_t cache;        // Rendered results of recent queries, off by default
+    termcache_t terms;          // Dictionary lookups of recent keywords, off by default
+    taskpool_t pool;            // Threads that help evaluate a query, none by default
+} query_engine_t;
+
+/* Seconds a query spent in each phase. Looking up its keywords in the
+   dictionaries, reading their postings, scoring and sorting the documents, and
+   rendering the page, which includes reading the results and the result cache */
+typedef struct {
+    double dictionary;
+    double postings;
+    double scoring;
+    double rendering;
+} query_timing_t;
+
+/* State of the queries of one thread */
+typedef struct {
+    packstore_cache_t cache;
+    uint64_t generation;        // Of the repository the cache holds blocks of
+    ranklist_t rank;            // Scores of the current query, reused by the next
+    int timed;                  // Whether queries fill in timing, off by default
+    query_timing_t timing;      // Of the last query
+} query_ctx_t;
+
+/* Open everything a query needs. Returns -1 on error */
+int
+query_open( query_engine_t* e );
+
+void
+query_close( query_engine_t* e );
+
+/* Open the parts that changed on disk again. Waits for running queries.
+   Returns 1 if anything changed, 0 if not and -1 on error */
+int
+query_refresh( query_engine_t* e );
+
+/* Give the result cache `results' bytes and the term cache `terms' bytes,
+   dropping what they hold. Call before running queries */
+void
+query_cacheSize( query_engine_t* e, size_t results, size_t terms );
+
+/* Let `n' threads help evaluate every query besides the one that runs it.
+   Call before running queries. Returns -1 on error */
+int
+query_threads( query_engine_t* e, size_t n );
+
+void
+query_ctxCreate( query_ctx_t* c );
+
+void
+query_ctxFree( query_ctx_t* c );
+
+/* Answer `query' in `mode' and write page `page' of the results, counting from
+   0, in `format' to `out'. A query has one or more words, which documents need
+   all of; `a OR b' needs either and `NOT a' or `-a' excludes a. Results are
+   ranked by BM25F over the title, URL and page text, and only the ones that can
+   still make it onto the page are scored, sorted and read. A color query is the DOCID of an image and
+   has a single page. When the cache of the engine has a budget, the page is
+   kept there until the next refresh that changes anything, for queries that
+   only differ in spacing. If `c' is timed, its timing is that of this query
+   afterwards. Returns the number of results on the page */
+int
+query_run( query_engine_t* e, query_ctx_t* c, query_mode_t mode, query_format_t format,
+        const char* query, size_t page, FILE* out );
+
+/* Look up the image of `docid' and copy its content type to `type'. The image is
+   `len' bytes at `offs' in `fd', which the caller has to close.
+   Returns 0 on success, 1 if there is no such image and -1 on error */
+int
+query_image( query_engine_t* e, docid_t docid, char* type, size_t size, int* fd, uint64_t* offs, size_t* len );
+
+#endif
@@ -0,0 +1,568 @@
+/*
+ * Websearch - querybench_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Measures how fast queries are answered. A number of clients send queries at
+ * the same time, each waiting for its answer before it sends the next, and the
+ * throughput and the latency percentiles are reported at the end. The queries
+ * are replayed from a log, one per line, or drawn from the keywords of the index
+ * with a Zipfian distribution, so common words come up as often as they would
+ * in real searches. Queries go to webqueryd over HTTP, or to any front end that
+ * speaks the same /api/search, or webquery is started for every query. The
+ * time every phase took is reported too when the front end tells, which
+ * webqueryd does with -t and webquery with --timing.
+ */
+
+#define _GNU_SOURCE
+#include "segment.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define QUERYBENCH_HOST "localhost"
+#define QUERYBENCH_PORT "8090"
+#define QUERYBENCH_REQUESTS 1000        // Queries of a generated workload
+#define QUERYBENCH_VOCABULARY 10000     // Most common keywords queries are drawn from
+#define QUERYBENCH_MAX_WORDS 3          // Keywords of a generated query
+#define QUERYBENCH_MAX_WORDLEN 64       // Longer keywords are left out of generated queries
+#define QUERYBENCH_ZIPF_S 1.0           // Exponent of the Zipfian distribution
+#define QUERYBENCH_RESPSIZE 8192        // Largest response head
+#define QUERYBENCH_MAX_CLIENTS 1024
+#define QUERYBENCH_PHASES 4
+
+static const char* PHASE_NAME[QUERYBENCH_PHASES] ={ "dict", "postings", "score", "render" };
+
+/* Outcome of one query */
+typedef struct {
+    double latency;                     // Seconds
+    double phase[QUERYBENCH_PHASES];    // Milliseconds, if timed
+    int ok;
+    int timed;
+} sample_t;
+
+/* A keyword and the number of documents it is in */
+typedef struct {
+    const char *word;
+    size_t len;
+    uint64_t df;
+} vocab_t;
+
+static char **queries;
+static size_t nqueries;
+static sample_t *samples;
+static size_t nrequests, warmup;
+static size_t next_request;             // Taken by the clients in turn
+static const char *host =QUERYBENCH_HOST, *port =QUERYBENCH_PORT;
+static const char *program;             // webquery to start for every query, or NULL for HTTP
+static const char *mode ="web";
+static size_t page;
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-l log | -z] [-n requests] [-c clients] [-w warmup] [-h host:port] [-x webquery] "
+            "[-i] [-p page] [-v words] [-s seed] - Measure the throughput and latency of queries\n", name );
+    fprintf( stderr, "\t-l log\treplay the queries in `log', one per line, in order\n" );
+    fprintf( stderr, "\t-z\tdraw queries of 1 to %d keywords of the index with a Zipfian distribution (default)\n",
+            QUERYBENCH_MAX_WORDS );
+    fprintf( stderr, "\t-n n\tnumber of queries, all of the log or %d by default\n", QUERYBENCH_REQUESTS );
+    fprintf( stderr, "\t-c n\tnumber of clients sending queries at the same time, 1 by default\n" );
+    fprintf( stderr, "\t-w n\tqueries to send before measuring, 0 by default\n" );
+    fprintf( stderr, "\t-h host:port\tfront end to query over HTTP, " QUERYBENCH_HOST ":" QUERYBENCH_PORT " by default\n" );
+    fprintf( stderr, "\t-x path\tstart webquery at `path' for every query instead\n" );
+    fprintf( stderr, "\t-i\tsearch images instead of web pages\n" );
+    fprintf( stderr, "\t-p n\tpage of results to ask for, counting from 0\n" );
+    fprintf( stderr, "\t-v n\tdraw keywords from the %d most common by default\n", QUERYBENCH_VOCABULARY );
+    fprintf( stderr, "\t-s n\tseed of the generated queries\n" );
+}
+
+static double
+now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Add `query' to the workload. Returns -1 on error */
+static int
+add_query( const char* query, size_t* size ) {
+    if( nqueries == *size ) {
+        char **q =realloc( queries, sizeof( char* ) * ( *size * 2 + 256 ) );
+        if( q == NULL ) return -1;
+        queries =q;
+        *size =*size * 2 + 256;
+    }
+    if( ( queries[nqueries] =strdup( query ) ) == NULL )
+        return -1;
+    nqueries++;
+    return 0;
+}
+
+/* Read the queries of the log `name', skipping empty lines. Returns -1 on error */
+static int
+load_log( const char* name ) {
+    FILE *file =fopen( name, "r" );
+    if( file == NULL ) {
+        fprintf( stderr, "load_log(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    char *line =NULL;
+    size_t linesize =0, size =0;
+    int err =0;
+    while( err == 0 && getline( &line, &linesize, file ) >= 0 ) {
+        line[strcspn( line, "\r\n" )] =0;
+        if( line[strspn( line, " \t" )] != 0 )
+            err =add_query( line, &size );
+    }
+    free( line );
+    fclose( file );
+    return err;
+}
+
+static int
+vocab_compareWord( const void* left, const void* right ) {
+    const vocab_t *l =left, *r =right;
+    size_t len =l->len < r->len ? l->len : r->len;
+    int c =memcmp( l->word, r->word, len );
+    return c != 0 ? c : ( l->len > r->len ) - ( l->len < r->len );
+}
+
+static int
+vocab_compareDf( const void* left, const void* right ) {
+    const vocab_t *l =left, *r =right;
+    return ( l->df < r->df ) - ( l->df > r->df );
+}
+
+/* Generate `n' queries of the `size' keywords of the page index that are in the
+   most documents, where the keyword of rank r comes up in proportion to
+   1 / r^QUERYBENCH_ZIPF_S. Returns -1 on error */
+static int
+make_zipf( size_t n, size_t size, unsigned short seed[3] ) {
+    segment_set_t set;
+    if( segment_setOpen( &set ) != 0 )
+        return -1;
+
+    // A keyword is in every segment its documents are in
+    size_t count =0;
+    for( size_t s =0; s < set.count; s++ )
+        count +=set.segs[s].hdr.nterms;
+    vocab_t *vocab =malloc( sizeof( vocab_t ) * ( count + 1 ) );
+    double *cdf =malloc( sizeof( double ) * ( size + 1 ) );
+    if( vocab == NULL || cdf == NULL ) {
+        free( vocab );
+        free( cdf );
+        segment_setClose( &set );
+        return -1;
+    }
+    count =0;
+    for( size_t s =0; s < set.count; s++ ) {
+        const segment_t *sg =&set.segs[s];
+        for( uint32_t i =0; i < sg->hdr.nterms; i++ ) {
+            const segment_term_t *t =&sg->terms[i];
+            if( t->idx != IDX_PAGEIDX || t->term_len > QUERYBENCH_MAX_WORDLEN ) continue;
+            vocab[count].word =sg->heap + t->term_off;
+            vocab[count].len =t->term_len;
+            vocab[count++].df =t->df;
+        }
+    }
+    qsort( vocab, count, sizeof( vocab_t ), vocab_compareWord );
+    size_t words =0;
+    for( size_t i =0; i < count; i++ ) {
+        if( words > 0 && vocab_compareWord( &vocab[words-1], &vocab[i] ) == 0 )
+            vocab[words-1].df +=vocab[i].df;
+        else
+            vocab[words++] =vocab[i];
+    }
+    qsort( vocab, words, sizeof( vocab_t ), vocab_compareDf );
+    if( size > words ) size =words;
+    if( size == 0 ) {
+        fprintf( stderr, "ERROR: the index has no keywords\n" );
+        free( vocab );
+        free( cdf );
+        segment_setClose( &set );
+        return -1;
+    }
+
+    double sum =0;
+    for( size_t r =0; r < size; r++ )
+        cdf[r] =sum +=1 / pow( r + 1, QUERYBENCH_ZIPF_S );
+
+    int err =0;
+    size_t qsize =0;
+    for( size_t i =0; i < n && err == 0; i++ ) {
+        char query[QUERYBENCH_MAX_WORDS * ( QUERYBENCH_MAX_WORDLEN + 1 )];
+        size_t len =0, nwords =1 + (size_t)( erand48( seed ) * QUERYBENCH_MAX_WORDS );
+        for( size_t w =0; w < nwords && w < QUERYBENCH_MAX_WORDS; w++ ) {
+            double x =erand48( seed ) * sum;
+            size_t lo =0, hi =size - 1;
+            while( lo < hi ) {
+                size_t mid =( lo + hi ) / 2;
+                if( cdf[mid] < x ) lo =mid + 1;
+                else hi =mid;
+            }
+            if( len > 0 ) query[len++] =' ';
+            memcpy( query + len, vocab[lo].word, vocab[lo].len );
+            len +=vocab[lo].len;
+        }
+        query[len] =0;
+        err =add_query( query, &qsize );
+    }
+    free( vocab );
+    free( cdf );
+    segment_setClose( &set );
+    return err;
+}
+
+/* Connect to the front end. Returns the socket or -1 on error */
+static int
+http_connect( void ) {
+    struct addrinfo hints, *res, *ai;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family =AF_UNSPEC;
+    hints.ai_socktype =SOCK_STREAM;
+    if( getaddrinfo( host, port, &hints, &res ) != 0 )
+        return -1;
+    int fd =-1, one =1;
+    for( ai =res; ai != NULL && fd < 0; ai =ai->ai_next ) {
+        fd =socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+        if( fd >= 0 && connect( fd, ai->ai_addr, ai->ai_addrlen ) != 0 ) {
+            close( fd );
+            fd =-1;
+        }
+    }
+    freeaddrinfo( res );
+    if( fd >= 0 )
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    return fd;
+}
+
+/* Read the phases from a Server-Timing header in `value' into `s' */
+static void
+parse_timing( sample_t* s, const char* value ) {
+    for( int p =0; p < QUERYBENCH_PHASES; p++ ) {
+        size_t len =strlen( PHASE_NAME[p] );
+        for( const char *v =value; ( v =strstr( v, PHASE_NAME[p] ) ) != NULL; v +=len ) {
+            if( ( v != value && isalnum( (unsigned char)v[-1] ) ) || strncmp( v + len, ";dur=", 5 ) != 0 )
+                continue;
+            s->phase[p] =strtod( v + len + 5, NULL );
+            s->timed =1;
+            break;
+        }
+    }
+}
+
+/* Ask the front end on `*fd' for `query', connecting again when the connection
+   was closed, and fill in `s'. Returns -1 on error */
+static int
+http_query( int* fd, const char* query, sample_t* s ) {
+    char req[QUERYBENCH_RESPSIZE * 3 + 256], head[QUERYBENCH_RESPSIZE+1];
+    int n =snprintf( req, sizeof( req ), "GET /api/search?type=%s&page=%zu&q=", mode, page );
+    for( const unsigned char *q =(const unsigned char*)query; *q && n < sizeof( req ) - 128; q++ ) {
+        if( isalnum( *q ) || strchr( "-_.~", *q ) )
+            req[n++] =*q;
+        else
+            n +=sprintf( req + n, "%%%02X", *q );
+    }
+    n +=snprintf( req + n, sizeof( req ) - n, " HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", host );
+
+    for( int attempt =0; attempt < 2; attempt++ ) {
+        // The front end may have closed an idle connection
+        if( *fd < 0 && ( *fd =http_connect( ) ) < 0 )
+            return -1;
+        size_t len =0;
+        ssize_t got =0;
+        char *end =NULL;
+        if( send( *fd, req, n, MSG_NOSIGNAL ) == n ) {
+            while( len < QUERYBENCH_RESPSIZE && ( got =recv( *fd, head + len, QUERYBENCH_RESPSIZE - len, 0 ) ) > 0 ) {
+                len +=got;
+                head[len] =0;
+                if( ( end =strstr( head, "\r\n\r\n" ) ) != NULL ) break;
+            }
+        }
+        if( end == NULL ) {
+            close( *fd );
+            *fd =-1;
+            if( len == 0 ) continue;
+            return -1;
+        }
+
+        *end =0;
+        size_t body =0;
+        int keep =1;
+        s->ok =strncmp( head, "HTTP/1.1 200", 12 ) == 0;
+        for( char *line =strstr( head, "\r\n" ); line != NULL; line =strstr( line, "\r\n" ) ) {
+            line +=2;
+            if( strncasecmp( line, "Content-Length:", 15 ) == 0 )
+                body =strtoul( line + 15, NULL, 10 );
+            else if( strncasecmp( line, "Server-Timing:", 14 ) == 0 ) {
+                char *eol =strstr( line, "\r\n" );
+                if( eol != NULL ) *eol =0;
+                parse_timing( s, line + 14 );
+                if( eol != NULL ) *eol ='\r';
+            } else if( strncasecmp( line, "Connection: close", 17 ) == 0 )
+                keep =0;
+        }
+        // Skip the body, of which a part may already be read
+        size_t have =len - ( end + 4 - head );
+        while( have < body ) {
+            char buf[65536];
+            got =recv( *fd, buf, body - have < sizeof( buf ) ? body - have : sizeof( buf ), 0 );
+            if( got <= 0 ) {
+                close( *fd );
+                *fd =-1;
+                return -1;
+            }
+            have +=got;
+        }
+        if( !keep ) {
+            close( *fd );
+            *fd =-1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Start webquery for `query' and fill in `s' from the timing it prints.
+   Returns -1 on error */
+static int
+exec_query( const char* query, sample_t* s ) {
+    char pagestr[32];
+    int fds[2];
+    snprintf( pagestr, sizeof( pagestr ), "%zu", page );
+    if( pipe2( fds, O_CLOEXEC ) != 0 )
+        return -1;
+    pid_t pid =fork( );
+    if( pid < 0 ) {
+        close( fds[0] );
+        close( fds[1] );
+        return -1;
+    }
+    if( pid == 0 ) {
+        int null =open( "/dev/null", O_WRONLY );
+        if( null < 0 || dup2( null, STDOUT_FILENO ) < 0 || dup2( fds[1], STDERR_FILENO ) < 0 )
+            _exit( 127 );
+        char *args[] ={ (char*)program, "--query", (char*)query, "--timing", "--page", pagestr,
+                strcmp( mode, "images" ) == 0 ? "--images" : NULL, NULL };
+        execv( program, args );
+        _exit( 127 );
+    }
+    close( fds[1] );
+
+    char out[4096];
+    size_t len =0;
+    ssize_t got;
+    while( ( got =read( fds[0], out + len, sizeof( out ) - 1 - len ) ) > 0 )
+        len +=got;
+    close( fds[0] );
+    out[len] =0;
+
+    int status;
+    if( waitpid( pid, &status, 0 ) != pid )
+        return -1;
+    s->ok =WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+    // webquery prints timing: dict <ms> postings <ms> score <ms> render <ms> ms
+    char *t =strstr( out, "timing:" );
+    for( int p =0; t != NULL && p < QUERYBENCH_PHASES; p++ ) {
+        char *v =strstr( t, PHASE_NAME[p] );
+        if( v == NULL ) break;
+        s->phase[p] =strtod( v + strlen( PHASE_NAME[p] ), NULL );
+        s->timed =p + 1 == QUERYBENCH_PHASES;
+    }
+    return 0;
+}
+
+static void*
+client( void* arg ) {
+    int fd =-1;
+    while( 1 ) {
+        size_t i =__atomic_fetch_add( &next_request, 1, __ATOMIC_RELAXED );
+        if( i >= warmup + nrequests ) break;
+        sample_t s;
+        memset( &s, 0, sizeof( sample_t ) );
+        double start =now( );
+        const char *query =queries[i % nqueries];
+        int err =program != NULL ? exec_query( query, &s ) : http_query( &fd, query, &s );
+        s.latency =now( ) - start;
+        if( err != 0 )
+            s.ok =0;
+        if( i >= warmup )
+            samples[i - warmup] =s;
+    }
+    if( fd >= 0 )
+        close( fd );
+    return NULL;
+}
+
+static int
+double_compare( const void* left, const void* right ) {
+    double l =*(const double*)left, r =*(const double*)right;
+    return ( l > r ) - ( l < r );
+}
+
+/* Return percentile `p' of the `n' sorted values in `v' */
+static double
+percentile( const double* v, size_t n, double p ) {
+    size_t i =(size_t)ceil( p * n );
+    return v[i > 0 ? i - 1 : 0];
+}
+
+/* Print the mean and the percentiles of the `n' values in `v', sorting them */
+static void
+report( const char* name, double* v, size_t n ) {
+    double sum =0;
+    for( size_t i =0; i < n; i++ )
+        sum +=v[i];
+    qsort( v, n, sizeof( double ), double_compare );
+    printf( "%-10s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, sum / n,
+            percentile( v, n, 0.5 ), percentile( v, n, 0.95 ), percentile( v, n, 0.99 ),
+            percentile( v, n, 0.999 ), v[n-1] );
+}
+
+int main( int argc, char** argv ) {
+    const char *log =NULL;
+    size_t clients =1, vocabulary =QUERYBENCH_VOCABULARY;
+    long requests =-1;
+    unsigned short seed[3] ={ 0x330e, 0, 0 };
+    char hostbuf[256];
+
+    for( int i =1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-l" ) == 0 && i+1 < argc ) {
+            log =argv[++i];
+            continue;
+        }
+        if( strcmp( argv[i], "-z" ) == 0 ) {
+            log =NULL;
+            continue;
+        }
+        if( strcmp( argv[i], "-n" ) == 0 && i+1 < argc && ( requests =atol( argv[++i] ) ) > 0 )
+            continue;
+        if( strcmp( argv[i], "-c" ) == 0 && i+1 < argc && ( clients =atol( argv[++i] ) ) > 0 )
+            continue;
+        if( strcmp( argv[i], "-w" ) == 0 && i+1 < argc ) {
+            warmup =strtoul( argv[++i], NULL, 10 );
+            continue;
+        }
+        if( strcmp( argv[i], "-h" ) == 0 && i+1 < argc ) {
+            snprintf( hostbuf, sizeof( hostbuf ), "%s", argv[++i] );
+            char *colon =strrchr( hostbuf, ':' );
+            if( colon != NULL ) {
+                *colon =0;
+                port =colon + 1;
+            }
+            host =hostbuf;
+            continue;
+        }
+        if( strcmp( argv[i], "-x" ) == 0 && i+1 < argc ) {
+            program =argv[++i];
+            continue;
+        }
+        if( strcmp( argv[i], "-i" ) == 0 ) {
+            mode ="images";
+            continue;
+        }
+        if( strcmp( argv[i], "-p" ) == 0 && i+1 < argc ) {
+            page =strtoul( argv[++i], NULL, 10 );
+            continue;
+        }
+        if( strcmp( argv[i], "-v" ) == 0 && i+1 < argc && ( vocabulary =atol( argv[++i] ) ) > 0 )
+            continue;
+        if( strcmp( argv[i], "-s" ) == 0 && i+1 < argc ) {
+            unsigned long s =strtoul( argv[++i], NULL, 10 );
+            seed[1] =s;
+            seed[2] =s >> 16;
+            continue;
+        }
+        show_help( *argv );
+        return 0;
+    }
+    if( clients > QUERYBENCH_MAX_CLIENTS ) clients =QUERYBENCH_MAX_CLIENTS;
+
+    int err =log != NULL ? load_log( log )
+            : make_zipf( requests > 0 ? requests : QUERYBENCH_REQUESTS, vocabulary, seed );
+    if( err != 0 || nqueries == 0 ) {
+        fprintf( stderr, "ERROR: there are no queries to send\n" );
+        return -1;
+    }
+    // A log is replayed once, or as often as it takes
+    nrequests =requests > 0 ? requests : nqueries;
+    samples =calloc( nrequests, sizeof( sample_t ) );
+    pthread_t *threads =malloc( sizeof( pthread_t ) * clients );
+    if( samples == NULL || threads == NULL ) {
+        fprintf( stderr, "ERROR: out of memory\n" );
+        return -1;
+    }
+
+    // The warmup queries are taken first, so the clock starts once they are all answered
+    size_t started =0;
+    double start =now( );
+    if( warmup > 0 ) {
+        size_t n =nrequests;
+        nrequests =0;
+        for( ; started < clients; started++ )
+            if( pthread_create( &threads[started], NULL, client, NULL ) != 0 )
+                break;
+        for( size_t i =0; i < started; i++ )
+            pthread_join( threads[i], NULL );
+        nrequests =n;
+        next_request =warmup;
+        started =0;
+        start =now( );
+    }
+    for( ; started < clients; started++ )
+        if( pthread_create( &threads[started], NULL, client, NULL ) != 0 )
+            break;
+    if( started == 0 ) {
+        fprintf( stderr, "ERROR: could not start the clients\n" );
+        return -1;
+    }
+    for( size_t i =0; i < started; i++ )
+        pthread_join( threads[i], NULL );
+    double wall =now( ) - start;
+
+    // Only the queries that were answered count for the latency
+    double *v =malloc( sizeof( double ) * nrequests );
+    if( v == NULL ) return -1;
+    size_t ok =0, timed =0;
+    for( size_t i =0; i < nrequests; i++ )
+        if( samples[i].ok ) {
+            v[ok++] =samples[i].latency * 1e3;
+            timed +=samples[i].timed;
+        }
+    printf( "%zu queries, %zu errors, %zu clients, %.3f s, %.1f queries/s\n",
+            nrequests, nrequests - ok, started, wall, ok / wall );
+    if( ok > 0 ) {
+        printf( "%-10s %10s %10s %10s %10s %10s %10s\n", "ms", "mean", "p50", "p95", "p99", "p999", "max" );
+        report( "latency", v, ok );
+    }
+    if( timed > 0 ) {
+        for( int p =0; p < QUERYBENCH_PHASES; p++ ) {
+            size_t n =0;
+            for( size_t i =0; i < nrequests; i++ )
+                if( samples[i].ok && samples[i].timed )
+                    v[n++] =samples[i].phase[p];
+            report( PHASE_NAME[p], v, n );
+        }
+    }
+    free( v );
+    free( samples );
+    free( threads );
+    for( size_t i =0; i < nqueries; i++ )
+        free( queries[i] );
+    free( queries );
+    return ok == nrequests ? 0 : 1;
+}
@@ -11,8 +11,9 @@
 #include <assert.h>
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 
-#define RANKLIST_ARRAYSIZE_INCR 1024
+#define RANKLIST_INITSIZE 1024
 
 static int
 rank_compare( const void* left, const void* right ) {
@@ -42,47 +43,187 @@ ranklist_idxWeight( index_t idx ) {
 void
 ranklist_create( ranklist_t* r ) {
     r->count =0;
-    r->first =malloc( sizeof( rankelem_t ) * RANKLIST_ARRAYSIZE_INCR );
-    r->size =RANKLIST_ARRAYSIZE_INCR;
+    r->first =malloc( sizeof( rankelem_t ) * RANKLIST_INITSIZE );
+    r->size =RANKLIST_INITSIZE;
+    r->nslots =RANKLIST_INITSIZE * 2;
+    r->slots =calloc( r->nslots, sizeof( uint32_t ) );
+    assert( r->first != NULL && r->slots != NULL );
 }
 
 void 
 ranklist_free( ranklist_t* r ) {
     free( r->first );
-    r->size =r->count =0;
+    free( r->slots );
+    r->first =NULL;
+    r->slots =NULL;
+    r->size =r->count =r->nslots =0;
 }
 
-void
-ranklist_push( ranklist_t* r, docid_t docid, index_t idx ) {
-    // First, check if the docid already exists
-    // TODO: add a separate bin. tree to do this faster
-    rankelem_t *elem =NULL;
+static inline size_t
+slot_hash( docid_t docid ) {
+    // DOCIDs are hashes already, just spread the high bits
+    return ( docid * 0x9e3779b97f4a7c15ull ) >> 17;
+}
+
+/* Point the table at the elements where they are now */
+static void
+slots_fill( ranklist_t* r ) {
+    memset( r->slots, 0, sizeof( uint32_t ) * r->nslots );
     for( size_t i =0; i < r->count; i++ ) {
-        if( r->first[i].docid == docid ) {
-            elem =r->first + i;
-            break;
-        }
+        size_t h =slot_hash( r->first[i].docid ) & (r->nslots-1);
+        while( r->slots[h] != 0 )
+            h =(h+1) & (r->nslots-1);
+        r->slots[h] =i + 1;
     }
+}
 
-    if( elem ) {
-        elem->rank +=ranklist_idxWeight( idx );
-        return;
-    }
+/* Double the table and add all elements to it again */
+static void
+slots_grow( ranklist_t* r ) {
+    free( r->slots );
+    r->nslots *=2;
+    r->slots =malloc( sizeof( uint32_t ) * r->nslots );
+    assert( r->slots != NULL );
+    slots_fill( r );
+}
 
+/* Return the slot of `docid', which is in the list */
+static size_t
+slot_find( const ranklist_t* r, docid_t docid ) {
+    size_t h =slot_hash( docid ) & (r->nslots-1);
+    while( r->first[r->slots[h]-1].docid != docid )
+        h =(h+1) & (r->nslots-1);
+    return h;
+}
 
+/* Append a new element for `docid' and return it */
+static rankelem_t*
+elem_append( ranklist_t* r, docid_t docid ) {
     // Make more room if neccesary
     if( r->count == r->size ) {
-        r->first =realloc( r->first, sizeof( rankelem_t) * (r->size += RANKLIST_ARRAYSIZE_INCR) );
+        r->first =realloc( r->first, sizeof( rankelem_t) * (r->size *=2) );
         assert( r->first != NULL );
     }
-    elem =r->first + r->count;
+    rankelem_t *elem =r->first + r->count++;
     elem->docid =docid;
-    elem->rank =ranklist_idxWeight( idx );
+    elem->rank =0;
+    return elem;
+}
 
-    r->count++;
+void
+ranklist_push( ranklist_t* r, docid_t docid, index_t idx, int tf ) {
+    ranklist_add( r, docid, ranklist_idxWeight( idx ) * tf );
+}
+
+void
+ranklist_add( ranklist_t* r, docid_t docid, float score ) {
+    // Keep the table at most half full, so probe sequences stay short
+    if( ( r->count + 1 ) * 2 > r->nslots )
+        slots_grow( r );
+
+    size_t h =slot_hash( docid ) & (r->nslots-1);
+    while( r->slots[h] != 0 && r->first[r->slots[h]-1].docid != docid )
+        h =(h+1) & (r->nslots-1);
+
+    if( r->slots[h] == 0 ) {
+        elem_append( r, docid );
+        r->slots[h] =r->count;
+    }
+    r->first[r->slots[h]-1].rank +=score;
+}
+
+void
+ranklist_clear( ranklist_t* r ) {
+    // The slot of an element is in the run of used slots from its hash on. All
+    // elements go, so that whole run can be emptied, which every slot is just once
+    for( size_t i =0; i < r->count; i++ ) {
+        size_t h =slot_hash( r->first[i].docid ) & (r->nslots-1);
+        while( r->slots[h] != 0 ) {
+            r->slots[h] =0;
+            h =(h+1) & (r->nslots-1);
+        }
+    }
+    r->count =0;
 }
 
 void
 ranklist_sort( ranklist_t* r ) {
     qsort( (void*)r->first, (size_t)r->count, sizeof( rankelem_t ), rank_compare );
+    slots_fill( r );
+}
+
+/* Whether element `a' ranks before `b'. Ties keep the order they were pushed in */
+static inline int
+rank_before( const ranklist_t* r, uint32_t a, uint32_t b ) {
+    return r->first[a].rank > r->first[b].rank || ( r->first[a].rank == r->first[b].rank && a < b );
+}
+
+/* Restore the heap below `i', which has the worst element at the root */
+static void
+heap_down( const ranklist_t* r, uint32_t* heap, size_t len, size_t i ) {
+    while( 1 ) {
+        size_t worst =i, left =2*i + 1, right =left + 1;
+        if( left < len && rank_before( r, heap[worst], heap[left] ) )
+            worst =left;
+        if( right < len && rank_before( r, heap[worst], heap[right] ) )
+            worst =right;
+        if( worst == i )
+            return;
+        uint32_t tmp =heap[i];
+        heap[i] =heap[worst];
+        heap[worst] =tmp;
+        i =worst;
+    }
+}
+
+size_t
+ranklist_top( ranklist_t* r, size_t offset, size_t k ) {
+    size_t n =offset + k < r->count ? offset + k : r->count;
+    if( n == 0 )
+        return 0;
+
+    // Keep the best n elements seen so far in a heap with the worst of them on top
+    uint32_t *heap =malloc( sizeof( uint32_t ) * n );
+    docid_t *best =malloc( sizeof( docid_t ) * n );
+    assert( heap != NULL && best != NULL );
+    size_t len =0;
+    for( uint32_t i =0; i < r->count; i++ ) {
+        if( len < n ) {
+            size_t j =len++;
+            heap[j] =i;
+            while( j > 0 && rank_before( r, heap[(j-1)/2], heap[j] ) ) {
+                uint32_t tmp =heap[j];
+                heap[j] =heap[(j-1)/2];
+                heap[(j-1)/2] =tmp;
+                j =(j-1)/2;
+            }
+        } else if( rank_before( r, i, heap[0] ) ) {
+            heap[0] =i;
+            heap_down( r, heap, len, 0 );
+        }
+    }
+
+    // Taking the worst off the top gives them from the back
+    for( size_t j =n; j-- > 0; ) {
+        best[j] =r->first[heap[0]].docid;
+        heap[0] =heap[--len];
+        heap_down( r, heap, len, 0 );
+    }
+
+    // Swap them to the front in place, the table follows the elements it points at
+    for( size_t j =0; j < n; j++ ) {
+        size_t h =slot_find( r, best[j] ), i =r->slots[h]-1;
+        if( i == j )
+            continue;
+        size_t g =slot_find( r, r->first[j].docid );
+        rankelem_t tmp =r->first[i];
+        r->first[i] =r->first[j];
+        r->first[j] =tmp;
+        r->slots[h] =j + 1;
+        r->slots[g] =i + 1;
+    }
+
+    free( best );
+    free( heap );
+    return n;
 }
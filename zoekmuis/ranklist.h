@@ -5,23 +5,30 @@
  * Micky Faas
  *
  * Implements a simple associative array that stores <docid, rank> tuples 
+ *
+ * The elements are kept in the order they were added and found through an open
+ * addressing table keyed by DOCID. The table only grows, so it is cleared by
+ * walking the elements rather than the whole table.
  */
 
 #ifndef RANKLIST_H
 #define RANKLIST_H
 
+#include <stdint.h>
 #include "docid.h"
 #include "index.h"
 
 typedef struct rankelem {
     docid_t docid;
-    int rank;
+    float rank;
 } rankelem_t;
 
 typedef struct ranklist {
     rankelem_t *first;  // Pointer to the first element
     size_t count;       // Actual number of elements
     size_t size;        // Total array size
+    uint32_t *slots;    // Element + 1 by DOCID
+    size_t nslots;      // Number of slots, a power of two
 } ranklist_t;
 
 int 
@@ -33,11 +40,30 @@ ranklist_create( ranklist_t* r );
 void 
 ranklist_free( ranklist_t* r );
 
+/* Add `tf' occurrences of `docid' in index `idx' to its rank */
+void
+ranklist_push( ranklist_t* r, docid_t docid, index_t idx, int tf );
+
+/* Add `score' to the rank of `docid' */
 void
-ranklist_push( ranklist_t* r, docid_t docid, index_t idx );
+ranklist_add( ranklist_t* r, docid_t docid, float score );
 
+/* Remove all elements, so the list can be used for the next query */
+void
+ranklist_clear( ranklist_t* r );
+
+/* Sort by rank, ties end up in no particular order. Elements can still be added
+   afterwards */
 void
 ranklist_sort( ranklist_t* r );
 
+/* Move the best `offset' + `k' elements to the front, sorted by rank with ties in
+   the order they were in, and leave the others behind them in no particular
+   order. Takes O(n log (offset+k)) time and O(offset+k) memory instead of
+   sorting all n elements. Elements can still be added afterwards.
+   Returns the number of elements that were sorted */
+size_t
+ranklist_top( ranklist_t* r, size_t offset, size_t k );
+
 #endif
 
@@ -0,0 +1,232 @@
+/*
+ * Websearch - reindex_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Rebuilds the web, title and page keywords of all documents from the repository,
+ * without crawling. The repository is divided into contiguous parts for a number
+ * of workers that each write their own segments; these are merged with the existing index
+ * at the end. Images are left out, their keywords are kept.
+ * The lengths of the documents in the document table are updated to match, so
+ * do not run it while the webspider is running.
+ */
+
+#define _GNU_SOURCE
+#include "segment.h"
+#include "index.h"
+#include "docid.h"
+#include "doctable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct {
+    packstore_t *repo;
+    const docid_t *docs;        // Slice of the DOCIDs for this worker
+    uint32_t *doclen;           // Their new lengths, UINT32_MAX if not indexed
+    size_t count;
+    size_t indexed;
+    int err;
+} worker_t;
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-j n] - Rebuild the keyword indices from the repository\n", name );
+    fprintf( stderr, "\t-j n\tnumber of worker threads, one per core by default\n" );
+}
+
+/* Return 1 if the `len' bytes at `str' are `placeholder' */
+static int
+is_placeholder( const char* str, size_t len, const char* placeholder ) {
+    return len == strlen( placeholder ) && memcmp( str, placeholder, len ) == 0;
+}
+
+/* Tokenize the URL, title and text of one record into `page', leaving out what
+   the webspider stored in place of a missing title or text.
+   Returns 1 if the record is not a webpage, -1 on error */
+static int
+index_record( index_page_t* page, const index_record_t* rec ) {
+    // Images have no title
+    if( rec->title == NULL )
+        return 1;
+
+    size_t title_len =is_placeholder( rec->title, rec->title_len, IDX_UNTITLED ) ? 0 : rec->title_len;
+    size_t text_len =rec->text == NULL || is_placeholder( rec->text, rec->text_len, IDX_NODESCRIPTION )
+            ? 0 : rec->text_len;
+
+    // The tokenizer works in place, so it gets a copy of the title and text
+    char *title =malloc( title_len + text_len + 2 );
+    if( title == NULL ) return -1;
+    char *text =title + title_len + 1;
+    memcpy( title, rec->title, title_len );
+    title[title_len] =0;
+    memcpy( text, rec->text, text_len );
+    text[text_len] =0;
+
+    int err =0;
+    if( index_pageAddUrl( page, rec->url, rec->url_len ) != 0
+            || index_pageAddInner( page, IDX_TITLEIDX, title ) != 0
+            || index_pageAddInner( page, IDX_PAGEIDX, text ) != 0
+            || index_pageFinish( page ) != 0 )
+        err =-1;
+    free( title );
+    return err;
+}
+
+static void*
+worker( void* arg ) {
+    worker_t *w =arg;
+    segment_builder_t seg;
+    index_page_t page;
+    packstore_cache_t cache;
+
+    segment_builderCreate( &seg );
+    packstore_cacheCreate( &cache );
+    for( size_t i =0; i < w->count && !w->err; i++ ) {
+        index_record_t rec;
+        if( index_readRepository( w->repo, &cache, w->docs[i], &rec ) != 0 ) {
+            fprintf( stderr, "Could not read the repository record of %Lx\n", (long long unsigned int)w->docs[i] );
+            continue;
+        }
+
+        index_pageCreate( &page, w->docs[i] );
+        int err =index_record( &page, &rec );
+        if( err == 0 ) {
+            if( segment_builderAddPage( &seg, &page ) != 0 )
+                w->err =-1;
+            w->doclen[i] =0;
+            for( int idx =0; idx < IDX_FIELDS; idx++ )
+                w->doclen[i] +=page.wordpos[idx];
+            w->indexed++;
+        } else if( err < 0 )
+            w->err =-1;
+        index_pageFree( &page );
+
+        if( !w->err && segment_builderFull( &seg ) && segment_builderFlush( &seg ) != 0 )
+            w->err =-1;
+    }
+    if( !w->err && segment_builderFlush( &seg ) != 0 )
+        w->err =-1;
+    segment_builderFree( &seg );
+    packstore_cacheFree( &cache );
+    return NULL;
+}
+
+/* Set the length of the `count' documents in `docs' to `doclen' in the
+   document table, where it changed. BM25F normalizes by it, so it has to match
+   the keywords. Returns -1 on error */
+static int
+update_doclen( const docid_t* docs, const uint32_t* doclen, size_t count ) {
+    doctable_t old, table;
+    if( doctable_open( &old, 0 ) != 0 )
+        return -1;
+    if( doctable_open( &table, 1 ) != 0 ) {
+        doctable_close( &old );
+        return -1;
+    }
+    // The entries are read from the table as it was opened, the writer only appends
+    int err =0;
+    for( size_t i =0; i < count && !err; i++ ) {
+        const doctable_doc_t *d =doctable_lookup( &old, docs[i] );
+        if( doclen[i] == UINT32_MAX || d == NULL || d->doclen == doclen[i] )
+            continue;
+        err =doctable_put( &table, docs[i], doctable_url( &old, d ), d->url_len,
+                doctable_title( &old, d ), d->title_len, doclen[i], d->crawled );
+    }
+    doctable_close( &table );
+    doctable_close( &old );
+    return err;
+}
+
+/* Merge everything into one segment, which drops the old postings of the
+   documents that were indexed again */
+static int
+merge_all( void ) {
+    segment_set_t set;
+    int err =0;
+    if( segment_setOpen( &set ) != 0 )
+        return -1;
+    if( set.count > 1 )
+        err =segment_merge( &set, 0, set.count );
+    segment_setClose( &set );
+    return err;
+}
+
+int main( int argc, char** argv ) {
+    long cores =sysconf( _SC_NPROCESSORS_ONLN );
+    int nworkers =cores > 0 ? cores : 1;
+
+    for( int i =1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-j" ) == 0 && i+1 < argc && ( nworkers =atoi( argv[++i] ) ) > 0 )
+            continue;
+        show_help( *argv );
+        return 0;
+    }
+
+    packstore_t repo;
+    if( packstore_open( &repo, IDX_PATH[IDX_REPOSITORY], 0 ) != 0 )
+        return -1;
+    size_t count =packstore_count( &repo );
+    docid_t *docs =malloc( sizeof( docid_t ) * (count+1) );
+    uint32_t *doclen =malloc( sizeof( uint32_t ) * (count+1) );
+    if( count == 0 || docs == NULL || doclen == NULL ) {
+        fprintf( stderr, "ERROR: the repository is empty\n" );
+        packstore_close( &repo );
+        free( docs );
+        free( doclen );
+        return -1;
+    }
+    memset( doclen, 0xff, sizeof( uint32_t ) * count );
+    count =packstore_list( &repo, docs, count );
+    if( nworkers > count )
+        nworkers =count;
+
+    // Every worker reads a contiguous part of the repository
+    worker_t *workers =calloc( nworkers, sizeof( worker_t ) );
+    pthread_t *threads =malloc( sizeof( pthread_t ) * nworkers );
+    size_t first =0;
+    for( int i =0; i < nworkers; i++ ) {
+        workers[i].repo =&repo;
+        workers[i].docs =docs + first;
+        workers[i].doclen =doclen + first;
+        workers[i].count =count / nworkers + ( i < count % nworkers );
+        first +=workers[i].count;
+        pthread_create( &threads[i], NULL, worker, &workers[i] );
+    }
+
+    size_t indexed =0;
+    int err =0;
+    for( int i =0; i < nworkers; i++ ) {
+        pthread_join( threads[i], NULL );
+        indexed +=workers[i].indexed;
+        err |=workers[i].err;
+    }
+    free( threads );
+    free( workers );
+    packstore_close( &repo );
+
+    if( err ) {
+        fprintf( stderr, "ERROR: reindexing failed\n" );
+        free( docs );
+        free( doclen );
+        return -1;
+    }
+    fprintf( stderr, "Reindexed %zu of %zu documents with %d workers\n", indexed, count, nworkers );
+
+    err =update_doclen( docs, doclen, count );
+    free( docs );
+    free( doclen );
+    if( err != 0 ) {
+        fprintf( stderr, "ERROR: updating the document lengths failed\n" );
+        return -1;
+    }
+
+    if( merge_all( ) != 0 ) {
+        fprintf( stderr, "ERROR: merging failed\n" );
+        return -1;
+    }
+    return 0;
+}
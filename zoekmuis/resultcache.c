@@ -0,0 +1,135 @@
+/*
+ * Websearch - resultcache.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Least recently used cache of rendered query results
+ */
+
+#include "resultcache.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RESULTCACHE_SEED 0x7a6d7263       // "zmrc"
+
+/* Bytes taken by `e' against the budget */
+static inline size_t
+entry_size( const resultcache_entry_t* e ) {
+    return sizeof( resultcache_entry_t ) + e->keylen + e->len;
+}
+
+static void
+lru_unlink( resultcache_t* c, resultcache_entry_t* e ) {
+    if( e->prev ) e->prev->next =e->next;
+    else c->head =e->next;
+    if( e->next ) e->next->prev =e->prev;
+    else c->tail =e->prev;
+}
+
+static void
+lru_front( resultcache_t* c, resultcache_entry_t* e ) {
+    e->prev =NULL;
+    e->next =c->head;
+    if( c->head ) c->head->prev =e;
+    else c->tail =e;
+    c->head =e;
+}
+
+/* Unlink `e' from the cache and free it */
+static void
+entry_remove( resultcache_t* c, resultcache_entry_t* e ) {
+    resultcache_entry_t **p =&c->bins[e->hash & (RESULTCACHE_BINS-1)];
+    while( *p != e )
+        p =&(*p)->chain;
+    *p =e->chain;
+    lru_unlink( c, e );
+    c->bytes -=entry_size( e );
+    free( e->key );
+    free( e->data );
+    free( e );
+}
+
+static resultcache_entry_t*
+entry_find( resultcache_t* c, uint64_t hash, const char* key, size_t keylen ) {
+    resultcache_entry_t *e =c->bins[hash & (RESULTCACHE_BINS-1)];
+    while( e != NULL && ( e->hash != hash || e->keylen != keylen || memcmp( e->key, key, keylen ) != 0 ) )
+        e =e->chain;
+    return e;
+}
+
+void
+resultcache_create( resultcache_t* c, size_t budget ) {
+    memset( c, 0, sizeof( resultcache_t ) );
+    pthread_mutex_init( &c->lock, NULL );
+    c->budget =budget;
+    c->bins =calloc( RESULTCACHE_BINS, sizeof( resultcache_entry_t* ) );
+    if( c->bins == NULL )
+        c->budget =0;
+}
+
+void
+resultcache_free( resultcache_t* c ) {
+    while( c->head != NULL )
+        entry_remove( c, c->head );
+    free( c->bins );
+    pthread_mutex_destroy( &c->lock );
+}
+
+int
+resultcache_get( resultcache_t* c, const char* key, size_t keylen, uint64_t version, FILE* out ) {
+    if( c->budget == 0 )
+        return -1;
+    uint64_t hash =murmur64A( key, keylen, RESULTCACHE_SEED );
+    int count =-1;
+
+    pthread_mutex_lock( &c->lock );
+    resultcache_entry_t *e =entry_find( c, hash, key, keylen );
+    if( e != NULL && e->version != version ) {
+        entry_remove( c, e );
+        e =NULL;
+    }
+    if( e != NULL ) {
+        lru_unlink( c, e );
+        lru_front( c, e );
+        fwrite( e->data, 1, e->len, out );
+        count =e->count;
+    }
+    pthread_mutex_unlock( &c->lock );
+    return count;
+}
+
+void
+resultcache_put( resultcache_t* c, const char* key, size_t keylen, uint64_t version, char* data, size_t len, int count ) {
+    // A single result that takes a large part of the budget would only push out many others
+    resultcache_entry_t *e =NULL;
+    if( sizeof( resultcache_entry_t ) + keylen + len > c->budget / 8
+            || ( e =malloc( sizeof( resultcache_entry_t ) ) ) == NULL
+            || ( e->key =malloc( keylen ) ) == NULL ) {
+        free( e );
+        free( data );
+        return;
+    }
+    e->hash =murmur64A( key, keylen, RESULTCACHE_SEED );
+    e->version =version;
+    memcpy( e->key, key, keylen );
+    e->keylen =keylen;
+    e->data =data;
+    e->len =len;
+    e->count =count;
+
+    pthread_mutex_lock( &c->lock );
+    // Another thread may have answered the same query in the meantime
+    resultcache_entry_t *old =entry_find( c, e->hash, key, keylen );
+    if( old != NULL )
+        entry_remove( c, old );
+    resultcache_entry_t **bin =&c->bins[e->hash & (RESULTCACHE_BINS-1)];
+    e->chain =*bin;
+    *bin =e;
+    lru_front( c, e );
+    c->bytes +=entry_size( e );
+    while( c->bytes > c->budget )
+        entry_remove( c, c->tail );
+    pthread_mutex_unlock( &c->lock );
+}
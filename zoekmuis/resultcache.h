@@ -0,0 +1,60 @@
+/*
+ * Websearch - resultcache.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Least recently used cache of rendered query results, shared by the threads
+ * of a query process. Every entry carries the version of the index it was made
+ * from; an entry of an older version is stale and is dropped when it is found.
+ * The entries together take at most a fixed number of bytes.
+ */
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define RESULTCACHE_BINS 4096   // Hash chains, a power of two
+
+typedef struct resultcache_entry {
+    uint64_t hash;
+    uint64_t version;           // Of the index the result was made from
+    char *key;
+    size_t keylen;
+    char *data;                 // The rendered result
+    size_t len;
+    int count;                  // Number of results in it
+    struct resultcache_entry *chain;        // Next in the hash chain
+    struct resultcache_entry *prev, *next;  // Most recently used first
+} resultcache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    resultcache_entry_t **bins;
+    resultcache_entry_t *head, *tail;
+    size_t bytes;               // Taken by all entries
+    size_t budget;              // Most bytes to take, 0 disables the cache
+} resultcache_t;
+
+void
+resultcache_create( resultcache_t* c, size_t budget );
+
+void
+resultcache_free( resultcache_t* c );
+
+/* Write the result for `key' of `version' to `out'. Returns the number of
+   results in it, or -1 if it is not in the cache */
+int
+resultcache_get( resultcache_t* c, const char* key, size_t keylen, uint64_t version, FILE* out );
+
+/* Add the `len' bytes of `data' with `count' results as the result for `key'
+   of `version', evicting the least recently used entries to stay within the
+   budget. The cache takes over `data', which was allocated with malloc() */
+void
+resultcache_put( resultcache_t* c, const char* key, size_t keylen, uint64_t version, char* data, size_t len, int count );
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Websearch - ringbuf.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Bounded lock-free multi-producer/multi-consumer queue of pointers
+ */
+
+#define _GNU_SOURCE
+#include "ringbuf.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define RINGBUF_SPIN 64         // Attempts before we start sleeping
+#define RINGBUF_SLEEP_US 500
+
+int
+ringbuf_create( ringbuf_t* r, size_t size ) {
+    size_t n =2;
+    while( n < size )
+        n <<= 1;
+    r->cells =malloc( sizeof( ringbuf_cell_t ) * n );
+    if( r->cells == NULL )
+        return -1;
+    for( size_t i =0; i < n; i++ )
+        r->cells[i].seq =i;
+    r->mask =n-1;
+    r->head =0;
+    r->tail =0;
+    r->closed =0;
+    return 0;
+}
+
+void
+ringbuf_free( ringbuf_t* r ) {
+    free( r->cells );
+    r->cells =NULL;
+}
+
+int
+ringbuf_tryPush( ringbuf_t* r, void* data ) {
+    size_t pos =__atomic_load_n( &r->head, __ATOMIC_RELAXED );
+    while( 1 ) {
+        ringbuf_cell_t *cell =&r->cells[pos & r->mask];
+        size_t seq =__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+        intptr_t diff =(intptr_t)seq - (intptr_t)pos;
+
+        if( diff == 0 ) {
+            // The cell is free, claim it
+            if( __atomic_compare_exchange_n( &r->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+                cell->data =data;
+                __atomic_store_n( &cell->seq, pos+1, __ATOMIC_RELEASE );
+                return 1;
+            }
+        } else if( diff < 0 ) {
+            // The cell still holds an element from the previous lap
+            return 0;
+        } else {
+            pos =__atomic_load_n( &r->head, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+int
+ringbuf_tryPop( ringbuf_t* r, void** data ) {
+    size_t pos =__atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+    while( 1 ) {
+        ringbuf_cell_t *cell =&r->cells[pos & r->mask];
+        size_t seq =__atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+        intptr_t diff =(intptr_t)seq - (intptr_t)(pos+1);
+
+        if( diff == 0 ) {
+            if( __atomic_compare_exchange_n( &r->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+                *data =cell->data;
+                // Hand the cell back to the producers for the next lap
+                __atomic_store_n( &cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE );
+                return 1;
+            }
+        } else if( diff < 0 ) {
+            return 0;
+        } else {
+            pos =__atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static void
+ringbuf_backoff( int attempt ) {
+    if( attempt < RINGBUF_SPIN )
+        sched_yield( );
+    else
+        usleep( RINGBUF_SLEEP_US );
+}
+
+void
+ringbuf_push( ringbuf_t* r, void* data ) {
+    for( int attempt =0; !ringbuf_tryPush( r, data ); attempt++ )
+        ringbuf_backoff( attempt );
+}
+
+int
+ringbuf_pop( ringbuf_t* r, void** data ) {
+    for( int attempt =0; ; attempt++ ) {
+        if( ringbuf_tryPop( r, data ) )
+            return 1;
+        // Elements pushed before closing must still come out
+        if( __atomic_load_n( &r->closed, __ATOMIC_ACQUIRE ) )
+            return ringbuf_tryPop( r, data );
+        ringbuf_backoff( attempt );
+    }
+}
+
+void
+ringbuf_close( ringbuf_t* r ) {
+    __atomic_store_n( &r->closed, 1, __ATOMIC_RELEASE );
+}
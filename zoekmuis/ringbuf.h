@@ -0,0 +1,65 @@
+/*
+ * Websearch - ringbuf.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Bounded lock-free multi-producer/multi-consumer queue of pointers, used to
+ * connect the stages of the webspider. Based on Dmitry Vyukov's bounded MPMC queue:
+ * every cell carries a sequence number that tells producers and consumers
+ * whether it is theirs to fill or to empty.
+ * A full queue makes producers wait, which throttles the faster stages.
+ */
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stddef.h>
+
+#define RINGBUF_CACHELINE 64
+
+typedef struct {
+    size_t seq;
+    void *data;
+} ringbuf_cell_t;
+
+typedef struct {
+    ringbuf_cell_t *cells;
+    size_t mask;                // Number of cells minus one, the size is a power of two
+    char pad0[RINGBUF_CACHELINE];
+    size_t head;                // Next cell to push to
+    char pad1[RINGBUF_CACHELINE];
+    size_t tail;                // Next cell to pop from
+    char pad2[RINGBUF_CACHELINE];
+    int closed;
+} ringbuf_t;
+
+/* Create a queue that holds at least `size' elements. Returns -1 on error */
+int
+ringbuf_create( ringbuf_t* r, size_t size );
+
+void
+ringbuf_free( ringbuf_t* r );
+
+/* Push without waiting. Returns 1 on success and 0 if the queue is full */
+int
+ringbuf_tryPush( ringbuf_t* r, void* data );
+
+/* Pop without waiting. Returns 1 on success and 0 if the queue is empty */
+int
+ringbuf_tryPop( ringbuf_t* r, void** data );
+
+/* Push `data', waiting while the queue is full */
+void
+ringbuf_push( ringbuf_t* r, void* data );
+
+/* Pop into *data, waiting while the queue is empty.
+   Returns 0 once the queue is closed and drained, 1 otherwise */
+int
+ringbuf_pop( ringbuf_t* r, void** data );
+
+/* Mark that no more elements will be pushed */
+void
+ringbuf_close( ringbuf_t* r );
+
+#endif
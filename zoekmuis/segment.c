@@ -0,0 +1,1121 @@
+/*
+ * Websearch - segment.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Immutable index segments, the manifest and merging
+ */
+
+#define _GNU_SOURCE
+#include "segment.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define PATH_SIZE 64
+#define MANIFEST_HEADER "zoekmuis-manifest"
+#define MANIFEST_VERSION 1
+#define SETOPEN_RETRIES 3
+#define BTERM_POST_INCR 4
+#define BUILDER_DOCS_INCR 1024
+#define BUILDER_HASH_SEED 0x7365676d656e7473l
+
+static void
+segment_path( char* buf, const char* name, const char* ext ) {
+    snprintf( buf, PATH_SIZE, "%s%s%s", SEGMENT_PATH, name, ext );
+}
+
+static int
+term_compare( index_t idx_a, const char* a, size_t len_a, index_t idx_b, const char* b, size_t len_b ) {
+    if( idx_a != idx_b )
+        return idx_a < idx_b ? -1 : 1;
+    int c =memcmp( a, b, len_a < len_b ? len_a : len_b );
+    if( c )
+        return c;
+    if( len_a == len_b )
+        return 0;
+    return len_a < len_b ? -1 : 1;
+}
+
+static int
+docid_compare( const void* left, const void* right ) {
+    docid_t l =*(const docid_t*)left, r =*(const docid_t*)right;
+    return l < r ? -1 : (l > r);
+}
+
+static int
+docs_contains( const docid_t* docs, size_t n, docid_t docid ) {
+    size_t lo =0, hi =n;
+    while( lo < hi ) {
+        size_t mid =lo + (hi-lo)/2;
+        if( docs[mid] < docid )
+            lo =mid+1;
+        else
+            hi =mid;
+    }
+    return lo < n && docs[lo] == docid;
+}
+
+/* Sort and remove duplicates, returns the new length */
+static size_t
+docs_unique( docid_t* docs, size_t n ) {
+    if( n == 0 ) return 0;
+    qsort( docs, n, sizeof( docid_t ), docid_compare );
+    size_t j =1;
+    for( size_t i =1; i < n; i++ )
+        if( docs[i] != docs[j-1] )
+            docs[j++] =docs[i];
+    return j;
+}
+
+static int
+file_sync( FILE* file ) {
+    if( fflush( file ) != 0 )
+        return -1;
+    return fsync( fileno( file ) );
+}
+
+/*
+ * Manifest
+ */
+
+int
+segment_manifestRead( segment_manifest_t* m ) {
+    m->generation =0;
+    m->next =0;
+    m->segs =NULL;
+    m->count =0;
+
+    FILE *file =fopen( SEGMENT_MANIFEST, "r" );
+    if( file == NULL )
+        return errno == ENOENT ? 0 : -1;
+
+    int version;
+    unsigned long long generation, next;
+    if( fscanf( file, MANIFEST_HEADER " %d generation %llu next %llu", &version, &generation, &next ) != 3
+            || version != MANIFEST_VERSION ) {
+        fprintf( stderr, "segment_manifestRead(): corrupt manifest\n" );
+        fclose( file );
+        return -1;
+    }
+    m->generation =generation;
+    m->next =next;
+
+    char name[SEGMENT_NAMELEN];
+    unsigned long long ndocs, nbytes;
+    while( fscanf( file, " segment %15s %llu %llu", name, &ndocs, &nbytes ) == 3 ) {
+        m->segs =realloc( m->segs, sizeof( segment_info_t ) * (m->count+1) );
+        segment_info_t *info =&m->segs[m->count++];
+        strcpy( info->name, name );
+        info->ndocs =ndocs;
+        info->nbytes =nbytes;
+    }
+
+    fclose( file );
+    return 0;
+}
+
+static int
+manifest_write( const segment_manifest_t* m ) {
+    const char *tmp_path =SEGMENT_MANIFEST ".tmp";
+    FILE *file =fopen( tmp_path, "w" );
+    if( file == NULL ) goto err;
+
+    fprintf( file, "%s %d\ngeneration %llu\nnext %llu\n", MANIFEST_HEADER, MANIFEST_VERSION,
+            (unsigned long long)m->generation, (unsigned long long)m->next );
+    for( size_t i =0; i < m->count; i++ )
+        fprintf( file, "segment %s %llu %llu\n", m->segs[i].name,
+                (unsigned long long)m->segs[i].ndocs, (unsigned long long)m->segs[i].nbytes );
+
+    if( file_sync( file ) != 0 ) {
+        fclose( file );
+        goto err;
+    }
+    fclose( file );
+
+    // Readers see either the old or the new manifest, never a partial one
+    if( rename( tmp_path, SEGMENT_MANIFEST ) != 0 )
+        goto err;
+    return 0;
+
+err:
+    fprintf( stderr, "manifest_write(): %s\n", strerror( errno ) );
+    return -1;
+}
+
+int
+segment_manifestPublish( segment_manifest_t* m ) {
+    m->generation++;
+    return manifest_write( m );
+}
+
+void
+segment_manifestFree( segment_manifest_t* m ) {
+    free( m->segs );
+    m->segs =NULL;
+    m->count =0;
+}
+
+int
+segment_lock( void ) {
+    int fd =open( SEGMENT_LOCKFILE, O_RDWR | O_CREAT, 0644 );
+    if( fd < 0 || flock( fd, LOCK_EX ) != 0 ) {
+        fprintf( stderr, "segment_lock(): %s\n", strerror( errno ) );
+        if( fd >= 0 ) close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+void
+segment_unlock( int fd ) {
+    flock( fd, LOCK_UN );
+    close( fd );
+}
+
+int
+segment_reserveName( char* name ) {
+    segment_manifest_t m;
+    int lock =segment_lock( );
+    if( lock < 0 )
+        return -1;
+
+    int err =segment_manifestRead( &m );
+    if( !err ) {
+        snprintf( name, SEGMENT_NAMELEN, "seg%08llx", (unsigned long long)m.next++ );
+        // Only the counter changes, so the generation stays the same
+        err =manifest_write( &m );
+    }
+
+    segment_manifestFree( &m );
+    segment_unlock( lock );
+    return err;
+}
+
+/* Append `info' to the manifest and publish it */
+static int
+manifest_add( const segment_info_t* info ) {
+    segment_manifest_t m;
+    int lock =segment_lock( );
+    if( lock < 0 )
+        return -1;
+
+    int err =segment_manifestRead( &m );
+    if( !err ) {
+        m.segs =realloc( m.segs, sizeof( segment_info_t ) * (m.count+1) );
+        m.segs[m.count++] =*info;
+        err =segment_manifestPublish( &m );
+    }
+
+    segment_manifestFree( &m );
+    segment_unlock( lock );
+    return err;
+}
+
+/*
+ * Segments
+ */
+
+int
+segment_open( segment_t* s, const char* name ) {
+    char path[PATH_SIZE];
+    memset( s, 0, sizeof( segment_t ) );
+    strncpy( s->name, name, SEGMENT_NAMELEN-1 );
+
+    segment_path( path, name, ".dict" );
+    if( index_mapOpen( &s->dict, path ) != 0 ) goto err;
+    if( s->dict.len < sizeof( segment_dicthdr_t ) ) {
+        errno =EINVAL;
+        goto err;
+    }
+    memcpy( &s->hdr, s->dict.data, sizeof( segment_dicthdr_t ) );
+    // Segments of version 1 are read as they are, without combined lists
+    if( s->hdr.magic != SEGMENT_MAGIC || s->hdr.version < 1 || s->hdr.version > SEGMENT_VERSION
+            || s->dict.len < sizeof( segment_dicthdr_t ) + sizeof( segment_term_t ) * s->hdr.nterms + s->hdr.heaplen ) {
+        errno =EINVAL;
+        goto err;
+    }
+    s->terms =(const segment_term_t*)((const char*)s->dict.data + sizeof( segment_dicthdr_t ));
+    s->heap =(const char*)(s->terms + s->hdr.nterms);
+
+    segment_path( path, name, ".docs" );
+    if( index_mapOpen( &s->docmap, path ) != 0 ) goto err;
+    s->docs =s->docmap.data;
+    s->ndocs =s->docmap.len / sizeof( docid_t );
+
+    segment_path( path, name, ".post" );
+    if( index_mapOpen( &s->post, path ) != 0 ) goto err;
+    s->postings =s->post.data;
+    segment_path( path, name, ".pos" );
+    if( index_mapOpen( &s->pos, path ) != 0 ) goto err;
+    s->positions =s->pos.data;
+
+    // Every lookup does a binary search on the dictionary and the document list
+    index_mapAdvise( &s->dict, 0, s->dict.len, MADV_WILLNEED );
+    index_mapAdvise( &s->docmap, 0, s->docmap.len, MADV_WILLNEED );
+    index_mapAdvise( &s->post, 0, s->post.len, MADV_RANDOM );
+    index_mapAdvise( &s->pos, 0, s->pos.len, MADV_RANDOM );
+    return 0;
+
+err:
+    // A segment that vanished was merged away, the caller may want to retry silently
+    if( errno != ENOENT )
+        fprintf( stderr, "segment_open(): %s: %s\n", name, strerror( errno ) );
+    segment_close( s );
+    return -1;
+}
+
+void
+segment_close( segment_t* s ) {
+    index_mapClose( &s->dict );
+    index_mapClose( &s->docmap );
+    index_mapClose( &s->post );
+    index_mapClose( &s->pos );
+    s->terms =NULL;
+    s->heap =NULL;
+    s->docs =NULL;
+    s->postings =NULL;
+    s->positions =NULL;
+}
+
+const segment_term_t*
+segment_lookup( const segment_t* s, index_t idx, const char* keyword ) {
+    size_t len =strlen( keyword );
+    size_t lo =0, hi =s->hdr.nterms;
+    while( lo < hi ) {
+        size_t mid =lo + (hi-lo)/2;
+        const segment_term_t *t =&s->terms[mid];
+        int c =term_compare( (index_t)t->idx, s->heap + t->term_off, t->term_len, idx, keyword, len );
+        if( c == 0 )
+            return t;
+        if( c < 0 )
+            lo =mid+1;
+        else
+            hi =mid;
+    }
+    return NULL;
+}
+
+const segment_uposting_t*
+segment_upostings( const segment_t* s, const segment_term_t* t ) {
+    return (const segment_uposting_t*)((const char*)s->postings + t->post_off) + 1;
+}
+
+int
+segment_hasDoc( const segment_t* s, docid_t docid ) {
+    return docs_contains( s->docs, s->ndocs, docid );
+}
+
+void
+segment_unlink( const char* name ) {
+    static const char* exts[] = { ".dict", ".post", ".pos", ".docs" };
+    char path[PATH_SIZE];
+    for( int i =0; i < 4; i++ ) {
+        segment_path( path, name, exts[i] );
+        remove( path );
+    }
+}
+
+/*
+ * Snapshots
+ */
+
+int
+segment_setOpen( segment_set_t* set ) {
+    for( int attempt =0; attempt < SETOPEN_RETRIES; attempt++ ) {
+        if( segment_manifestRead( &set->manifest ) != 0 )
+            return -1;
+
+        set->segs =malloc( sizeof( segment_t ) * set->manifest.count + 1 );
+        set->count =0;
+        while( set->count < set->manifest.count ) {
+            if( segment_open( &set->segs[set->count], set->manifest.segs[set->count].name ) != 0 )
+                break;
+            set->count++;
+        }
+        if( set->count == set->manifest.count )
+            return 0;
+
+        // A merge replaced the manifest while we were opening it, try the new one
+        segment_setClose( set );
+    }
+    fprintf( stderr, "segment_setOpen(): could not open a consistent set of segments\n" );
+    return -1;
+}
+
+int
+segment_setRefresh( segment_set_t* set ) {
+    segment_manifest_t m;
+    if( segment_manifestRead( &m ) != 0 )
+        return -1;
+    uint64_t generation =m.generation;
+    segment_manifestFree( &m );
+    if( generation == set->manifest.generation )
+        return 0;
+
+    segment_set_t fresh;
+    if( segment_setOpen( &fresh ) != 0 )
+        return -1;
+    segment_setClose( set );
+    *set =fresh;
+    return 1;
+}
+
+void
+segment_setClose( segment_set_t* set ) {
+    for( size_t i =0; i < set->count; i++ )
+        segment_close( &set->segs[i] );
+    free( set->segs );
+    set->segs =NULL;
+    set->count =0;
+    segment_manifestFree( &set->manifest );
+}
+
+int
+segment_setSuperseded( const segment_set_t* set, size_t seg, docid_t docid ) {
+    for( size_t i =seg+1; i < set->count; i++ )
+        if( segment_hasDoc( &set->segs[i], docid ) )
+            return 1;
+    return 0;
+}
+
+/*
+ * Postings
+ */
+
+int
+segment_postingsOpen( segment_postings_t* p, segment_set_t* set, index_t idx, const char* keyword ) {
+    p->set =set;
+    p->idx =idx;
+    p->keyword =keyword;
+    p->seg =0;
+    p->next_seg =0;
+    p->cur =p->end =NULL;
+    p->pos =NULL;
+    p->poslen =0;
+
+    for( size_t i =0; i < set->count; i++ )
+        if( segment_lookup( &set->segs[i], idx, keyword ) != NULL )
+            return 0;
+    return -1;
+}
+
+int
+segment_postingsNext( segment_postings_t* p, index_posting_t* post ) {
+    while( 1 ) {
+        while( p->cur == p->end ) {
+            if( p->next_seg >= p->set->count )
+                return 0;
+            p->seg =p->next_seg++;
+            segment_t *s =&p->set->segs[p->seg];
+            const segment_term_t *t =segment_lookup( s, p->idx, p->keyword );
+            if( t == NULL )
+                continue;
+
+            p->cur =s->postings + t->post_off / sizeof( index_posting_t );
+            p->end =p->cur + t->df;
+            p->pos =s->positions + t->pos_off;
+            p->poslen =0;
+            // The list is read front to back, let the kernel read ahead
+            index_mapAdvise( &s->post, t->post_off, t->df * sizeof( index_posting_t ), MADV_SEQUENTIAL );
+            index_mapAdvise( &s->post, t->post_off, t->df * sizeof( index_posting_t ), MADV_WILLNEED );
+        }
+        *post =*p->cur++;
+        p->pos +=p->poslen;
+        p->poslen =post->poslen;
+
+        if( !segment_setSuperseded( p->set, p->seg, post->docid ) )
+            return 1;
+    }
+}
+
+size_t
+segment_postingsPositions( segment_postings_t* p, uint32_t* pos, size_t max ) {
+    if( p->pos == NULL || p->poslen == 0 )
+        return 0;
+    return index_decodePositions( pos, max, p->pos, p->poslen );
+}
+
+/*
+ * Building
+ */
+
+void
+segment_builderCreate( segment_builder_t* b ) {
+    b->bins =calloc( SEGMENT_BUILDER_BINS, sizeof( segment_bterm_t* ) );
+    b->nterms =0;
+    b->docsize =BUILDER_DOCS_INCR;
+    b->docs =malloc( sizeof( docid_t ) * b->docsize );
+    b->ndocs =0;
+    b->bytes =0;
+}
+
+static segment_bterm_t*
+builder_term( segment_builder_t* b, const char* word, size_t len ) {
+    uint64_t h =murmur64A( word, len, BUILDER_HASH_SEED );
+    segment_bterm_t **bin =&b->bins[h % SEGMENT_BUILDER_BINS];
+    segment_bterm_t *t;
+
+    for( t =*bin; t != NULL; t =t->next )
+        if( strcmp( t->word, word ) == 0 )
+            return t;
+
+    t =calloc( 1, sizeof( segment_bterm_t ) );
+    if( t == NULL ) return NULL;
+    t->word =malloc( len+1 );
+    if( t->word == NULL ) {
+        free( t );
+        return NULL;
+    }
+    memcpy( t->word, word, len+1 );
+    t->next =*bin;
+    *bin =t;
+    b->bytes +=sizeof( segment_bterm_t ) + len+1;
+    return t;
+}
+
+static segment_bfield_t*
+builder_field( segment_builder_t* b, segment_bterm_t* t, index_t idx ) {
+    segment_bfield_t *f =t->field[idx];
+    if( f != NULL )
+        return f;
+
+    f =calloc( 1, sizeof( segment_bfield_t ) );
+    if( f == NULL ) return NULL;
+    f->size =BTERM_POST_INCR;
+    f->post =malloc( sizeof( index_posting_t ) * f->size );
+    if( f->post == NULL ) {
+        free( f );
+        return NULL;
+    }
+    t->field[idx] =f;
+    b->nterms++;
+    b->bytes +=sizeof( segment_bfield_t );
+    return f;
+}
+
+int
+segment_builderAddPage( segment_builder_t* b, const index_page_t* page ) {
+    if( b->ndocs == b->docsize )
+        b->docs =realloc( b->docs, sizeof( docid_t ) * (b->docsize += BUILDER_DOCS_INCR) );
+    if( b->docs == NULL )
+        return -1;
+    b->docs[b->ndocs++] =page->docid;
+
+    // One lookup per keyword, then a posting for every index it occurs in
+    for( size_t i =0; i < page->nterms; i++ ) {
+        const index_pageterm_t *pt =&page->terms[i];
+        segment_bterm_t *t =builder_term( b, pt->word, pt->len );
+        if( t == NULL ) return -1;
+
+        for( int idx =0; idx < IDX_FIELDS; idx++ ) {
+            if( !( pt->fields & (1u << idx) ) )
+                continue;
+            segment_bfield_t *f =builder_field( b, t, idx );
+            if( f == NULL ) return -1;
+
+            if( f->count == f->size )
+                f->post =realloc( f->post, sizeof( index_posting_t ) * (f->size *= 2) );
+            size_t need =f->poslen + IDX_POS_MAXBYTES( pt->tf[idx] );
+            if( need > f->possize ) {
+                f->possize =need * 2;
+                f->pos =realloc( f->pos, f->possize );
+            }
+            if( f->post == NULL || f->pos == NULL )
+                return -1;
+
+            index_posting_t *post =&f->post[f->count++];
+            post->docid =page->docid;
+            post->tf =pt->tf[idx];
+            post->poslen =index_encodePositions( f->pos + f->poslen, pt->pos[idx], pt->tf[idx] );
+            f->poslen +=post->poslen;
+            b->bytes +=sizeof( index_posting_t ) + post->poslen;
+        }
+    }
+    return 0;
+}
+
+int
+segment_builderFull( const segment_builder_t* b ) {
+    return b->bytes >= SEGMENT_FLUSH_BYTES;
+}
+
+/* A keyword in one index, as sorted for writing */
+typedef struct {
+    segment_bterm_t *term;
+    index_t idx;
+} builder_entry_t;
+
+static int
+builder_entryCompare( const void* left, const void* right ) {
+    const builder_entry_t *l =left, *r =right;
+    return term_compare( l->idx, l->term->word, strlen( l->term->word ), r->idx, r->term->word, strlen( r->term->word ) );
+}
+
+/* A posting together with the location of its positions, used while sorting */
+typedef struct {
+    index_posting_t post;
+    size_t pos;                 // Offset of the positions in the caller's buffer
+    size_t order;               // Arrival order, the latest copy of a document wins
+} sortpost_t;
+
+static int
+sortpost_compare( const void* left, const void* right ) {
+    const sortpost_t *l =left, *r =right;
+    if( l->post.docid != r->post.docid )
+        return l->post.docid < r->post.docid ? -1 : 1;
+    return l->order < r->order ? -1 : (l->order > r->order);
+}
+
+/* Writes the files of a new segment, one term at a time */
+typedef struct {
+    char name[SEGMENT_NAMELEN];
+    FILE *dict, *post, *pos;
+    segment_term_t *terms;
+    size_t nterms, size;
+    char *heap;
+    size_t heaplen, heapsize;
+    uint64_t post_off, pos_off;
+} segwriter_t;
+
+static int
+segwriter_open( segwriter_t* w ) {
+    char path[PATH_SIZE];
+    memset( w, 0, sizeof( segwriter_t ) );
+    if( segment_reserveName( w->name ) != 0 )
+        return -1;
+    // The postings are read back to combine them, see segwriter_unified()
+    segment_path( path, w->name, ".post" );
+    w->post =fopen( path, "w+b" );
+    segment_path( path, w->name, ".pos" );
+    w->pos =fopen( path, "wb" );
+    if( w->post == NULL || w->pos == NULL ) {
+        fprintf( stderr, "segwriter_open(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the postings of the keyword of `len' bytes at `word', `posts' must be
+   sorted and unique by DOCID */
+static int
+segwriter_term( segwriter_t* w, index_t idx, const char* word, size_t len, const sortpost_t* posts, size_t n,
+        const uint8_t* posbuf ) {
+    if( n == 0 )
+        return 0;
+    if( len > UINT16_MAX ) {
+        // The tokenizer never makes such keywords, see IDX_MAX_KWLEN
+        errno =ENAMETOOLONG;
+        return -1;
+    }
+
+    if( w->nterms == w->size )
+        w->terms =realloc( w->terms, sizeof( segment_term_t ) * (w->size =w->size*2 + 64) );
+    if( w->heaplen + len > w->heapsize )
+        w->heap =realloc( w->heap, w->heapsize =(w->heaplen + len)*2 + 1024 );
+
+    segment_term_t *t =&w->terms[w->nterms++];
+    memset( t, 0, sizeof( segment_term_t ) );
+    t->post_off =w->post_off;
+    t->pos_off =w->pos_off;
+    t->df =n;
+    t->term_off =w->heaplen;
+    t->term_len =len;
+    t->idx =idx;
+    memcpy( w->heap + w->heaplen, word, len );
+    w->heaplen +=len;
+
+    for( size_t i =0; i < n; i++ ) {
+        if( posts[i].post.tf > t->maxtf )
+            t->maxtf =posts[i].post.tf;
+        if( fwrite( &posts[i].post, sizeof( index_posting_t ), 1, w->post ) != 1 )
+            return -1;
+        if( fwrite( posbuf + posts[i].pos, 1, posts[i].post.poslen, w->pos ) != posts[i].post.poslen )
+            return -1;
+        w->post_off +=sizeof( index_posting_t );
+        w->pos_off +=posts[i].post.poslen;
+    }
+    return 0;
+}
+
+/* A keyword in one of the text indices, as sorted for combining */
+typedef struct {
+    const char *word;
+    size_t len;
+    index_t idx;
+    size_t term;                // Entry in the writer
+} ufield_t;
+
+static int
+ufield_compare( const void* left, const void* right ) {
+    const ufield_t *l =left, *r =right;
+    int c =term_compare( IDX_WEBIDX, l->word, l->len, IDX_WEBIDX, r->word, r->len );
+    if( c )
+        return c;
+    return l->idx < r->idx ? -1 : l->idx > r->idx;
+}
+
+/* Combine the postings of every keyword in the text indices, which have all
+   been written, into a list in SEGMENT_UNIFIED. The lists are read back from
+   name.post and appended to it */
+static int
+segwriter_unified( segwriter_t* w ) {
+    static const index_t ufield[SEGMENT_UFIELDS] =SEGMENT_UFIELD_INDICES;
+    ufield_t *f =malloc( sizeof( ufield_t ) * w->nterms + 1 );
+    index_posting_t *in[SEGMENT_UFIELDS] ={ NULL };
+    size_t insize[SEGMENT_UFIELDS] ={ 0 }, inlen[SEGMENT_UFIELDS], at[SEGMENT_UFIELDS];
+    size_t n =0, nterms =w->nterms;
+    int err =0;
+    if( f == NULL || fflush( w->post ) != 0 ) {
+        free( f );
+        return -1;
+    }
+
+    for( size_t i =0; i < nterms; i++ ) {
+        const segment_term_t *t =&w->terms[i];
+        for( int u =0; u < SEGMENT_UFIELDS; u++ ) {
+            if( t->idx != ufield[u] ) continue;
+            f[n].word =w->heap + t->term_off;
+            f[n].len =t->term_len;
+            f[n].idx =u;
+            f[n++].term =i;
+        }
+    }
+    qsort( f, n, sizeof( ufield_t ), ufield_compare );
+
+    for( size_t i =0; i < n && !err; ) {
+        // Read the lists of the keyword in every text index it is in
+        segment_uposting_t max;
+        memset( &max, 0, sizeof( max ) );
+        memset( inlen, 0, sizeof( inlen ) );
+        memset( at, 0, sizeof( at ) );
+        size_t first =i;
+        for( ; i < n && f[i].len == f[first].len && memcmp( f[i].word, f[first].word, f[first].len ) == 0; i++ ) {
+            const segment_term_t *t =&w->terms[f[i].term];
+            size_t u =f[i].idx;
+            if( t->df > insize[u] && ( in[u] =realloc( in[u], sizeof( index_posting_t ) * ( insize[u] =t->df ) ) ) == NULL ) {
+                err =-1;
+                break;
+            }
+            if( pread( fileno( w->post ), in[u], sizeof( index_posting_t ) * t->df, t->post_off )
+                    != (ssize_t)( sizeof( index_posting_t ) * t->df ) ) {
+                err =-1;
+                break;
+            }
+            inlen[u] =t->df;
+            max.tf[u] =t->maxtf < UINT16_MAX ? t->maxtf : UINT16_MAX;
+            max.fields |=1 << u;
+        }
+        if( err ) break;
+
+        if( w->nterms == w->size )
+            w->terms =realloc( w->terms, sizeof( segment_term_t ) * (w->size =w->size*2 + 64) );
+        segment_term_t *t =&w->terms[w->nterms++];
+        memset( t, 0, sizeof( segment_term_t ) );
+        t->post_off =w->post_off;
+        t->term_off =f[first].word - w->heap;
+        t->term_len =f[first].len;
+        t->idx =SEGMENT_UNIFIED;
+        for( int u =0; u < SEGMENT_UFIELDS; u++ )
+            if( max.tf[u] > t->maxtf )
+                t->maxtf =max.tf[u];
+        if( fwrite( &max, sizeof( max ), 1, w->post ) != 1 ) {
+            err =-1;
+            break;
+        }
+        w->post_off +=sizeof( max );
+
+        // Merge the lists by DOCID
+        while( !err ) {
+            docid_t docid =UINT64_MAX;
+            int left =0;
+            for( int u =0; u < SEGMENT_UFIELDS; u++ ) {
+                if( at[u] == inlen[u] ) continue;
+                if( !left || in[u][at[u]].docid < docid )
+                    docid =in[u][at[u]].docid;
+                left =1;
+            }
+            if( !left ) break;
+
+            segment_uposting_t p;
+            memset( &p, 0, sizeof( p ) );
+            p.docid =docid;
+            for( int u =0; u < SEGMENT_UFIELDS; u++ ) {
+                if( at[u] == inlen[u] || in[u][at[u]].docid != docid ) continue;
+                uint32_t tf =in[u][at[u]++].tf;
+                p.tf[u] =tf < UINT16_MAX ? tf : UINT16_MAX;
+                p.fields |=1 << u;
+            }
+            if( fwrite( &p, sizeof( p ), 1, w->post ) != 1 )
+                err =-1;
+            w->post_off +=sizeof( p );
+            t->df++;
+        }
+    }
+
+    for( int u =0; u < SEGMENT_UFIELDS; u++ )
+        free( in[u] );
+    free( f );
+    return err;
+}
+
+/* Write the dictionary and document list and fill in `info'.
+   On failure all files of the segment are removed */
+static int
+segwriter_close( segwriter_t* w, const docid_t* docs, size_t ndocs, segment_info_t* info ) {
+    char path[PATH_SIZE];
+    FILE *file =NULL;
+    int err =0;
+
+    segment_dicthdr_t hdr;
+    if( segwriter_unified( w ) != 0 ) goto err;
+    hdr.magic =SEGMENT_MAGIC;
+    hdr.version =SEGMENT_VERSION;
+    hdr.nterms =w->nterms;
+    hdr.heaplen =w->heaplen;
+
+    segment_path( path, w->name, ".dict" );
+    if( ( w->dict =fopen( path, "wb" ) ) == NULL ) goto err;
+    if( fwrite( &hdr, sizeof( hdr ), 1, w->dict ) != 1
+            || fwrite( w->terms, sizeof( segment_term_t ), w->nterms, w->dict ) != w->nterms
+            || fwrite( w->heap, 1, w->heaplen, w->dict ) != w->heaplen )
+        goto err;
+
+    segment_path( path, w->name, ".docs" );
+    if( ( file =fopen( path, "wb" ) ) == NULL ) goto err;
+    if( fwrite( docs, sizeof( docid_t ), ndocs, file ) != ndocs )
+        goto err;
+
+    // Everything must be on disk before the manifest points at it
+    if( file_sync( w->dict ) || file_sync( w->post ) || file_sync( w->pos ) || file_sync( file ) )
+        goto err;
+
+    memset( info, 0, sizeof( segment_info_t ) );
+    strcpy( info->name, w->name );
+    info->ndocs =ndocs;
+    info->nbytes =ftell( w->dict ) + w->post_off + w->pos_off + ndocs * sizeof( docid_t );
+    goto done;
+
+err:
+    fprintf( stderr, "segwriter_close(): %s\n", strerror( errno ) );
+    err =-1;
+done:
+    if( file ) fclose( file );
+    if( w->dict ) fclose( w->dict );
+    if( w->post ) fclose( w->post );
+    if( w->pos ) fclose( w->pos );
+    free( w->terms );
+    free( w->heap );
+    if( err )
+        segment_unlink( w->name );
+    return err;
+}
+
+static void
+segwriter_abort( segwriter_t* w ) {
+    if( w->post ) fclose( w->post );
+    if( w->pos ) fclose( w->pos );
+    free( w->terms );
+    free( w->heap );
+    segment_unlink( w->name );
+}
+
+int
+segment_builderFlush( segment_builder_t* b ) {
+    if( b->ndocs == 0 )
+        return 0;
+
+    segwriter_t w;
+    sortpost_t *posts =NULL;
+    size_t postsize =0;
+    int err =0;
+
+    builder_entry_t *terms =malloc( sizeof( builder_entry_t ) * b->nterms + 1 );
+    size_t n =0;
+    for( size_t i =0; i < SEGMENT_BUILDER_BINS; i++ )
+        for( segment_bterm_t *t =b->bins[i]; t != NULL; t =t->next )
+            for( int idx =0; idx < IDX_FIELDS; idx++ )
+                if( t->field[idx] != NULL ) {
+                    terms[n].term =t;
+                    terms[n++].idx =idx;
+                }
+    qsort( terms, n, sizeof( builder_entry_t ), builder_entryCompare );
+
+    if( segwriter_open( &w ) != 0 ) {
+        segwriter_abort( &w );
+        free( terms );
+        return -1;
+    }
+
+    for( size_t i =0; i < n && !err; i++ ) {
+        segment_bfield_t *f =terms[i].term->field[terms[i].idx];
+        if( f->count > postsize )
+            posts =realloc( posts, sizeof( sortpost_t ) * (postsize =f->count*2) );
+
+        size_t offs =0;
+        for( size_t k =0; k < f->count; k++ ) {
+            posts[k].post =f->post[k];
+            posts[k].pos =offs;
+            posts[k].order =k;
+            offs +=f->post[k].poslen;
+        }
+        qsort( posts, f->count, sizeof( sortpost_t ), sortpost_compare );
+
+        // A page that was indexed twice keeps only its latest posting
+        size_t m =0;
+        for( size_t k =0; k < f->count; k++ ) {
+            if( m && posts[m-1].post.docid == posts[k].post.docid )
+                m--;
+            posts[m++] =posts[k];
+        }
+        err =segwriter_term( &w, terms[i].idx, terms[i].term->word, strlen( terms[i].term->word ), posts, m, f->pos );
+    }
+    free( posts );
+    free( terms );
+
+    size_t ndocs =docs_unique( b->docs, b->ndocs );
+    if( err ) {
+        fprintf( stderr, "segment_builderFlush(): %s\n", strerror( errno ) );
+        segwriter_abort( &w );
+        return -1;
+    }
+    segment_info_t info;
+    if( segwriter_close( &w, b->docs, ndocs, &info ) != 0 )
+        return -1;
+    if( manifest_add( &info ) != 0 ) {
+        segment_unlink( w.name );
+        return -1;
+    }
+    fprintf( stderr, "Flushed segment %s (%zu documents, %zu terms)\n", w.name, ndocs, n );
+
+    segment_builderFree( b );
+    segment_builderCreate( b );
+    return 0;
+}
+
+void
+segment_builderFree( segment_builder_t* b ) {
+    for( size_t i =0; i < SEGMENT_BUILDER_BINS; i++ ) {
+        segment_bterm_t *t =b->bins[i];
+        while( t != NULL ) {
+            segment_bterm_t *next =t->next;
+            for( int idx =0; idx < IDX_FIELDS; idx++ ) {
+                if( t->field[idx] == NULL ) continue;
+                free( t->field[idx]->post );
+                free( t->field[idx]->pos );
+                free( t->field[idx] );
+            }
+            free( t->word );
+            free( t );
+            t =next;
+        }
+    }
+    free( b->bins );
+    free( b->docs );
+    b->bins =NULL;
+    b->docs =NULL;
+    b->nterms =b->ndocs =b->bytes =0;
+}
+
+/*
+ * Merging
+ */
+
+/* Whether all entries of `s' from `cursor' on have been merged. The combined
+   lists come last and are made again from the merged text indices */
+static inline int
+merge_done( const segment_t* s, size_t cursor ) {
+    return cursor == s->hdr.nterms || s->terms[cursor].idx == SEGMENT_UNIFIED;
+}
+
+int
+segment_merge( segment_set_t* set, size_t first, size_t count ) {
+    segwriter_t w;
+    size_t *cursor =calloc( count, sizeof( size_t ) );
+    sortpost_t *posts =NULL;
+    size_t postsize =0;
+    uint8_t *posbuf =NULL;
+    size_t posbufsize =0;
+    docid_t *docs =NULL;
+    size_t ndocs =0;
+    int err =0;
+
+    if( segwriter_open( &w ) != 0 ) {
+        segwriter_abort( &w );
+        free( cursor );
+        return -1;
+    }
+
+    // Merging reads every input once, front to back
+    for( size_t i =0; i < count; i++ ) {
+        const segment_t *s =&set->segs[first+i];
+        index_mapAdvise( &s->post, 0, s->post.len, MADV_SEQUENTIAL );
+        index_mapAdvise( &s->pos, 0, s->pos.len, MADV_SEQUENTIAL );
+    }
+
+    // Walk all dictionaries in order, like the merge step of merge sort
+    while( !err ) {
+        const segment_term_t *min =NULL;
+        const segment_t *min_seg =NULL;
+        for( size_t i =0; i < count; i++ ) {
+            const segment_t *s =&set->segs[first+i];
+            if( merge_done( s, cursor[i] ) )
+                continue;
+            const segment_term_t *t =&s->terms[cursor[i]];
+            if( min == NULL || term_compare( (index_t)t->idx, s->heap + t->term_off, t->term_len,
+                        (index_t)min->idx, min_seg->heap + min->term_off, min->term_len ) < 0 ) {
+                min =t;
+                min_seg =s;
+            }
+        }
+        if( min == NULL )
+            break;
+
+        // The inputs stay mapped, so the keyword is compared where it is
+        const char *word =min_seg->heap + min->term_off;
+        size_t len =min->term_len;
+        index_t idx =(index_t)min->idx;
+
+        // Collect the live postings of this term from every segment that has it
+        size_t n =0, poslen =0;
+        for( size_t i =0; i < count && !err; i++ ) {
+            segment_t *s =&set->segs[first+i];
+            if( merge_done( s, cursor[i] ) )
+                continue;
+            const segment_term_t *t =&s->terms[cursor[i]];
+            if( term_compare( (index_t)t->idx, s->heap + t->term_off, t->term_len, idx, word, len ) != 0 )
+                continue;
+            cursor[i]++;
+
+            const index_posting_t *in =s->postings + t->post_off / sizeof( index_posting_t );
+            size_t inlen =0;
+            for( size_t k =0; k < t->df; k++ )
+                inlen +=in[k].poslen;
+            if( poslen + inlen > posbufsize )
+                posbuf =realloc( posbuf, posbufsize =(poslen + inlen)*2 + 1024 );
+            memcpy( posbuf + poslen, s->positions + t->pos_off, inlen );
+
+            size_t offs =poslen;
+            for( size_t k =0; k < t->df && !err; k++ ) {
+                if( !segment_setSuperseded( set, first+i, in[k].docid ) ) {
+                    if( n == postsize )
+                        posts =realloc( posts, sizeof( sortpost_t ) * (postsize =postsize*2 + 64) );
+                    posts[n].post =in[k];
+                    posts[n].pos =offs;
+                    posts[n].order =n;
+                    n++;
+                }
+                offs +=in[k].poslen;
+            }
+            poslen +=inlen;
+        }
+        qsort( posts, n, sizeof( sortpost_t ), sortpost_compare );
+        if( !err )
+            err =segwriter_term( &w, idx, word, len, posts, n, posbuf );
+    }
+
+    // The merged segment contains every live document of its inputs
+    for( size_t i =0; i < count; i++ ) {
+        const segment_t *s =&set->segs[first+i];
+        docs =realloc( docs, sizeof( docid_t ) * (ndocs + s->ndocs) + 1 );
+        for( size_t k =0; k < s->ndocs; k++ )
+            if( !segment_setSuperseded( set, first+i, s->docs[k] ) )
+                docs[ndocs++] =s->docs[k];
+    }
+    ndocs =docs_unique( docs, ndocs );
+
+    free( cursor );
+    free( posts );
+    free( posbuf );
+
+    if( err ) {
+        fprintf( stderr, "segment_merge(): %s\n", strerror( errno ) );
+        segwriter_abort( &w );
+        free( docs );
+        return -1;
+    }
+    segment_info_t info;
+    err =segwriter_close( &w, docs, ndocs, &info );
+    free( docs );
+    if( err )
+        return -1;
+
+    // Swap the inputs for the merged segment, provided nobody else touched them
+    segment_manifest_t m;
+    int lock =segment_lock( );
+    if( lock < 0 || segment_manifestRead( &m ) != 0 ) {
+        if( lock >= 0 ) segment_unlock( lock );
+        segment_unlink( w.name );
+        return -1;
+    }
+
+    size_t at =0;
+    while( at < m.count && strcmp( m.segs[at].name, set->segs[first].name ) != 0 )
+        at++;
+    for( size_t i =0; i < count && !err; i++ )
+        if( at+i >= m.count || strcmp( m.segs[at+i].name, set->segs[first+i].name ) != 0 )
+            err =-1;
+
+    if( !err ) {
+        // A merge of only superseded documents simply removes its inputs
+        size_t keep =ndocs ? 1 : 0;
+        if( keep )
+            m.segs[at] =info;
+        memmove( &m.segs[at+keep], &m.segs[at+count], sizeof( segment_info_t ) * (m.count - at - count) );
+        m.count -=count-keep;
+        err =segment_manifestPublish( &m );
+    } else {
+        fprintf( stderr, "segment_merge(): manifest changed during merge, discarding %s\n", w.name );
+    }
+    segment_manifestFree( &m );
+    segment_unlock( lock );
+
+    if( err || !ndocs )
+        segment_unlink( w.name );
+    if( err )
+        return -1;
+
+    // Open readers keep their handles, only new snapshots see the merged segment
+    for( size_t i =0; i < count; i++ )
+        segment_unlink( set->segs[first+i].name );
+
+    fprintf( stderr, "Merged %zu segments into %s (%zu documents)\n", count, w.name, ndocs );
+    return 0;
+}
+
+static int
+merge_tier( uint64_t nbytes ) {
+    int tier =0;
+    uint64_t size =SEGMENT_TIER_BASE;
+    while( nbytes > size ) {
+        size *=SEGMENT_MERGE_FACTOR;
+        tier++;
+    }
+    return tier;
+}
+
+size_t
+segment_mergePolicy( const segment_manifest_t* m, size_t* first ) {
+    int best_tier =-1;
+
+    // Merge the lowest tier that has enough adjacent segments
+    for( size_t i =0; i < m->count; ) {
+        int tier =merge_tier( m->segs[i].nbytes );
+        size_t j =i+1;
+        while( j < m->count && merge_tier( m->segs[j].nbytes ) == tier )
+            j++;
+        if( j-i >= SEGMENT_MERGE_FACTOR && (best_tier < 0 || tier < best_tier) ) {
+            best_tier =tier;
+            *first =i;
+        }
+        i =j;
+    }
+    return best_tier < 0 ? 0 : SEGMENT_MERGE_FACTOR;
+}
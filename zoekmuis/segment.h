@@ -0,0 +1,267 @@
+/*
+ * Websearch - segment.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Immutable index segments. The webspider collects postings in memory and flushes
+ * them as a new segment every now and then; indexmerge combines small segments
+ * into larger ones. The list of live segments is kept in the manifest, which is
+ * only ever replaced atomically, so queries can keep using an older snapshot.
+ *
+ * A segment `name' consists of four files:
+ *  name.dict  header, term entries sorted by (index, keyword), keyword heap
+ *  name.post  index_posting_t records, per term sorted by DOCID
+ *  name.pos   position streams of the postings, in the same order
+ *  name.docs  sorted DOCIDs of all documents in the segment
+ * Since version 2 the dictionary ends with an entry per keyword in the
+ * pseudo-index SEGMENT_UNIFIED, whose postings in name.post are
+ * segment_uposting_t records that combine the web, page and title indices:
+ * one list tells in which of them a document has the keyword and how often.
+ * The list starts with a record that holds the highest tf of every index.
+ * A document in a segment is superseded (tombstoned) when a newer segment
+ * contains the same DOCID.
+ */
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "docid.h"
+#include "index.h"
+
+#define SEGMENT_PATH "segments/"
+#define SEGMENT_MANIFEST SEGMENT_PATH "MANIFEST"
+#define SEGMENT_LOCKFILE SEGMENT_PATH "LOCK"
+#define SEGMENT_WAL SEGMENT_PATH "WAL"        // Write-ahead log of the webspider
+#define SEGMENT_NAMELEN 16
+
+#define SEGMENT_MAGIC 0x44534d5a   // "ZMSD"
+#define SEGMENT_VERSION 2
+#define SEGMENT_UNIFIED ((index_t)0xff)         // Index of the combined lists
+#define SEGMENT_UFIELDS 3                       // Indices in a combined list
+#define SEGMENT_UFIELD_INDICES { IDX_WEBIDX, IDX_PAGEIDX, IDX_TITLEIDX }
+
+#define SEGMENT_FLUSH_BYTES (32 << 20)  // Flush the builder at roughly this much data
+#define SEGMENT_MERGE_FACTOR 4          // Number of segments per tier before merging
+#define SEGMENT_TIER_BASE (1 << 20)     // Segments up to this size are in tier 0
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nterms;
+    uint32_t heaplen;           // Size of the keyword heap following the entries
+} segment_dicthdr_t;
+
+typedef struct {
+    uint64_t post_off;          // Byte offset of the first posting in name.post
+    uint64_t pos_off;           // Byte offset of the first position in name.pos
+    uint32_t df;                // Number of postings
+    uint32_t term_off;          // Offset of the keyword in the heap
+    uint16_t term_len;
+    uint8_t idx;                // index_t
+    uint8_t pad;
+    uint32_t maxtf;             // Highest tf of the postings, 0 in segments written before it was kept
+} segment_term_t;
+
+/* Posting of a keyword in all text indices at once */
+typedef struct {
+    docid_t docid;
+    uint16_t tf[SEGMENT_UFIELDS];   // Per index in SEGMENT_UFIELD_INDICES order, at most 65535
+    uint8_t fields;                 // Bit i is set if tf[i] is not 0
+    uint8_t pad;
+} segment_uposting_t;
+
+/* Entry of the manifest */
+typedef struct {
+    char name[SEGMENT_NAMELEN];
+    uint64_t ndocs;
+    uint64_t nbytes;
+} segment_info_t;
+
+typedef struct {
+    uint64_t generation;        // Bumped every time the set of segments changes
+    uint64_t next;              // Sequence number of the next segment name
+    segment_info_t *segs;       // Oldest first
+    size_t count;
+} segment_manifest_t;
+
+/* An open segment, all files are memory mapped */
+typedef struct {
+    char name[SEGMENT_NAMELEN];
+    index_map_t dict, post, pos, docmap;
+    segment_dicthdr_t hdr;
+    const segment_term_t *terms;
+    const char *heap;
+    const docid_t *docs;
+    size_t ndocs;
+    const index_posting_t *postings;
+    const uint8_t *positions;
+} segment_t;
+
+/* A consistent snapshot of all live segments */
+typedef struct {
+    segment_manifest_t manifest;
+    segment_t *segs;
+    size_t count;
+} segment_set_t;
+
+/* Iterates the live postings of one keyword over all segments of a set,
+   decoding them directly from the mapped files */
+typedef struct {
+    segment_set_t *set;
+    index_t idx;
+    const char *keyword;
+    size_t seg;                 // Current segment
+    size_t next_seg;            // Next segment to look the keyword up in
+    const index_posting_t *cur; // Next posting in the current segment
+    const index_posting_t *end;
+    const uint8_t *pos;         // Positions of the last posting
+    uint32_t poslen;
+} segment_postings_t;
+
+/* Postings of a keyword in one index of the builder */
+typedef struct {
+    index_posting_t *post;
+    size_t count, size;
+    uint8_t *pos;               // Positions of all postings, in arrival order
+    size_t poslen, possize;
+} segment_bfield_t;
+
+/* Builder for a new segment, kept in memory until flushed.
+   Keywords are shared by all indices */
+typedef struct segment_bterm {
+    char *word;
+    segment_bfield_t *field[IDX_FIELDS];
+    struct segment_bterm *next;
+} segment_bterm_t;
+
+#define SEGMENT_BUILDER_BINS 65536
+
+typedef struct {
+    segment_bterm_t **bins;
+    size_t nterms;              // Number of (index, keyword) pairs
+    docid_t *docs;
+    size_t ndocs, docsize;
+    size_t bytes;               // Approximate memory in use
+} segment_builder_t;
+
+/* Manifest */
+
+/* Read the manifest, an absent manifest is an empty index. Returns -1 on error */
+int
+segment_manifestRead( segment_manifest_t* m );
+
+/* Atomically replace the manifest with `m' and bump its generation.
+   The caller must hold the lock */
+int
+segment_manifestPublish( segment_manifest_t* m );
+
+void
+segment_manifestFree( segment_manifest_t* m );
+
+/* Exclusive lock for read-modify-write cycles on the manifest.
+   Returns a descriptor to pass to segment_unlock() or -1 on error */
+int
+segment_lock( void );
+
+void
+segment_unlock( int fd );
+
+/* Reserve a new unique segment name in `name' */
+int
+segment_reserveName( char* name );
+
+/* Segments */
+
+int
+segment_open( segment_t* s, const char* name );
+
+void
+segment_close( segment_t* s );
+
+/* Return the term entry for `keyword' in `idx' or NULL if the segment does not
+   contain it. `idx' may be SEGMENT_UNIFIED if the segment has combined lists */
+const segment_term_t*
+segment_lookup( const segment_t* s, index_t idx, const char* keyword );
+
+/* Return the combined postings of entry `t' in SEGMENT_UNIFIED, which follow
+   the record with the highest tf of every index */
+const segment_uposting_t*
+segment_upostings( const segment_t* s, const segment_term_t* t );
+
+/* Return 1 if the segment contains `docid' */
+int
+segment_hasDoc( const segment_t* s, docid_t docid );
+
+/* Remove all files of segment `name' */
+void
+segment_unlink( const char* name );
+
+/* Snapshots */
+
+/* Open all segments in the current manifest */
+int
+segment_setOpen( segment_set_t* set );
+
+/* Reopen `set' if the manifest has been published since it was opened, so a
+   long-running reader can keep using the same handle.
+   Returns 1 if the set changed, 0 if not and -1 on error (the old set stays open) */
+int
+segment_setRefresh( segment_set_t* set );
+
+void
+segment_setClose( segment_set_t* set );
+
+/* Return 1 if `docid' in segment `seg' is superseded by a newer segment of the set */
+int
+segment_setSuperseded( const segment_set_t* set, size_t seg, docid_t docid );
+
+/* Postings */
+
+/* Start iterating `keyword' in `idx'. Returns -1 if no segment contains it */
+int
+segment_postingsOpen( segment_postings_t* p, segment_set_t* set, index_t idx, const char* keyword );
+
+/* Read the next live posting into `post'. Returns 1 on success and 0 at the end */
+int
+segment_postingsNext( segment_postings_t* p, index_posting_t* post );
+
+/* Decode the positions of the last posting into `pos', at most `max' */
+size_t
+segment_postingsPositions( segment_postings_t* p, uint32_t* pos, size_t max );
+
+/* Building */
+
+void
+segment_builderCreate( segment_builder_t* b );
+
+/* Add all keywords of `page', which must be finished by index_pageFinish() */
+int
+segment_builderAddPage( segment_builder_t* b, const index_page_t* page );
+
+/* Return 1 if the builder should be flushed */
+int
+segment_builderFull( const segment_builder_t* b );
+
+/* Write the builder as a new segment and publish it, then empty the builder */
+int
+segment_builderFlush( segment_builder_t* b );
+
+void
+segment_builderFree( segment_builder_t* b );
+
+/* Merging */
+
+/* Merge `count' adjacent segments of `set' starting at `first' into one,
+   dropping superseded documents, and publish the result */
+int
+segment_merge( segment_set_t* set, size_t first, size_t count );
+
+/* Find the next run of segments to merge according to the tiered policy.
+   Returns the number of segments in the run (0 if none) and sets *first */
+size_t
+segment_mergePolicy( const segment_manifest_t* m, size_t* first );
+
+#endif
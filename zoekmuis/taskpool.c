@@ -0,0 +1,111 @@
+/*
+ * Websearch - taskpool.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Pool of threads that help with the tasks of a job
+ */
+
+#include "taskpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Take the next task of `job', the pool must be locked. The job leaves the list
+   of jobs with its last task, so it is not touched after it has finished */
+static size_t
+job_take( taskpool_t* p, taskpool_job_t* job ) {
+    size_t task =job->next++;
+    if( job->next == job->count ) {
+        taskpool_job_t **j =&p->jobs;
+        while( *j != job )
+            j =&(*j)->link;
+        *j =job->link;
+    }
+    return task;
+}
+
+/* Run `task' of `job' with the pool unlocked and count it as done */
+static void
+job_do( taskpool_t* p, taskpool_job_t* job, size_t task ) {
+    pthread_mutex_unlock( &p->lock );
+    job->fn( job->arg, task );
+    pthread_mutex_lock( &p->lock );
+    if( ++job->done == job->count )
+        pthread_cond_broadcast( &p->finished );
+}
+
+static void*
+pool_thread( void* arg ) {
+    taskpool_t *p =arg;
+    pthread_mutex_lock( &p->lock );
+    while( !p->stop ) {
+        if( p->jobs == NULL ) {
+            pthread_cond_wait( &p->work, &p->lock );
+            continue;
+        }
+        taskpool_job_t *job =p->jobs;
+        job_do( p, job, job_take( p, job ) );
+    }
+    pthread_mutex_unlock( &p->lock );
+    return NULL;
+}
+
+int
+taskpool_create( taskpool_t* p, size_t nthreads ) {
+    memset( p, 0, sizeof( taskpool_t ) );
+    pthread_mutex_init( &p->lock, NULL );
+    pthread_cond_init( &p->work, NULL );
+    pthread_cond_init( &p->finished, NULL );
+    if( nthreads == 0 )
+        return 0;
+    if( ( p->threads =malloc( sizeof( pthread_t ) * nthreads ) ) == NULL )
+        return -1;
+    for( ; p->nthreads < nthreads; p->nthreads++ ) {
+        int err =pthread_create( &p->threads[p->nthreads], NULL, pool_thread, p );
+        if( err != 0 ) {
+            fprintf( stderr, "taskpool_create(): %s\n", strerror( err ) );
+            taskpool_free( p );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+taskpool_free( taskpool_t* p ) {
+    pthread_mutex_lock( &p->lock );
+    p->stop =1;
+    pthread_cond_broadcast( &p->work );
+    pthread_mutex_unlock( &p->lock );
+    for( size_t i =0; i < p->nthreads; i++ )
+        pthread_join( p->threads[i], NULL );
+    free( p->threads );
+    p->threads =NULL;
+    p->nthreads =0;
+    pthread_cond_destroy( &p->finished );
+    pthread_cond_destroy( &p->work );
+    pthread_mutex_destroy( &p->lock );
+}
+
+void
+taskpool_run( taskpool_t* p, taskpool_fn_t fn, void* arg, size_t count ) {
+    if( p->nthreads == 0 || count < 2 ) {
+        for( size_t i =0; i < count; i++ )
+            fn( arg, i );
+        return;
+    }
+
+    taskpool_job_t job ={ fn, arg, count, 0, 0, NULL };
+    pthread_mutex_lock( &p->lock );
+    job.link =p->jobs;
+    p->jobs =&job;
+    pthread_cond_broadcast( &p->work );
+    while( job.next < job.count )
+        job_do( p, &job, job_take( p, &job ) );
+    while( job.done < job.count )
+        pthread_cond_wait( &p->finished, &p->lock );
+    pthread_mutex_unlock( &p->lock );
+}
@@ -0,0 +1,55 @@
+/*
+ * Websearch - taskpool.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Pool of threads that help with the tasks of a job. A job is a number of
+ * independent tasks; the thread that runs it works on its tasks itself and any
+ * thread of the pool that is idle takes tasks from it too, so a job never waits
+ * for the pool and several jobs share it. Tasks are taken one at a time, so the
+ * threads that finish early pick up what is left of the slow ones.
+ */
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Run task `task' of the job with `arg' */
+typedef void (*taskpool_fn_t)( void* arg, size_t task );
+
+typedef struct taskpool_job {
+    taskpool_fn_t fn;
+    void *arg;
+    size_t count;               // Number of tasks
+    size_t next;                // Next task to take
+    size_t done;                // Number of tasks that have finished
+    struct taskpool_job *link;  // Next job with tasks left
+} taskpool_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // Signalled when a job is added
+    pthread_cond_t finished;    // Broadcast when a job has finished
+    taskpool_job_t *jobs;       // Jobs with tasks that nobody took yet
+    pthread_t *threads;
+    size_t nthreads;
+    int stop;
+} taskpool_t;
+
+/* Start a pool of `nthreads' threads. Without threads, every job runs on the
+   thread that runs it. Returns -1 on error */
+int
+taskpool_create( taskpool_t* p, size_t nthreads );
+
+/* Stop the threads of the pool, there must be no jobs left */
+void
+taskpool_free( taskpool_t* p );
+
+/* Run `fn' for tasks 0 to `count' - 1 and return when all of them have finished */
+void
+taskpool_run( taskpool_t* p, taskpool_fn_t fn, void* arg, size_t count );
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Websearch - termcache.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Cache of dictionary lookups with lock-free readers and CLOCK eviction
+ */
+
+#include "termcache.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TERMCACHE_SEED 0x7a6d7463       // "zmtc"
+
+/* Fill `key' with segment `seg', `idx' and `keyword'. Returns 0 if the keyword is too long */
+static int
+make_key( uint64_t* key, const char* seg, index_t idx, const char* keyword ) {
+    size_t len =strlen( keyword );
+    if( len > TERMCACHE_MAXLEN )
+        return 0;
+    char *k =(char*)key;
+    memset( key, 0, sizeof( uint64_t ) * TERMCACHE_KEYLEN );
+    strncpy( k, seg, SEGMENT_NAMELEN );
+    k[SEGMENT_NAMELEN] =(char)idx;
+    memcpy( k + SEGMENT_NAMELEN + 1, keyword, len );
+    return 1;
+}
+
+static inline termcache_slot_t*
+bucket( const termcache_t* c, const uint64_t* key, size_t* b ) {
+    *b =murmur64A( key, sizeof( uint64_t ) * TERMCACHE_KEYLEN, TERMCACHE_SEED ) & (c->nbuckets-1);
+    return c->slots + *b * TERMCACHE_WAYS;
+}
+
+void
+termcache_create( termcache_t* c, size_t budget ) {
+    memset( c, 0, sizeof( termcache_t ) );
+    pthread_mutex_init( &c->lock, NULL );
+    size_t n =budget / ( sizeof( termcache_slot_t ) * TERMCACHE_WAYS );
+    if( n == 0 )
+        return;
+    c->nbuckets =1;
+    while( c->nbuckets * 2 <= n )
+        c->nbuckets *=2;
+    c->slots =calloc( c->nbuckets * TERMCACHE_WAYS, sizeof( termcache_slot_t ) );
+    c->hand =calloc( c->nbuckets, 1 );
+    if( c->slots == NULL || c->hand == NULL ) {
+        free( c->slots );
+        free( c->hand );
+        c->nbuckets =0;
+    }
+}
+
+void
+termcache_free( termcache_t* c ) {
+    free( c->slots );
+    free( c->hand );
+    c->nbuckets =0;
+    pthread_mutex_destroy( &c->lock );
+}
+
+int
+termcache_get( termcache_t* c, const char* seg, index_t idx, const char* keyword, uint32_t* term ) {
+    uint64_t key[TERMCACHE_KEYLEN];
+    size_t b;
+    if( c->nbuckets == 0 || !make_key( key, seg, idx, keyword ) )
+        return 0;
+    termcache_slot_t *slot =bucket( c, key, &b );
+
+    for( int i =0; i < TERMCACHE_WAYS; i++ ) {
+        termcache_slot_t *s =&slot[i];
+        uint32_t seq =__atomic_load_n( &s->seq, __ATOMIC_ACQUIRE );
+        if( seq & 1 ) continue;
+        int k;
+        for( k =0; k < TERMCACHE_KEYLEN && __atomic_load_n( &s->key[k], __ATOMIC_RELAXED ) == key[k]; k++ );
+        if( k < TERMCACHE_KEYLEN ) continue;
+        *term =__atomic_load_n( &s->term, __ATOMIC_RELAXED );
+        // A writer that got in between may have mixed the old and the new entry
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &s->seq, __ATOMIC_RELAXED ) != seq ) continue;
+        if( !__atomic_load_n( &s->ref, __ATOMIC_RELAXED ) )
+            __atomic_store_n( &s->ref, 1, __ATOMIC_RELAXED );
+        return 1;
+    }
+    return 0;
+}
+
+void
+termcache_put( termcache_t* c, const char* seg, index_t idx, const char* keyword, uint32_t term ) {
+    uint64_t key[TERMCACHE_KEYLEN];
+    size_t b;
+    if( c->nbuckets == 0 || !make_key( key, seg, idx, keyword ) )
+        return;
+    termcache_slot_t *slot =bucket( c, key, &b );
+
+    pthread_mutex_lock( &c->lock );
+    // Another thread may have looked up the same keyword in the meantime
+    for( int i =0; i < TERMCACHE_WAYS; i++ ) {
+        if( memcmp( slot[i].key, key, sizeof( key ) ) == 0 ) {
+            pthread_mutex_unlock( &c->lock );
+            return;
+        }
+    }
+    termcache_slot_t *s;
+    while( 1 ) {
+        s =&slot[c->hand[b]];
+        c->hand[b] =( c->hand[b] + 1 ) % TERMCACHE_WAYS;
+        if( !__atomic_load_n( &s->ref, __ATOMIC_RELAXED ) )
+            break;
+        __atomic_store_n( &s->ref, 0, __ATOMIC_RELAXED );
+    }
+
+    uint32_t seq =s->seq;
+    __atomic_store_n( &s->seq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    for( int k =0; k < TERMCACHE_KEYLEN; k++ )
+        __atomic_store_n( &s->key[k], key[k], __ATOMIC_RELAXED );
+    __atomic_store_n( &s->term, term, __ATOMIC_RELAXED );
+    __atomic_store_n( &s->ref, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &s->seq, seq + 2, __ATOMIC_RELEASE );
+    pthread_mutex_unlock( &c->lock );
+}
@@ -0,0 +1,63 @@
+/*
+ * Websearch - termcache.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Cache of dictionary lookups, shared by the threads of a query process. For a
+ * keyword in an index of a segment it keeps where the keyword is in the
+ * dictionary, so the words that many queries have in common are only looked
+ * up once.
+ * Segments never change, so an entry stays valid for as long as its segment is
+ * in use and simply ages out afterwards.
+ *
+ * The cache is a fixed number of buckets of TERMCACHE_WAYS slots. Readers do not
+ * lock: every slot has a sequence number that is odd while it is written, and a
+ * reader that sees it change tries the next slot. Writers take a lock and
+ * evict by CLOCK within the bucket, passing over slots that were used since the
+ * hand last came by.
+ */
+
+#ifndef TERMCACHE_H
+#define TERMCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "index.h"
+#include "segment.h"
+
+#define TERMCACHE_MAXLEN 31     // Longer keywords are not cached
+#define TERMCACHE_WAYS 8        // Slots per bucket
+#define TERMCACHE_KEYLEN ((SEGMENT_NAMELEN + 1 + TERMCACHE_MAXLEN) / 8)
+
+typedef struct {
+    uint32_t seq;               // Odd while the slot is written
+    uint32_t ref;               // Used since the clock hand passed
+    uint64_t key[TERMCACHE_KEYLEN];     // Segment name, index and keyword, padded with zeroes
+    uint32_t term;              // Entry + 1 in the dictionary, 0 if not in the index
+} termcache_slot_t;
+
+typedef struct {
+    termcache_slot_t *slots;
+    uint8_t *hand;              // Clock hand of every bucket
+    size_t nbuckets;            // A power of two, 0 if the cache is off
+    pthread_mutex_t lock;       // Taken by writers
+} termcache_t;
+
+/* Create a cache of at most `budget' bytes, 0 turns it off */
+void
+termcache_create( termcache_t* c, size_t budget );
+
+void
+termcache_free( termcache_t* c );
+
+/* Copy the entry of `keyword' in index `idx' of segment `seg' to `term'.
+   Returns 1 if it was in the cache */
+int
+termcache_get( termcache_t* c, const char* seg, index_t idx, const char* keyword, uint32_t* term );
+
+void
+termcache_put( termcache_t* c, const char* seg, index_t idx, const char* keyword, uint32_t term );
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * Websearch - wal.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Write-ahead log with group commit
+ */
+
+#define _GNU_SOURCE
+#include "wal.h"
+#include "index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define WAL_BUF_INCR 65536
+#define WAL_NULLSTR UINT32_MAX
+
+static uint32_t crc_table[256];
+
+static void
+crc_init( void ) {
+    for( uint32_t i =0; i < 256; i++ ) {
+        uint32_t c =i;
+        for( int k =0; k < 8; k++ )
+            c =( c & 1 ) ? 0xedb88320 ^ ( c >> 1 ) : c >> 1;
+        crc_table[i] =c;
+    }
+}
+
+static uint32_t
+crc32( const void* data, size_t len ) {
+    const uint8_t *p =data;
+    uint32_t c =0xffffffff;
+    while( len-- )
+        c =crc_table[( c ^ *p++ ) & 0xff] ^ ( c >> 8 );
+    return c ^ 0xffffffff;
+}
+
+int
+wal_open( wal_t* w, const char* path ) {
+    memset( w, 0, sizeof( wal_t ) );
+    if( crc_table[1] == 0 )
+        crc_init( );
+
+    w->fd =open( path, O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( w->fd < 0 ) goto err;
+    if( flock( w->fd, LOCK_EX | LOCK_NB ) != 0 ) goto err;
+    if( ( w->end =lseek( w->fd, 0, SEEK_END ) ) < 0 ) goto err;
+    return 0;
+
+err:
+    fprintf( stderr, "wal_open(): %s: %s\n", path, strerror( errno ) );
+    if( w->fd >= 0 ) close( w->fd );
+    w->fd =-1;
+    return -1;
+}
+
+/* Cut the log at `offs', dropping a torn or corrupt tail */
+static int
+wal_truncate( wal_t* w, off_t offs ) {
+    if( ftruncate( w->fd, offs ) != 0 || fdatasync( w->fd ) != 0 ) {
+        fprintf( stderr, "wal_truncate(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    w->end =offs;
+    return 0;
+}
+
+long
+wal_replay( wal_t* w, int (*apply)( const char* data, size_t len, void* arg ), void* arg ) {
+    index_map_t map ={ NULL, 0 };
+    long count =0;
+    size_t offs =0;
+
+    // Map the log through the descriptor we hold the lock on
+    if( w->end > 0 ) {
+        map.data =mmap( NULL, w->end, PROT_READ, MAP_PRIVATE, w->fd, 0 );
+        if( map.data == MAP_FAILED ) {
+            fprintf( stderr, "wal_replay(): %s\n", strerror( errno ) );
+            return -1;
+        }
+        map.len =w->end;
+    }
+
+    while( offs + sizeof( wal_rechdr_t ) <= map.len ) {
+        wal_rechdr_t hdr;
+        memcpy( &hdr, (char*)map.data + offs, sizeof( wal_rechdr_t ) );
+        const char *data =(char*)map.data + offs + sizeof( wal_rechdr_t );
+
+        if( hdr.magic != WAL_MAGIC || hdr.len > map.len - offs - sizeof( wal_rechdr_t )
+                || crc32( data, hdr.len ) != hdr.crc )
+            break;
+        int err =apply( data, hdr.len, arg );
+        if( err < 0 ) {
+            index_mapClose( &map );
+            return -1;
+        }
+        if( err > 0 )
+            break;
+        offs +=sizeof( wal_rechdr_t ) + hdr.len;
+        count++;
+    }
+
+    if( offs < map.len ) {
+        fprintf( stderr, "wal_replay(): dropping %zu bytes after record %ld\n", map.len - offs, count );
+        if( wal_truncate( w, offs ) != 0 )
+            count =-1;
+    }
+    index_mapClose( &map );
+    return count;
+}
+
+static int
+wal_grow( wal_t* w, size_t add ) {
+    if( w->len + add <= w->size )
+        return 0;
+    size_t size =w->size + WAL_BUF_INCR;
+    while( size < w->len + add )
+        size *= 2;
+    char *buf =realloc( w->buf, size );
+    if( buf == NULL ) {
+        w->err =1;
+        return -1;
+    }
+    w->buf =buf;
+    w->size =size;
+    return 0;
+}
+
+void
+wal_begin( wal_t* w ) {
+    w->rec =w->len;
+    w->err =0;
+    if( wal_grow( w, sizeof( wal_rechdr_t ) ) == 0 )
+        w->len +=sizeof( wal_rechdr_t );
+}
+
+void
+wal_put( wal_t* w, const void* data, size_t len ) {
+    if( w->err || wal_grow( w, len ) != 0 )
+        return;
+    memcpy( w->buf + w->len, data, len );
+    w->len +=len;
+}
+
+void
+wal_putU32( wal_t* w, uint32_t v ) {
+    wal_put( w, &v, sizeof( uint32_t ) );
+}
+
+void
+wal_putU64( wal_t* w, uint64_t v ) {
+    wal_put( w, &v, sizeof( uint64_t ) );
+}
+
+void
+wal_putStr( wal_t* w, const char* str, size_t len ) {
+    if( str == NULL ) {
+        wal_putU32( w, WAL_NULLSTR );
+        return;
+    }
+    wal_putU32( w, len );
+    wal_put( w, str, len );
+}
+
+uint8_t*
+wal_reserve( wal_t* w, size_t max ) {
+    if( w->err || wal_grow( w, max ) != 0 )
+        return NULL;
+    return (uint8_t*)w->buf + w->len;
+}
+
+void
+wal_extend( wal_t* w, size_t len ) {
+    if( !w->err )
+        w->len +=len;
+}
+
+int
+wal_end( wal_t* w ) {
+    size_t len =w->len - w->rec - sizeof( wal_rechdr_t );
+    if( w->err || len > WAL_MAXRECORD ) {
+        w->len =w->rec;
+        return -1;
+    }
+    wal_rechdr_t hdr;
+    hdr.magic =WAL_MAGIC;
+    hdr.len =len;
+    hdr.crc =crc32( w->buf + w->rec + sizeof( wal_rechdr_t ), len );
+    memcpy( w->buf + w->rec, &hdr, sizeof( wal_rechdr_t ) );
+    w->rec =w->len;
+    w->pending++;
+    return 0;
+}
+
+int
+wal_commit( wal_t* w ) {
+    size_t len =w->rec;     // Only completed records
+    size_t done =0;
+
+    if( w->pending == 0 )
+        return 0;
+    while( done < len ) {
+        ssize_t n =write( w->fd, w->buf + done, len - done );
+        if( n < 0 ) {
+            if( errno == EINTR ) continue;
+            goto err;
+        }
+        done +=n;
+    }
+    if( fdatasync( w->fd ) != 0 )
+        goto err;
+
+    w->end +=len;
+    memmove( w->buf, w->buf + len, w->len - len );
+    w->len -=len;
+    w->rec =0;
+    w->pending =0;
+    return 0;
+
+err:
+    fprintf( stderr, "wal_commit(): %s\n", strerror( errno ) );
+    // Do not leave half a batch behind
+    wal_truncate( w, w->end );
+    return -1;
+}
+
+int
+wal_checkpoint( wal_t* w ) {
+    if( syncfs( w->fd ) != 0 ) {
+        fprintf( stderr, "wal_checkpoint(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    return wal_truncate( w, 0 );
+}
+
+void
+wal_close( wal_t* w ) {
+    if( w->fd >= 0 ) {
+        flock( w->fd, LOCK_UN );
+        close( w->fd );
+    }
+    free( w->buf );
+    memset( w, 0, sizeof( wal_t ) );
+    w->fd =-1;
+}
+
+void
+wal_readerInit( wal_reader_t* r, const char* data, size_t len ) {
+    r->p =data;
+    r->end =data + len;
+    r->err =0;
+}
+
+const char*
+wal_get( wal_reader_t* r, size_t len ) {
+    if( r->err || len > (size_t)( r->end - r->p ) ) {
+        r->err =1;
+        return NULL;
+    }
+    const char *p =r->p;
+    r->p +=len;
+    return p;
+}
+
+uint32_t
+wal_getU32( wal_reader_t* r ) {
+    uint32_t v =0;
+    const char *p =wal_get( r, sizeof( uint32_t ) );
+    if( p ) memcpy( &v, p, sizeof( uint32_t ) );
+    return v;
+}
+
+uint64_t
+wal_getU64( wal_reader_t* r ) {
+    uint64_t v =0;
+    const char *p =wal_get( r, sizeof( uint64_t ) );
+    if( p ) memcpy( &v, p, sizeof( uint64_t ) );
+    return v;
+}
+
+int
+wal_getStr( wal_reader_t* r, const char** str, size_t* len ) {
+    uint32_t n =wal_getU32( r );
+    *str =NULL;
+    *len =0;
+    if( r->err ) return -1;
+    if( n == WAL_NULLSTR ) return 0;
+    if( ( *str =wal_get( r, n ) ) == NULL ) return -1;
+    *len =n;
+    return 0;
+}
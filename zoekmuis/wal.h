@@ -0,0 +1,122 @@
+/*
+ * Websearch - wal.h
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Write-ahead log of the index writer. Every record holds the complete update of
+ * one page and is checksummed, so a page is either recovered entirely or not at
+ * all. Records are collected in memory and committed in batches with a single
+ * fdatasync(). After the updates are safely stored in a segment the log is
+ * checkpointed, which empties it.
+ *
+ * A record on disk is a wal_rechdr_t followed by `len' bytes of payload.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define WAL_MAGIC 0x4c574d5a    // "ZMWL"
+#define WAL_MAXRECORD (1 << 30)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;               // Length of the payload
+    uint32_t crc;               // CRC-32 of the payload
+} wal_rechdr_t;
+
+typedef struct {
+    int fd;
+    off_t end;                  // Size of the log on disk
+    char *buf;                  // Records waiting for the next commit
+    size_t len, size;
+    size_t rec;                 // Start of the record that is being built
+    size_t pending;             // Number of complete records in `buf'
+    int err;                    // Set when a record could not be built
+} wal_t;
+
+/* Reads the payload of a record */
+typedef struct {
+    const char *p, *end;
+    int err;                    // Set when reading past the end
+} wal_reader_t;
+
+/* Open or create the log at `path' and lock it for this process.
+   Returns -1 on error or if another process holds the log */
+int
+wal_open( wal_t* w, const char* path );
+
+/* Call `apply' for every intact record in the log, in order. `apply' returns 0 on
+   success, 1 for a malformed record and -1 on error, which stops the replay.
+   The log is truncated at the first torn, corrupt or malformed record.
+   Returns the number of records applied or -1 on error */
+long
+wal_replay( wal_t* w, int (*apply)( const char* data, size_t len, void* arg ), void* arg );
+
+/* Start a new record in the commit buffer */
+void
+wal_begin( wal_t* w );
+
+void
+wal_put( wal_t* w, const void* data, size_t len );
+
+void
+wal_putU32( wal_t* w, uint32_t v );
+
+void
+wal_putU64( wal_t* w, uint64_t v );
+
+/* Put a string with its length, `str' may be NULL */
+void
+wal_putStr( wal_t* w, const char* str, size_t len );
+
+/* Return room for at most `max' bytes at the end of the record,
+   of which wal_extend() marks the ones that were used */
+uint8_t*
+wal_reserve( wal_t* w, size_t max );
+
+void
+wal_extend( wal_t* w, size_t len );
+
+/* Complete the current record. Returns -1 if it could not be built,
+   in which case it is dropped */
+int
+wal_end( wal_t* w );
+
+/* Write all completed records and make them durable with one fdatasync().
+   Returns -1 on error */
+int
+wal_commit( wal_t* w );
+
+/* Empty the log once everything in it has been stored elsewhere. Syncs the
+   filesystem first, as the other index files are written without syncing.
+   Returns -1 on error */
+int
+wal_checkpoint( wal_t* w );
+
+void
+wal_close( wal_t* w );
+
+void
+wal_readerInit( wal_reader_t* r, const char* data, size_t len );
+
+uint32_t
+wal_getU32( wal_reader_t* r );
+
+uint64_t
+wal_getU64( wal_reader_t* r );
+
+/* Return a pointer to the next `len' bytes, or NULL past the end */
+const char*
+wal_get( wal_reader_t* r, size_t len );
+
+/* Read a string written by wal_putStr(). Returns 0 on success, *str is NULL
+   for a NULL string and is not null-terminated otherwise */
+int
+wal_getStr( wal_reader_t* r, const char** str, size_t* len );
+
+#endif
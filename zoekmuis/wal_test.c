@@ -0,0 +1,147 @@
+/*
+ * Websearch - wal_test.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Checks that the write-ahead log replays what was committed and drops a torn
+ * or corrupt tail. Prints every failed check and returns the number of failures
+ */
+
+#define _GNU_SOURCE
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int failed =0;
+
+#define CHECK( cond ) do { if( !(cond) ) { \
+    fprintf( stderr, "%s:%d: failed `%s'\n", __FILE__, __LINE__, #cond ); failed++; } } while( 0 )
+
+typedef struct {
+    uint32_t next;              // Number the next record should have
+    int malformed;              // Reject the record with this number
+} replay_t;
+
+/* Record `i' holds its number and a string that depends on it */
+static void
+put_record( wal_t* w, uint32_t i ) {
+    char str[64];
+    int len =snprintf( str, sizeof( str ), "record %u", i );
+    wal_begin( w );
+    wal_putU32( w, i );
+    wal_putStr( w, str, len );
+    wal_putStr( w, NULL, 0 );
+    CHECK( wal_end( w ) == 0 );
+}
+
+static int
+apply( const char* data, size_t len, void* arg ) {
+    replay_t *r =arg;
+    wal_reader_t rd;
+    const char *str;
+    size_t n;
+    char expect[64];
+
+    wal_readerInit( &rd, data, len );
+    uint32_t i =wal_getU32( &rd );
+    if( (int)i == r->malformed )
+        return 1;
+    int elen =snprintf( expect, sizeof( expect ), "record %u", i );
+    CHECK( i == r->next );
+    CHECK( wal_getStr( &rd, &str, &n ) == 0 && n == elen && memcmp( str, expect, n ) == 0 );
+    CHECK( wal_getStr( &rd, &str, &n ) == 0 && str == NULL );
+    CHECK( !rd.err && rd.p == rd.end );
+    r->next++;
+    return 0;
+}
+
+/* Open the log at `path', replay it and close it again. Returns the number of
+   records replayed */
+static long
+replay( const char* path, int malformed ) {
+    wal_t w;
+    replay_t r ={ 0, malformed };
+    if( wal_open( &w, path ) != 0 ) {
+        CHECK( !"wal_open" );
+        return -1;
+    }
+    long n =wal_replay( &w, apply, &r );
+    CHECK( n == r.next );
+    wal_close( &w );
+    return n;
+}
+
+static off_t
+file_size( const char* path ) {
+    struct stat st;
+    return stat( path, &st ) == 0 ? st.st_size : -1;
+}
+
+int main( int argc, char** argv ) {
+    char dir[] ="/tmp/wal_test.XXXXXX", path[64];
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+    snprintf( path, sizeof( path ), "%s/wal", dir );
+
+    // Records are only written by a commit
+    wal_t w;
+    CHECK( wal_open( &w, path ) == 0 );
+    CHECK( wal_replay( &w, apply, &(replay_t){ 0, -1 } ) == 0 );
+    for( uint32_t i =0; i < 5; i++ )
+        put_record( &w, i );
+    CHECK( file_size( path ) == 0 );
+    CHECK( wal_commit( &w ) == 0 );
+    off_t five =file_size( path );
+    put_record( &w, 5 );
+    CHECK( wal_commit( &w ) == 0 );
+    off_t six =file_size( path );
+    wal_close( &w );
+    CHECK( replay( path, -1 ) == 6 );
+
+    // A torn last record is dropped and cut off
+    CHECK( truncate( path, six - 3 ) == 0 );
+    CHECK( replay( path, -1 ) == 5 );
+    CHECK( file_size( path ) == five );
+
+    // Appending after the cut continues the log
+    CHECK( wal_open( &w, path ) == 0 );
+    CHECK( wal_replay( &w, apply, &(replay_t){ 0, -1 } ) == 5 );
+    put_record( &w, 5 );
+    put_record( &w, 6 );
+    CHECK( wal_commit( &w ) == 0 );
+    wal_close( &w );
+    CHECK( replay( path, -1 ) == 7 );
+
+    // A corrupt payload ends the log at that record
+    int fd =open( path, O_RDWR );
+    char c;
+    CHECK( pread( fd, &c, 1, five - 1 ) == 1 );
+    c ^=0x40;
+    CHECK( pwrite( fd, &c, 1, five - 1 ) == 1 );
+    close( fd );
+    CHECK( replay( path, -1 ) == 4 );
+    CHECK( replay( path, -1 ) == 4 );
+
+    // So does a record that can not be applied
+    CHECK( replay( path, 2 ) == 2 );
+    CHECK( replay( path, -1 ) == 2 );
+
+    // A checkpoint empties the log
+    CHECK( wal_open( &w, path ) == 0 );
+    CHECK( wal_replay( &w, apply, &(replay_t){ 0, -1 } ) == 2 );
+    CHECK( wal_checkpoint( &w ) == 0 );
+    wal_close( &w );
+    CHECK( file_size( path ) == 0 );
+    CHECK( replay( path, -1 ) == 0 );
+
+    unlink( path );
+    rmdir( dir );
+    if( failed )
+        fprintf( stderr, "%d checks failed\n", failed );
+    return failed;
+}
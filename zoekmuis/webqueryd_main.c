@@ -0,0 +1,777 @@
+/*
+ * Websearch - webqueryd_main.c
+ *
+ * Part of homework 4 for MIR course
+ * Micky Faas
+ *
+ * Query daemon. Keeps the query engine open and answers queries with a pool of
+ * worker threads, both over HTTP and on a Unix socket. Over HTTP it serves
+ *
+ *   GET /                      the search page, with results if there is a `q'
+ *   GET /api/search            the results as JSON
+ *   GET /image/<docid>         an image from the image store
+ *   GET /style.css, /muis.jpg  what the search page needs
+ *
+ * with the same parameters as the mongoose front end: `q', `type' (web or
+ * images), `color' and `page'. Connections are kept alive. With -t the
+ * results carry the time every phase of the query took in milliseconds, as
+ * Server-Timing: dict;dur=..., postings;dur=..., score;dur=..., render;dur=... On the Unix socket a
+ * client sends one line
+ *
+ *   <web|images|color> <page> <query>
+ *
+ * and reads the same HTML webquery would print until the connection is closed.
+ *
+ * One thread waits for all connections with epoll and hands the ones with a
+ * request to the workers; a connection is only watched again once its worker
+ * is done with it. Segments, the document table and the stores are opened
+ * again whenever the webspider or indexmerge changed them.
+ */
+
+#define _GNU_SOURCE
+#include "query.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define WEBQUERYD_SOCKET "webqueryd.sock"
+#define WEBQUERYD_PORT 8090
+#define WEBQUERYD_STATIC "../mongoose/"         // Where the images of the search page are
+#define WEBQUERYD_REQSIZE 8192                  // Largest request head
+#define WEBQUERYD_BACKLOG 128
+#define WEBQUERYD_EVENTS 64
+#define WEBQUERYD_TIMEOUT 5             // Seconds a client may take to receive a response
+#define WEBQUERYD_KEEPALIVE 15          // Seconds an idle connection is kept open
+#define WEBQUERYD_MAX_CONNS 4096
+#define WEBQUERYD_REFRESH 1             // Seconds between looking for changes on disk
+#define WEBQUERYD_MAX_THREADS 64
+#define WEBQUERYD_CACHE 64              // Megabytes of cached results
+#define WEBQUERYD_TERMCACHE 8           // Megabytes of cached dictionary lookups
+
+typedef struct conn {
+    int fd;
+    int listening;              // A listening socket, handled by the epoll thread
+    int http;                   // Speaks HTTP, else the line protocol of the Unix socket
+    int busy;                   // Queued for or being served by a worker
+    time_t last;                // Time it was last watched again
+    size_t len;
+    char buf[WEBQUERYD_REQSIZE];
+    struct conn *prev, *next;   // All open connections
+    struct conn *qnext;         // Queue of connections with a request
+} conn_t;
+
+/* A file of the search page */
+typedef struct {
+    const char *path, *type;
+    const char *data;
+    size_t len;
+} asset_t;
+
+static query_engine_t engine;
+static int epfd;
+static int timed;               // Whether responses tell how long the phases took
+
+static pthread_mutex_t conns_lock =PTHREAD_MUTEX_INITIALIZER;
+static conn_t *conns;
+static size_t nconns;
+
+static pthread_mutex_t queue_lock =PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond =PTHREAD_COND_INITIALIZER;
+static conn_t *queue_head, *queue_tail;
+
+static const char PAGE_HEAD[] =
+    "<!DOCTYPE html>\n"
+    "<html>\n"
+    "<head>\n"
+    "    <meta charset=\"utf-8\">\n"
+    "    <title>ZoekMuis</title>\n"
+    "    <link href=\"https://fonts.googleapis.com/css?family=Roboto:300\" rel=\"stylesheet\">\n"
+    "    <link rel=\"stylesheet\" type=\"text/css\" href=\"/style.css\">\n"
+    "</head>\n"
+    "<body>\n"
+    "<div class=\"header\">\n"
+    "<div class=\"container\">\n"
+    "\n"
+    "<h1 id=\"title\">ZoekMuis</h1>\n"
+    "\n"
+    "<div style=\"text-align: center\">\n"
+    "<form action=\"/\" method=\"get\">\n"
+    "<input name=\"q\" size=\"60\"><br/><br/>\n"
+    "<button type=\"submit\" name=\"type\" value=\"web\">Search Web</button>\n"
+    "<button type=\"submit\" name=\"type\" value=\"images\">Search Images</button>\n"
+    "</form>\n"
+    "</div>\n"
+    "</div>\n"
+    "</div>\n"
+    "\n"
+    "<div class=\"container-background\">\n"
+    "<div class=\"container\">\n"
+    "<div class=\"result-list\">\n";
+
+static const char PAGE_TAIL[] =
+    "\n</div></div></div>\n"
+    "</body></html>\n";
+
+static const char STYLE_CSS[] =
+    "body, html, div {\n    margin: 0;\n    padding: 0;\n}\n\n"
+    "a img, a, img {\n    border: 0;\n}\n\n"
+    "a, a:visited {\n    color: teal;\n}\n\n"
+    "a.color-link {\n    font-size: 75%;\n    display: block;\n}\n\n"
+    "body, html {\n    font-family: 'Roboto', sans-serif;\n}\n\n"
+    "div.container-background {\n    background-image: url('/muis.jpg');\n"
+    "    background-repeat: no-repeat;\n    background-position: top left;\n}\n\n"
+    "div.container {\n    max-width: 960px;\n    margin-left: auto;\n    margin-right: auto;\n}\n\n"
+    "div.header {\n    padding-top: 25px;\n    padding-bottom: 25px;\n"
+    "    background-color: whitesmoke;\n    border-bottom: 1px solid lightgray;\n}\n\n"
+    "h1#title {\n    text-align: center;\n    color: teal;\n}\n\n"
+    ".result p {\n    color: gray;\n}\n\n"
+    ".result h3 {\n    font-size: 150%;\n}\n\n"
+    ".result-list h2 {\n    color: teal;\n    text-align: center;\n}\n\n"
+    ".result-list {\n    margin-top: 75px;\n    margin-bottom: 20px;\n"
+    "    background-color: white;\n    background-color: rgba( 255, 255, 255, 128 );\n    min-height: 300px;\n}\n\n"
+    ".img-result {\n    display: inline-block;\n    padding: 5px;\n    width: 180px;\n}\n\n"
+    ".img-result img {\n    width: 170px;\n    height: auto;\n    max-height: 150px;\n}\n\n"
+    ".img-query {\n    text-align: center;\n    display: block;\n}\n\n"
+    ".img-query img {\n    width: 250px;\n    height: auto;\n}\n\n"
+    "div.pages {\n    clear: both;\n    padding: 20px;\n    text-align: center;\n    color: gray;\n}\n";
+
+static asset_t assets[] ={
+    { "/style.css", "text/css", STYLE_CSS, sizeof( STYLE_CSS ) - 1 },
+    { "/muis.jpg", "image/jpeg", NULL, 0 },     // Read from WEBQUERYD_STATIC
+    { NULL }
+};
+
+void
+show_help( const char *name ) {
+    fprintf( stderr, "%s [-p port] [-s socket] [-j threads] [-w threads] [-c MB] [-t] - Answer queries over HTTP on port %d "
+            "and on the Unix socket " WEBQUERYD_SOCKET " by default. -p 0 turns HTTP off, "
+            "-w sets the threads that help evaluate a query (one per core, 0 for none), "
+            "-c sets the size of the result cache (%d MB, 0 turns it off), "
+            "-t adds the time of every phase of a query to the HTTP response as Server-Timing\n",
+            name, WEBQUERYD_PORT, WEBQUERYD_CACHE );
+}
+
+/* Read the file `name' in WEBQUERYD_STATIC into `a' */
+static void
+asset_load( asset_t* a, const char* name ) {
+    char path[256];
+    snprintf( path, sizeof( path ), WEBQUERYD_STATIC "%s", name );
+    FILE *file =fopen( path, "r" );
+    if( file == NULL ) return;
+    char *data =NULL;
+    size_t len =0, size =0;
+    while( !feof( file ) && !ferror( file ) ) {
+        if( len == size && ( data =realloc( data, size =size ? size*2 : 65536 ) ) == NULL )
+            break;
+        len +=fread( data + len, 1, size - len, file );
+    }
+    fclose( file );
+    a->data =data;
+    a->len =data ? len : 0;
+}
+
+static void
+queue_push( conn_t* c ) {
+    pthread_mutex_lock( &queue_lock );
+    c->qnext =NULL;
+    if( queue_tail )
+        queue_tail->qnext =c;
+    else
+        queue_head =c;
+    queue_tail =c;
+    pthread_cond_signal( &queue_cond );
+    pthread_mutex_unlock( &queue_lock );
+}
+
+static conn_t*
+queue_pop( void ) {
+    pthread_mutex_lock( &queue_lock );
+    while( queue_head == NULL )
+        pthread_cond_wait( &queue_cond, &queue_lock );
+    conn_t *c =queue_head;
+    if( ( queue_head =c->qnext ) == NULL )
+        queue_tail =NULL;
+    pthread_mutex_unlock( &queue_lock );
+    return c;
+}
+
+/* Create a connection for `fd' and start watching it. `conns_lock' is held */
+static conn_t*
+conn_add( int fd, int listening, int http ) {
+    conn_t *c =malloc( sizeof( conn_t ) );
+    if( c == NULL ) return NULL;
+    c->fd =fd;
+    c->listening =listening;
+    c->http =http;
+    c->busy =0;
+    c->last =time( NULL );
+    c->len =0;
+    c->prev =NULL;
+    if( ( c->next =conns ) != NULL )
+        conns->prev =c;
+    conns =c;
+    nconns++;
+
+    struct epoll_event ev;
+    ev.events =listening ? EPOLLIN : EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr =c;
+    if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 ) {
+        fprintf( stderr, "epoll_ctl(): %s\n", strerror( errno ) );
+        conns =c->next;
+        if( conns ) conns->prev =NULL;
+        nconns--;
+        free( c );
+        return NULL;
+    }
+    return c;
+}
+
+/* Close and free `c'. `conns_lock' is held */
+static void
+conn_remove( conn_t* c ) {
+    if( c->prev ) c->prev->next =c->next;
+    else conns =c->next;
+    if( c->next ) c->next->prev =c->prev;
+    nconns--;
+    close( c->fd );
+    free( c );
+}
+
+/* Write all of `buf', waiting for the client if it is slow. `more' holds it back
+   until the rest of the response follows. Returns -1 if the client is gone */
+static int
+send_all( int fd, const char* buf, size_t len, int more ) {
+    while( len > 0 ) {
+        ssize_t w =send( fd, buf, len, more ? MSG_MORE : 0 );
+        if( w < 0 && ( errno == EAGAIN || errno == EINTR ) ) {
+            struct pollfd p ={ fd, POLLOUT, 0 };
+            if( poll( &p, 1, WEBQUERYD_TIMEOUT * 1000 ) <= 0 )
+                return -1;
+            continue;
+        }
+        if( w <= 0 ) return -1;
+        buf +=w;
+        len -=w;
+    }
+    return 0;
+}
+
+static int
+send_file( int fd, int in, uint64_t offs, size_t len ) {
+    off_t o =offs;
+    while( len > 0 ) {
+        ssize_t w =sendfile( fd, in, &o, len );
+        if( w < 0 && ( errno == EAGAIN || errno == EINTR ) ) {
+            struct pollfd p ={ fd, POLLOUT, 0 };
+            if( poll( &p, 1, WEBQUERYD_TIMEOUT * 1000 ) <= 0 )
+                return -1;
+            continue;
+        }
+        if( w <= 0 ) return -1;
+        len -=w;
+    }
+    return 0;
+}
+
+/* Send the status line and the headers of a response with a body of `len' bytes,
+   which follows unless `head' */
+static int
+send_head( int fd, const char* status, const char* type, size_t len, const char* extra, int head, int keep ) {
+    char hdr[1024];
+    int n =snprintf( hdr, sizeof( hdr ),
+            "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+            status, type, len, extra ? extra : "", keep ? "keep-alive" : "close" );
+    return send_all( fd, hdr, n, !head && len > 0 );
+}
+
+static int
+send_response( int fd, const char* status, const char* type, const char* body, size_t len, const char* extra, int head, int keep ) {
+    if( send_head( fd, status, type, len, extra, head, keep ) != 0 )
+        return -1;
+    return head ? 0 : send_all( fd, body, len, 0 );
+}
+
+static int
+send_error( int fd, const char* status, int head, int keep ) {
+    char body[128];
+    int len =snprintf( body, sizeof( body ), "%s\n", status );
+    return send_response( fd, status, "text/plain", body, len, NULL, head, keep );
+}
+
+static int
+hexval( int ch ) {
+    if( ch >= '0' && ch <= '9' ) return ch - '0';
+    if( ch >= 'a' && ch <= 'f' ) return ch - 'a' + 10;
+    if( ch >= 'A' && ch <= 'F' ) return ch - 'A' + 10;
+    return -1;
+}
+
+/* Find parameter `name' in the query string `qs' and decode its value into `buf'.
+   Returns 1 if the parameter is there, even without a value, 0 if not */
+static int
+get_param( const char* qs, const char* name, char* buf, size_t size ) {
+    size_t nlen =strlen( name );
+    while( qs != NULL && *qs ) {
+        const char *end =strchr( qs, '&' );
+        if( end == NULL ) end =qs + strlen( qs );
+        if( strncmp( qs, name, nlen ) == 0 && ( qs[nlen] == '=' || qs + nlen == end ) ) {
+            const char *p =qs + nlen + ( qs[nlen] == '=' );
+            size_t len =0;
+            while( p < end && len < size-1 ) {
+                if( *p == '+' )
+                    buf[len++] =' ';
+                else if( *p == '%' && p+2 < end && hexval( p[1] ) >= 0 && hexval( p[2] ) >= 0 ) {
+                    buf[len++] =hexval( p[1] ) << 4 | hexval( p[2] );
+                    p +=2;
+                } else
+                    buf[len++] =*p;
+                p++;
+            }
+            buf[len] =0;
+            return 1;
+        }
+        qs =*end ? end + 1 : end;
+    }
+    buf[0] =0;
+    return 0;
+}
+
+/* Answer the query in `qs', if any, in `format' with the search page around it
+   for HTML. Returns -1 if the client is gone */
+static int
+serve_search( conn_t* c, query_ctx_t* ctx, const char* qs, query_format_t format, int head, int keep ) {
+    char q[QUERY_MAX_KWSIZE+1], type[16];
+    get_param( qs, "q", q, sizeof( q ) );
+    int empty =q[strspn( q, " \t\r\n" )] == 0;
+    get_param( qs, "page", type, sizeof( type ) );
+    size_t page =strtoul( type, NULL, 10 );
+
+    query_mode_t mode =QUERY_WEB;
+    if( get_param( qs, "color", type, sizeof( type ) ) )
+        mode =QUERY_COLOR;
+    else if( get_param( qs, "type", type, sizeof( type ) ) && strcmp( type, "images" ) == 0 )
+        mode =QUERY_IMAGES;
+
+    if( format == QUERY_JSON && empty )
+        return send_error( c->fd, "400 Bad Request", head, keep );
+
+    char *buf =NULL;
+    size_t len =0;
+    FILE *out =open_memstream( &buf, &len );
+    if( out == NULL )
+        return send_error( c->fd, "500 Internal Server Error", head, keep );
+    if( format == QUERY_HTML )
+        fputs( PAGE_HEAD, out );
+    if( !empty )
+        query_run( &engine, ctx, mode, format, q, page, out );
+    if( format == QUERY_HTML )
+        fputs( PAGE_TAIL, out );
+
+    char extra[256] ="Cache-Control: no-cache\r\n";
+    if( ctx->timed && !empty )
+        snprintf( extra, sizeof( extra ), "Cache-Control: no-cache\r\n"
+                "Server-Timing: dict;dur=%.3f, postings;dur=%.3f, score;dur=%.3f, render;dur=%.3f\r\n",
+                ctx->timing.dictionary * 1e3, ctx->timing.postings * 1e3,
+                ctx->timing.scoring * 1e3, ctx->timing.rendering * 1e3 );
+
+    int err;
+    if( fclose( out ) != 0 )
+        err =send_error( c->fd, "500 Internal Server Error", head, keep );
+    else
+        err =send_response( c->fd, "200 OK", format == QUERY_JSON ? "application/json" : "text/html; charset=utf-8",
+                buf, len, extra, head, keep );
+    free( buf );
+    return err;
+}
+
+static int
+serve_image( conn_t* c, const char* id, int head, int keep ) {
+    char *end, type[128];
+    docid_t docid =strtoull( id, &end, 16 );
+    if( *id == 0 || *end != 0 )
+        return send_error( c->fd, "404 Not Found", head, keep );
+
+    int fd;
+    uint64_t offs;
+    size_t len;
+    int err =query_image( &engine, docid, type, sizeof( type ), &fd, &offs, &len );
+    if( err != 0 )
+        return send_error( c->fd, err == 1 ? "404 Not Found" : "500 Internal Server Error", head, keep );
+
+    // Stores from before the type was taken from the signature may hold SVG
+    err =send_head( c->fd, "200 OK", type, len, "Cache-Control: max-age=86400\r\nX-Content-Type-Options: nosniff\r\n"
+            "Content-Security-Policy: default-src 'none'; sandbox\r\n", head, keep );
+    if( err == 0 && !head )
+        err =send_file( c->fd, fd, offs, len );
+    close( fd );
+    return err;
+}
+
+/* Answer the HTTP request at the start of the buffer of `c', if it is complete.
+   Returns the length of the request, 0 if it is not complete yet or -1 if the
+   connection has to be closed */
+static ssize_t
+serve_http( conn_t* c, query_ctx_t* ctx ) {
+    char *end =strstr( c->buf, "\r\n\r\n" );
+    size_t hlen =4;
+    char *lf =strstr( c->buf, "\n\n" );
+    if( lf != NULL && ( end == NULL || lf < end ) ) {
+        end =lf;
+        hlen =2;
+    }
+    if( end == NULL )
+        return c->len >= sizeof( c->buf ) - 1 ? -1 : 0;
+    *end =0;
+    size_t reqlen =end - c->buf + hlen;
+
+    char method[8], target[2048], version[16];
+    if( sscanf( c->buf, "%7s %2047s %15s", method, target, version ) != 3 ) {
+        send_error( c->fd, "400 Bad Request", 0, 0 );
+        return -1;
+    }
+
+    // HTTP/1.1 keeps connections alive unless told not to, 1.0 only when asked
+    int keep =strcmp( version, "HTTP/1.1" ) == 0;
+    for( char *h =strchr( c->buf, '\n' ); h != NULL; h =strchr( h, '\n' ) ) {
+        h++;
+        if( strncasecmp( h, "Connection:", 11 ) == 0 ) {
+            const char *v =h + 11;
+            while( *v == ' ' || *v == '\t' ) v++;
+            if( strncasecmp( v, "close", 5 ) == 0 ) keep =0;
+            else if( strncasecmp( v, "keep-alive", 10 ) == 0 ) keep =1;
+        } else if( strncasecmp( h, "Content-Length:", 15 ) == 0 && atol( h + 15 ) > 0 ) {
+            // There are no requests with a body, do not try to find the next one after it
+            keep =0;
+        }
+    }
+
+    int head =strcmp( method, "HEAD" ) == 0;
+    if( !head && strcmp( method, "GET" ) != 0 ) {
+        send_error( c->fd, "405 Method Not Allowed", 0, 0 );
+        return -1;
+    }
+
+    char *qs =strchr( target, '?' );
+    if( qs != NULL )
+        *qs++ =0;
+
+    int err;
+    if( strcmp( target, "/" ) == 0 || strcmp( target, "/search" ) == 0 )
+        err =serve_search( c, ctx, qs, QUERY_HTML, head, keep );
+    else if( strcmp( target, "/api/search" ) == 0 )
+        err =serve_search( c, ctx, qs, QUERY_JSON, head, keep );
+    else if( strncmp( target, "/image/", 7 ) == 0 )
+        err =serve_image( c, target + 7, head, keep );
+    else {
+        asset_t *a =assets;
+        while( a->path != NULL && ( strcmp( a->path, target ) != 0 || a->data == NULL ) )
+            a++;
+        if( a->path != NULL )
+            err =send_response( c->fd, "200 OK", a->type, a->data, a->len, "Cache-Control: max-age=86400\r\n", head, keep );
+        else
+            err =send_error( c->fd, "404 Not Found", head, keep );
+    }
+    return err != 0 || !keep ? -1 : (ssize_t)reqlen;
+}
+
+/* Answer the request line at the start of the buffer of `c', if it is complete or
+   the client finished sending (`eof'). The connection is always closed after */
+static ssize_t
+serve_line( conn_t* c, query_ctx_t* ctx, int eof ) {
+    char type[8];
+    unsigned long page;
+    int offs;
+    if( strchr( c->buf, '\n' ) == NULL && !eof && c->len < sizeof( c->buf ) - 1 )
+        return 0;
+    if( sscanf( c->buf, "%7s %lu %n", type, &page, &offs ) != 2 )
+        return -1;
+    char *query =c->buf + offs;
+    query[strcspn( query, "\r\n" )] =0;
+
+    query_mode_t mode;
+    if( strcmp( type, "web" ) == 0 )
+        mode =QUERY_WEB;
+    else if( strcmp( type, "images" ) == 0 )
+        mode =QUERY_IMAGES;
+    else if( strcmp( type, "color" ) == 0 )
+        mode =QUERY_COLOR;
+    else
+        return -1;
+
+    char *buf =NULL;
+    size_t len =0;
+    FILE *out =open_memstream( &buf, &len );
+    if( out == NULL )
+        return -1;
+    query_run( &engine, ctx, mode, QUERY_HTML, query, page, out );
+    if( fclose( out ) == 0 )
+        send_all( c->fd, buf, len, 0 );
+    free( buf );
+    return -1;
+}
+
+/* Read what the client of `c' sent and answer every complete request in it */
+static void
+serve( conn_t* c, query_ctx_t* ctx ) {
+    int eof =0;
+    while( c->len < sizeof( c->buf ) - 1 ) {
+        ssize_t r =read( c->fd, c->buf + c->len, sizeof( c->buf ) - 1 - c->len );
+        if( r > 0 ) {
+            c->len +=r;
+            continue;
+        }
+        if( r < 0 && errno == EINTR )
+            continue;
+        if( r == 0 || errno != EAGAIN )
+            eof =1;
+        break;
+    }
+    c->buf[c->len] =0;
+
+    ssize_t used =0;
+    while( c->len > 0 ) {
+        used =c->http ? serve_http( c, ctx ) : serve_line( c, ctx, eof );
+        if( used <= 0 )
+            break;
+        c->len -=used;
+        memmove( c->buf, c->buf + used, c->len + 1 );
+    }
+
+    pthread_mutex_lock( &conns_lock );
+    if( eof || used < 0 )
+        conn_remove( c );
+    else {
+        // Watch it again for the next request
+        struct epoll_event ev;
+        ev.events =EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr =c;
+        c->busy =0;
+        c->last =time( NULL );
+        if( epoll_ctl( epfd, EPOLL_CTL_MOD, c->fd, &ev ) != 0 )
+            conn_remove( c );
+    }
+    pthread_mutex_unlock( &conns_lock );
+}
+
+static void*
+worker( void* arg ) {
+    query_ctx_t ctx;
+    query_ctxCreate( &ctx );
+    ctx.timed =timed;
+    while( 1 )
+        serve( queue_pop( ), &ctx );
+    query_ctxFree( &ctx );
+    return NULL;
+}
+
+static void*
+refresher( void* arg ) {
+    while( 1 ) {
+        sleep( WEBQUERYD_REFRESH );
+        if( query_refresh( &engine ) < 0 )
+            fprintf( stderr, "Could not reopen the index, still using the old one\n" );
+    }
+    return NULL;
+}
+
+/* Accept all waiting connections on listening socket `l' */
+static void
+accept_all( conn_t* l ) {
+    while( 1 ) {
+        int fd =accept4( l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if( fd < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) continue;
+            if( errno != EAGAIN )
+                fprintf( stderr, "accept(): %s\n", strerror( errno ) );
+            return;
+        }
+        // Responses are written in one go, there is nothing for Nagle to collect
+        int one =1;
+        if( l->http )
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+        pthread_mutex_lock( &conns_lock );
+        if( nconns >= WEBQUERYD_MAX_CONNS || conn_add( fd, 0, l->http ) == NULL )
+            close( fd );
+        pthread_mutex_unlock( &conns_lock );
+    }
+}
+
+/* Close the connections that have been idle for too long */
+static void
+close_idle( void ) {
+    time_t now =time( NULL );
+    pthread_mutex_lock( &conns_lock );
+    conn_t *c =conns;
+    while( c != NULL ) {
+        conn_t *next =c->next;
+        if( !c->listening && !c->busy && now - c->last > WEBQUERYD_KEEPALIVE )
+            conn_remove( c );
+        c =next;
+    }
+    pthread_mutex_unlock( &conns_lock );
+}
+
+static int
+listen_unix( const char* path ) {
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family =AF_UNIX;
+    if( strlen( path ) >= sizeof( addr.sun_path ) ) {
+        errno =ENAMETOOLONG;
+        return -1;
+    }
+    strcpy( addr.sun_path, path );
+
+    // A socket left behind by an earlier daemon is replaced
+    unlink( path );
+    int sock =socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( sock < 0 || bind( sock, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 || listen( sock, WEBQUERYD_BACKLOG ) != 0 ) {
+        if( sock >= 0 ) close( sock );
+        return -1;
+    }
+    return sock;
+}
+
+static int
+listen_tcp( int port ) {
+    int one =1;
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family =AF_INET;
+    addr.sin_port =htons( port );
+    addr.sin_addr.s_addr =htonl( INADDR_ANY );
+    int sock =socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( sock < 0 || setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) ) != 0
+            || bind( sock, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 || listen( sock, WEBQUERYD_BACKLOG ) != 0 ) {
+        if( sock >= 0 ) close( sock );
+        return -1;
+    }
+    return sock;
+}
+
+int main( int argc, char** argv ) {
+    const char *path =WEBQUERYD_SOCKET;
+    int port =WEBQUERYD_PORT;
+    long cache =WEBQUERYD_CACHE;
+    long threads =sysconf( _SC_NPROCESSORS_ONLN );
+    long helpers =threads;
+    for( int i =1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-s" ) == 0 && i+1 < argc ) {
+            path =argv[++i];
+            continue;
+        }
+        if( strcmp( argv[i], "-p" ) == 0 && i+1 < argc && ( port =atoi( argv[++i] ) ) >= 0 )
+            continue;
+        if( strcmp( argv[i], "-j" ) == 0 && i+1 < argc && ( threads =atoi( argv[++i] ) ) > 0 )
+            continue;
+        if( strcmp( argv[i], "-c" ) == 0 && i+1 < argc && ( cache =atol( argv[++i] ) ) >= 0 )
+            continue;
+        if( strcmp( argv[i], "-w" ) == 0 && i+1 < argc && ( helpers =atol( argv[++i] ) ) >= 0 )
+            continue;
+        if( strcmp( argv[i], "-t" ) == 0 ) {
+            timed =1;
+            continue;
+        }
+        show_help( *argv );
+        return 0;
+    }
+    if( threads < 1 ) threads =1;
+    if( threads > WEBQUERYD_MAX_THREADS ) threads =WEBQUERYD_MAX_THREADS;
+    signal( SIGPIPE, SIG_IGN );
+
+    if( query_open( &engine ) != 0 )
+        return -1;
+    query_cacheSize( &engine, (size_t)cache << 20, (size_t)WEBQUERYD_TERMCACHE << 20 );
+    if( helpers > WEBQUERYD_MAX_THREADS ) helpers =WEBQUERYD_MAX_THREADS;
+    if( query_threads( &engine, helpers ) != 0 ) {
+        query_close( &engine );
+        return -1;
+    }
+    asset_load( &assets[1], "muis.jpg" );
+
+    // Pages served by mongoose link to the images here as well
+    char imageurl[64];
+    if( port ) {
+        snprintf( imageurl, sizeof( imageurl ), "http://localhost:%d/image/", port );
+        engine.imageurl =imageurl;
+    }
+
+    if( ( epfd =epoll_create1( EPOLL_CLOEXEC ) ) < 0 ) {
+        fprintf( stderr, "epoll_create1(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    int usock =listen_unix( path );
+    if( usock < 0 || conn_add( usock, 1, 0 ) == NULL ) {
+        fprintf( stderr, "ERROR: can not listen on %s: %s\n", path, strerror( errno ) );
+        query_close( &engine );
+        return -1;
+    }
+    if( port ) {
+        int tsock =listen_tcp( port );
+        if( tsock < 0 || conn_add( tsock, 1, 1 ) == NULL ) {
+            fprintf( stderr, "ERROR: can not listen on port %d: %s\n", port, strerror( errno ) );
+            unlink( path );
+            query_close( &engine );
+            return -1;
+        }
+    }
+
+    pthread_t tid;
+    for( long i =0; i < threads; i++ ) {
+        if( pthread_create( &tid, NULL, worker, NULL ) != 0 ) {
+            fprintf( stderr, "pthread_create(): %s\n", strerror( errno ) );
+            return -1;
+        }
+    }
+    if( pthread_create( &tid, NULL, refresher, NULL ) != 0 ) {
+        fprintf( stderr, "pthread_create(): %s\n", strerror( errno ) );
+        return -1;
+    }
+    if( port )
+        fprintf( stderr, "Answering queries on http://localhost:%d/ and %s with %ld threads\n", port, path, threads );
+    else
+        fprintf( stderr, "Answering queries on %s with %ld threads\n", path, threads );
+
+    struct epoll_event events[WEBQUERYD_EVENTS];
+    time_t swept =time( NULL );
+    while( 1 ) {
+        int n =epoll_wait( epfd, events, WEBQUERYD_EVENTS, 1000 );
+        if( n < 0 && errno != EINTR ) {
+            fprintf( stderr, "epoll_wait(): %s\n", strerror( errno ) );
+            break;
+        }
+        for( int i =0; i < n; i++ ) {
+            conn_t *c =events[i].data.ptr;
+            if( c->listening ) {
+                accept_all( c );
+                continue;
+            }
+            pthread_mutex_lock( &conns_lock );
+            c->busy =1;
+            pthread_mutex_unlock( &conns_lock );
+            queue_push( c );
+        }
+        if( time( NULL ) != swept ) {
+            swept =time( NULL );
+            close_idle( );
+        }
+    }
+
+    unlink( path );
+    return 0;
+}
@@ -8,14 +8,15 @@
 #include <stdio.h> 
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <curl/curl.h>
 #include "htmlstreamparser.h"
 #include "index.h"
 
-static const char* title_undef ="Untitled";
-static const char* repotext_undef ="No description";
+static const char* title_undef =IDX_UNTITLED;
+static const char* repotext_undef =IDX_NODESCRIPTION;
 
-#define TITLE_MAXLEN 70
+#define TITLE_MAXLEN 70         // Of the titles in the document table, the repository keeps them whole
 
 #define TAG_IMG "img"
 #define TAG_IMG_LEN 3
@@ -31,9 +32,9 @@ static const char* repotext_undef ="No description";
 #define ATTR_SRC_LEN 3
 #define ATTR_ALT "alt"
 #define ATTR_ALT_LEN 3
+#define IMAGE_ALTS_MAXLEN 4096  // Alt texts kept of an image seen on many pages
 
 static size_t write_callback( char *buffer, size_t size, size_t nmemb, void *userp );
-static size_t write_callback_file( char *buffer, size_t size, size_t nmemb, void *userp );
 
 typedef struct {
     char *data;
@@ -125,27 +126,25 @@ make_absolute( char **buffer, const char* link, size_t length, const char* abs_u
     return entrylength;
 }
 
-size_t
-download_image( docid_t docid, const char* url ) {
+/* Download the image at `url' into the image store. Returns -1 on failure */
+static int
+download_image( docid_t docid, const char* url, packstore_t* store ) {
         
     int err =0;
-    char* docid_str =docid_tostr( docid );
-    FILE *file =index_open( IDX_IMAGES, docid_str, IDX_OPEN_WRITE );
-    free( docid_str );
-
-    if( file == NULL )
-        return -1;
+    dataptr_t dataptr;
+    dataptr_init( &dataptr );
 
     CURL *curl = curl_easy_init( );
 
     /* tell curl the URL address we are going to download */
     curl_easy_setopt( curl, CURLOPT_URL, url );
     
-    curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, write_callback_file );
+    curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, write_callback );
 
-    curl_easy_setopt( curl, CURLOPT_WRITEDATA, (void*)file );
+    curl_easy_setopt( curl, CURLOPT_WRITEDATA, (void*)&dataptr );
 
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L ); // ten second timeout
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L ); // timeouts must not use signals, we are threaded
     curl_easy_setopt(curl, CURLOPT_USERAGENT, "zoekmuis/1.0"); 
 
     /* Tell curl to perform the action */
@@ -157,18 +156,23 @@ download_image( docid_t docid, const char* url ) {
             fprintf( stderr, "`%s'\n", url );
             err = -1;
     } else {
-        char* buf;
-        curl_res = curl_easy_getinfo( curl, CURLINFO_CONTENT_TYPE, &buf );
+        // Only the signature is trusted, the content-type of the server is not: the
+        // images are served from the search site, where an SVG could run script
+        const char *type =index_imageType( dataptr.data, dataptr.size );
 
-        if( !buf || strncmp( buf, "image", 5 ) != 0 ) {
-            // Content-type doesn't match that of an image, probably 404 etc
-            index_remove( IDX_IMAGES, docid_str );
+        if( type == NULL || dataptr.size == 0 ) {
+            // Not an image we know, probably 404 etc
             err =-1;
-        }
+        } else if( index_appendImage( store, docid, type, dataptr.data, dataptr.size ) != 0 ) {
+            fprintf( stderr, "ERROR: could not store image `%s'\n", url );
+            err =-1;
+        } else if( index_exportImage( docid, dataptr.data, dataptr.size ) != 0 )
+            // Color searches do without it until the image is downloaded again
+            fprintf( stderr, "ERROR: could not export image `%s': %s\n", url, strerror( errno ) );
     }
 
     // Cleanup
-    fclose( file );
+    dataptr_free( &dataptr );
     curl_easy_cleanup(curl);
 
     return err;
@@ -195,6 +199,7 @@ get_webpage( char** buffer, char** effective_url, const char* url ) {
 
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L ); // ten second timeout
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L ); // timeouts must not use signals, we are threaded
     curl_easy_setopt(curl, CURLOPT_USERAGENT, "zoekmuis/1.0"); 
 
     /* Tell curl to perform the action */
@@ -227,8 +232,305 @@ get_webpage( char** buffer, char** effective_url, const char* url ) {
     return dataptr.size; // Will be 0 on failure
 }
 
+static char*
+copy_str( const char* str, size_t len ) {
+    char *copy =malloc( sizeof(char) * (len+1) );
+    if( copy == NULL ) return NULL;
+    memcpy( copy, str, len );
+    copy[len] =0;
+    return copy;
+}
+
+webspider_update_t*
+webspider_updateCreate( docid_t docid ) {
+    webspider_update_t *u =calloc( 1, sizeof( webspider_update_t ) );
+    if( u == NULL ) return NULL;
+    u->docid =docid;
+    u->crawled =time( NULL );
+    index_pageCreate( &u->terms, docid );
+    return u;
+}
+
+void
+webspider_imageFree( webspider_image_t* img ) {
+    free( img->src );
+    free( img->alt );
+    img->src =img->alt =NULL;
+}
+
+void
+webspider_updateFree( webspider_update_t* u ) {
+    index_pageFree( &u->terms );
+    for( size_t i =0; i < u->nlinks; i++ )
+        free( u->links[i].url );
+    for( size_t i =0; i < u->nimages; i++ )
+        webspider_imageFree( &u->images[i] );
+    free( u->links );
+    free( u->images );
+    free( u->url );
+    free( u->title );
+    free( u->text );
+    free( u );
+}
+
+static int
+update_addLink( webspider_update_t* u, docid_t docid, char* url, size_t len ) {
+    if( u->nlinks == u->linksize )
+        u->links =realloc( u->links, sizeof( webspider_link_t ) * (u->linksize =u->linksize*2 + 16) );
+    if( u->links == NULL )
+        return -1;
+    webspider_link_t *l =&u->links[u->nlinks++];
+    l->docid =docid;
+    l->url =url;
+    l->len =len;
+    return 0;
+}
+
+static int
+update_addImage( webspider_update_t* u, docid_t docid, char* src, char* alt ) {
+    if( u->nimages == u->imagesize )
+        u->images =realloc( u->images, sizeof( webspider_image_t ) * (u->imagesize =u->imagesize*2 + 4) );
+    if( u->images == NULL )
+        return -1;
+    webspider_image_t *img =&u->images[u->nimages++];
+    img->docid =docid;
+    img->src =src;
+    img->alt =alt;
+    return 0;
+}
+
+/* Add the alt texts of image `u' that are in the repository to its own and index
+   them all, so the image stays findable by the words of every page it was seen on.
+   Returns -1 on error */
+static int
+merge_alts( webspider_update_t* u, packstore_t* repo ) {
+    packstore_cache_t cache;
+    index_record_t rec;
+    packstore_cacheCreate( &cache );
+    if( index_readRepository( repo, &cache, u->docid, &rec ) != 0 || rec.title != NULL || rec.text == NULL ) {
+        packstore_cacheFree( &cache );
+        return 0;
+    }
+
+    // An alt text is kept once, so replaying the log does not add it again
+    int seen =u->text_len == 0;
+    const char *p =rec.text, *end =rec.text + rec.text_len;
+    while( p < end && !seen ) {
+        const char *nl =memchr( p, '\n', end - p );
+        size_t n =( nl ? nl : end ) - p;
+        seen =n == u->text_len && memcmp( p, u->text, n ) == 0;
+        p +=n + 1;
+    }
+    if( rec.text_len + 1 + u->text_len > IMAGE_ALTS_MAXLEN )
+        seen =1;
+
+    size_t len =rec.text_len;
+    char *text =malloc( len + 1 + u->text_len + 1 );
+    if( text == NULL ) {
+        packstore_cacheFree( &cache );
+        return -1;
+    }
+    memcpy( text, rec.text, len );
+    if( !seen ) {
+        text[len++] ='\n';
+        memcpy( text + len, u->text, u->text_len );
+        len +=u->text_len;
+    }
+    text[len] =0;
+    packstore_cacheFree( &cache );
+    free( u->text );
+    u->text =text;
+    u->text_len =len;
+
+    // The tokenizer works in place, so it gets a copy
+    char *copy =copy_str( text, len );
+    if( copy == NULL ) return -1;
+    index_pageFree( &u->terms );
+    index_pageCreate( &u->terms, u->docid );
+    int err =index_pageAddInner( &u->terms, IDX_IMAGEIDX, copy ) != 0 || index_pageFinish( &u->terms ) != 0 ? -1 : 0;
+    free( copy );
+    return err;
+}
+
+int
+webspider_store( webspider_update_t* u, segment_builder_t* seg, packstore_t* repo, doctable_t* docs ) {
+    int err =0;
+
+    // Only images have no title. Their keywords replace the earlier ones, so they
+    // have to include the earlier alt texts
+    if( u->title == NULL && merge_alts( u, repo ) != 0 ) {
+        fprintf( stderr, "ERROR: merging the alt texts of %Lx failed\n", (long long unsigned int)u->docid );
+        return -1;
+    }
+
+    if( ( err =segment_builderAddPage( seg, &u->terms ) ) != 0 ) {
+        fprintf( stderr, "ERROR: segment_builderAddPage() returned %d\n", err );
+        return err;
+    }
+
+    for( size_t i =0; i < u->nlinks; i++ )
+        index_appendLinkidx( u->links[i].docid, u->docid );
+
+    if( ( err =index_appendRepository( repo, u->docid, u->url, u->url_len, u->title, u->title_len, u->text, u->text_len ) ) != 0 ) {
+        fprintf( stderr, "ERROR: index_appendRepository() returned %d\n", err );
+        return err;
+    }
+
+    uint32_t doclen =0;
+    for( int idx =0; idx < IDX_FIELDS; idx++ )
+        doclen +=u->terms.wordpos[idx];
+    // Results show the title cut short, without splitting a character
+    size_t title_len =u->title_len;
+    if( title_len > TITLE_MAXLEN ) {
+        title_len =TITLE_MAXLEN;
+        while( title_len > 0 && ( (unsigned char)u->title[title_len] & 0xc0 ) == 0x80 )
+            title_len--;
+    }
+    if( ( err =doctable_put( docs, u->docid, u->url, u->url_len, u->title, title_len, doclen, u->crawled ) ) != 0 )
+        fprintf( stderr, "ERROR: doctable_put() returned %d\n", err );
+
+    return err;
+}
+
+int
+webspider_logUpdate( const webspider_update_t* u, wal_t* w ) {
+    const index_page_t *page =&u->terms;
+
+    wal_begin( w );
+    wal_putU64( w, u->docid );
+    wal_putStr( w, u->url, u->url_len );
+    wal_putStr( w, u->title, u->title_len );
+    wal_putStr( w, u->text, u->text_len );
+
+    wal_putU32( w, u->nlinks );
+    for( size_t i =0; i < u->nlinks; i++ ) {
+        wal_putU64( w, u->links[i].docid );
+        wal_putStr( w, u->links[i].url, u->links[i].len );
+    }
+
+    wal_putU32( w, page->nterms );
+    for( size_t i =0; i < page->nterms; i++ ) {
+        const index_pageterm_t *t =&page->terms[i];
+        wal_putStr( w, t->word, t->len );
+        wal_putU32( w, t->fields );
+        for( int idx =0; idx < IDX_FIELDS; idx++ ) {
+            if( !( t->fields & (1u << idx) ) )
+                continue;
+            wal_putU32( w, t->tf[idx] );
+            uint8_t *buf =wal_reserve( w, sizeof( uint32_t ) + IDX_POS_MAXBYTES( t->tf[idx] ) );
+            if( buf == NULL ) break;
+            uint32_t n =index_encodePositions( buf + sizeof( uint32_t ), t->pos[idx], t->tf[idx] );
+            memcpy( buf, &n, sizeof( uint32_t ) );
+            wal_extend( w, sizeof( uint32_t ) + n );
+        }
+    }
+    wal_putU64( w, u->crawled );
+    return wal_end( w );
+}
+
+webspider_update_t*
+webspider_decodeUpdate( const char* data, size_t len ) {
+    wal_reader_t r;
+    const char *str;
+    size_t n;
+    char *word =NULL;
+    uint32_t *pos =NULL;
+    size_t wordsize =0, possize =0;
+
+    wal_readerInit( &r, data, len );
+    webspider_update_t *u =webspider_updateCreate( wal_getU64( &r ) );
+    if( u == NULL ) return NULL;
+
+    if( wal_getStr( &r, &str, &n ) != 0 ) goto err;
+    if( str != NULL ) { u->url =copy_str( str, n ); u->url_len =n; }
+    if( wal_getStr( &r, &str, &n ) != 0 ) goto err;
+    if( str != NULL ) { u->title =copy_str( str, n ); u->title_len =n; }
+    if( wal_getStr( &r, &str, &n ) != 0 ) goto err;
+    if( str != NULL ) { u->text =copy_str( str, n ); u->text_len =n; }
+
+    uint32_t nlinks =wal_getU32( &r );
+    for( uint32_t i =0; i < nlinks && !r.err; i++ ) {
+        docid_t docid =wal_getU64( &r );
+        if( wal_getStr( &r, &str, &n ) != 0 || str == NULL ) goto err;
+        char *url =copy_str( str, n );
+        if( url == NULL || update_addLink( u, docid, url, n ) != 0 ) {
+            free( url );
+            goto err;
+        }
+    }
+
+    uint32_t nterms =wal_getU32( &r );
+    for( uint32_t i =0; i < nterms && !r.err; i++ ) {
+        if( wal_getStr( &r, &str, &n ) != 0 || str == NULL ) goto err;
+        if( n+1 > wordsize && ( word =realloc( word, wordsize =n+1 ) ) == NULL ) goto err;
+        memcpy( word, str, n );
+        word[n] =0;
+
+        uint32_t fields =wal_getU32( &r );
+        for( int idx =0; idx < IDX_FIELDS; idx++ ) {
+            if( !( fields & (1u << idx) ) )
+                continue;
+            uint32_t tf =wal_getU32( &r );
+            uint32_t poslen =wal_getU32( &r );
+            const char *buf =wal_get( &r, poslen );
+            if( buf == NULL ) goto err;
+            if( tf > possize && ( pos =realloc( pos, sizeof( uint32_t ) * (possize =tf) ) ) == NULL ) goto err;
+            if( index_decodePositions( pos, tf, (const uint8_t*)buf, poslen ) != tf ) goto err;
+            for( uint32_t k =0; k < tf; k++ )
+                if( index_pageAddAt( &u->terms, idx, word, pos[k] ) != 0 ) goto err;
+        }
+    }
+    // Logs written before the crawl time was recorded end here
+    if( r.p != r.end )
+        u->crawled =wal_getU64( &r );
+    if( r.err || r.p != r.end || index_pageFinish( &u->terms ) != 0 )
+        goto err;
+
+    free( word );
+    free( pos );
+    return u;
+
+err:
+    free( word );
+    free( pos );
+    webspider_updateFree( u );
+    return NULL;
+}
+
+webspider_update_t*
+webspider_fetchImage( const webspider_image_t* img, packstore_t* store ) {
+    if( download_image( img->docid, img->src, store ) != 0 )
+        return NULL;
+
+    webspider_update_t *u =webspider_updateCreate( img->docid );
+    if( u == NULL ) return NULL;
+    if( img->alt ) {
+        // The repository keeps one alt text per line
+        u->text_len =strlen( img->alt );
+        u->text =copy_str( img->alt, u->text_len );
+        char *alt =copy_str( img->alt, u->text_len );
+        if( u->text == NULL || alt == NULL ) {
+            free( alt );
+            webspider_updateFree( u );
+            return NULL;
+        }
+        for( size_t i =0; i < u->text_len; i++ )
+            if( u->text[i] == '\n' || u->text[i] == '\r' )
+                u->text[i] =alt[i] =' ';
+        index_pageAddInner( &u->terms, IDX_IMAGEIDX, alt );
+        free( alt );
+    }
+    if( index_pageFinish( &u->terms ) != 0 ) {
+        webspider_updateFree( u );
+        return NULL;
+    }
+    u->url_len =strlen( img->src );
+    u->url =copy_str( img->src, u->url_len );
+    return u;
+}
+
 size_t
-parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* abs_url, queue_t* q ) {
+parse_webpage( char* htmlpage, size_t length, const char* abs_url, webspider_update_t* u ) {
 
 
 	/*a pointer to the HTMLSTREAMPARSER structure and initialization*/
@@ -249,6 +551,7 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
         int count =0;                   // number of links found
         size_t title_len =0;            // length of the title (if any)
         const char *title =NULL;              // pointer to title string (if any)
+        index_pageAddUrl( &u->terms, abs_url, strlen( abs_url ) );
 
 	for ( int i = 0; i < length; i++) 
 	{             
@@ -266,16 +569,11 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
                                     if( !len ) continue;
                                     docid_t docid =docid_make( buffer, len );
 
-                                    int err;
-                                    if( err = queue_push( q, buffer, len, docid )
-                                            != 0 ) {
+                                    if( update_addLink( u, docid, buffer, len ) != 0 ) {
                                         free( buffer );
-                                        return err;
+                                        return -1;
                                     }
-
-                                    index_appendLinkidx( docid, base_docid );
                                     //fprintf( stderr, "--- Website HREF: %s\n", buffer );
-                                    free( buffer );
                                     count++;
 				}
                 }
@@ -320,17 +618,12 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
                         i++;
                     }
                     if( img_src ) {
-                       if( download_image( docid, img_src ) == 0 ) {
-                            if( !img_alt && title ) {
-                                img_alt =malloc( sizeof(char) * (title_len+1) );
-                                memcpy( img_alt, title, title_len);
-                                img_alt[title_len] =0;
-                            }
-                            //printf( "+++ Image: src `%s', alt `%s'\n", img_src, img_alt );
-                            if( img_alt )
-                                index_appendHtmlInner( IDX_IMAGEIDX, docid, img_alt );
-                            index_appendRepository( docid, img_src, strlen( img_src ), NULL, 0L, NULL, 0L );
-                        }
+                        if( !img_alt && title )
+                            img_alt =copy_str( title, title_len );
+                        //printf( "+++ Image: src `%s', alt `%s'\n", img_src, img_alt );
+                        // The image is downloaded and indexed later on
+                        if( update_addImage( u, docid, img_src, img_alt ) == 0 )
+                            img_src =img_alt =NULL;
                     }
                     if( img_src ) free( img_src );
                     if( img_alt ) free( img_alt );
@@ -355,7 +648,7 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
                         }
 
 
-                        index_appendHtmlInner( IDX_TITLEIDX, base_docid, title_trim );
+                        index_pageAddInner( &u->terms, IDX_TITLEIDX, title_trim );
                        // html_parser_release_inner_text_buffer(hsp);
                     }
                 }
@@ -380,7 +673,7 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
                             text[text_len] =0;
                         }
                         
-                        index_appendHtmlInner( IDX_PAGEIDX, base_docid, text );
+                        index_pageAddInner( &u->terms, IDX_PAGEIDX, text );
 
                 }
                       
@@ -393,9 +686,6 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
         if( title == NULL ) {
             title =title_undef;
             title_len =strlen( title_undef );
-        } else {
-            if( title_len > TITLE_MAXLEN )
-                title_len =TITLE_MAXLEN;
         }
         const char *repotext_str; size_t repotext_len;
         if( repotext.size == 0 ) {
@@ -405,13 +695,17 @@ parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* ab
             repotext_str =repotext.data;
             repotext_len =repotext.size;
         }
-        int err =0;
-
-        if( ( err =index_appendRepository( base_docid, abs_url, strlen(abs_url), title, title_len, repotext_str, repotext_len ) ) != 0 ) {
-            fprintf( stderr, "ERROR: index_appendRepository() returned %d\n", err );
-            count =err;
-        }
-         
+        // Hand the keywords to the index writer in one piece
+        if( index_pageFinish( &u->terms ) != 0 )
+            count =-1;
+
+        // The repository record is written together with the keywords
+        u->url_len =strlen( abs_url );
+        u->url =copy_str( abs_url, u->url_len );
+        u->title =copy_str( title, title_len );
+        u->title_len =title_len;
+        u->text =copy_str( repotext_str, repotext_len );
+        u->text_len =repotext_len;
 
         dataptr_free( &repotext );
         if( title != title_undef ) free( (char*)title );
@@ -434,18 +728,3 @@ write_callback( char *buffer, size_t size, size_t nmemb, void *userp )
 
     return realsize;
 } 
-
-static size_t 
-write_callback_file( char *buffer, size_t size, size_t nmemb, void *userp )
-{
-    FILE* file =(FILE*) userp;
-    if( file == NULL )
-        return 0L;
-
-    if( fwrite( buffer, size, nmemb, file ) != nmemb ) {
-        fprintf( stderr, "write_callback_file(): %s\n",strerror( errno ) );
-        return 0L;
-    }
-
-    return size*nmemb;
-} 
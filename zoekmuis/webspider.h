@@ -12,6 +12,9 @@
 #include <stdio.h> 
 #include <string.h>
 #include "queue.h"
+#include "segment.h"
+#include "wal.h"
+#include "doctable.h"
 
 /* Given a link and an absolute base url, return a new string that contains the full absolute path.
    `link' may or may not be null-terminated and its length should be specified through `length'
@@ -29,11 +32,67 @@ make_absolute( char **buffer, const char* link, size_t length, const char* abs_u
 size_t
 get_webpage( char** buffer, char** effective_url, const char* url );
 
-/* Given a htmlpage, parse and index the complete page.
+/* A link found on a page */
+typedef struct {
+    docid_t docid;
+    char *url;
+    size_t len;
+} webspider_link_t;
+
+/* An image found on a page, it is downloaded and indexed separately */
+typedef struct {
+    docid_t docid;
+    char *src;
+    char *alt;                  // Alternative text, may be NULL
+} webspider_image_t;
+
+/* Everything that has to be stored for a single document */
+typedef struct {
+    docid_t docid;
+    index_page_t terms;
+    webspider_link_t *links;
+    size_t nlinks, linksize;
+    webspider_image_t *images;
+    size_t nimages, imagesize;
+    char *url, *title, *text;   // Repository record, images have no title and their alt as text
+    size_t url_len, title_len, text_len;
+    int64_t crawled;            // Time of the download
+} webspider_update_t;
+
+webspider_update_t*
+webspider_updateCreate( docid_t docid );
+
+void
+webspider_updateFree( webspider_update_t* u );
+
+void
+webspider_imageFree( webspider_image_t* img );
+
+/* Store the keywords, link edges, repository record and metadata of `u' */
+int
+webspider_store( webspider_update_t* u, segment_builder_t* seg, packstore_t* repo, doctable_t* docs );
+
+/* Append `u' to the write-ahead log as a single record. The page must be finished.
+   Returns -1 on error */
+int
+webspider_logUpdate( const webspider_update_t* u, wal_t* w );
+
+/* Restore an update from a record of the write-ahead log, or return NULL if the
+   record is malformed */
+webspider_update_t*
+webspider_decodeUpdate( const char* data, size_t len );
+
+/* Download `img' into the image store `store' and return the update that indexes it,
+   or NULL on failure */
+webspider_update_t*
+webspider_fetchImage( const webspider_image_t* img, packstore_t* store );
+
+/* Given a htmlpage, parse the complete page into `u'.
+   Links and images are collected in `u', nothing is stored yet.
+   Returns the number of links found or a negative value on error.
    */
 size_t
-parse_webpage( docid_t base_docid, char* htmlpage, size_t length, const char* abs_url, queue_t* q );
+parse_webpage( char* htmlpage, size_t length, const char* abs_url, webspider_update_t* u );
 
 
 #endif
-